@@ -43,7 +43,13 @@
 #include <assert.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <fcntl.h>
 #include <sys/param.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "hostlist.h"
@@ -98,7 +104,11 @@
 #define MAX_RANGE    16384    /* 16K Hosts */
 
 /* max host suffix value */
-#define MAX_HOST_SUFFIX 1<<25
+#define MAX_HOST_SUFFIX (1<<25)
+
+/* max width of a numeric suffix read from a binary dump or database
+ * image: no hostname is longer than 255 characters */
+#define MAX_SUFFIX_WIDTH 255
 
 /* max number of ranges that will be processed between brackets */
 #define MAX_RANGES    10240    /* 10K Ranges */
@@ -112,6 +122,36 @@
 /* max size of internal hostrange buffer */
 #define MAXHOSTRANGELEN 1024
 
+/* number of ranges whose prefixes are measured by hostlist_memsize() */
+#define HOSTLIST_MEMSIZE_SAMPLE 16
+
+/* size of staging buffer used by hostlist_write() and hostlist_fwrite() */
+#define HOSTLIST_WRITE_BUFSIZ 65536
+
+/* number of host insertions/deletions remembered for repositioning
+ * iterators which have fallen behind the hostlist */
+#define HOSTLIST_EDIT_LOG 16
+
+/* a hostlist is compacted when at least HOSTLIST_COMPACT_MIN of its
+ * ranges could be joined with their neighbour, and the number of
+ * ranges is HOSTLIST_COMPACT_RATIO times the number it would have
+ * left (see hostlist_set_compact_ratio()) */
+#define HOSTLIST_COMPACT_MIN    64
+#define HOSTLIST_COMPACT_RATIO  2.0
+
+/* least number of ranges appended to a hostset before they are merged
+ * into the set (see hostset_append()) */
+#define HOSTSET_LOG_MIN   256
+
+/* max number of digits in a hostname suffix for set operations on
+ * whole ranges, such that any suffix fits in an unsigned long */
+#define HOSTSPAN_MAX_DIGITS (sizeof(unsigned long) >= 8 ? 18 : 9)
+
+/* max number of threads used by one hostlist operation, and the least
+ * amount of work (ranges) worth handing to each thread */
+#define HOSTLIST_MAX_THREADS    16
+#define HOSTLIST_PARALLEL_MIN   4096
+
 /* ----[ Internal Data Structures ]---- */
 
 /* hostname type: A convenience structure used in parsing single hostnames */
@@ -144,6 +184,83 @@ struct hostrange_components {
 
 typedef struct hostrange_components *hostrange_t;
 
+/* hostlist edit: delta hosts were inserted (delta > 0) or deleted
+ * (delta < 0) at host position pos when hostlist epoch became epoch */
+struct hostlist_edit {
+    unsigned long epoch;
+    int pos;
+    int delta;
+};
+
+/* find index entry of a frozen hostlist. Ranges are sorted by key,
+ * the prefix of their hostnames without trailing digits, and then by
+ * lo. Ranges which a hostname cannot be matched against by suffix alone
+ * (single hosts and prefixes ending in digits) have `any' set and sort
+ * first within their key. maxhi is the largest hi of this and all
+ * earlier entries with the same key which do not have `any' set.
+ */
+struct hostlist_key {
+    const char   *key;
+    size_t        len;      /* length of key                            */
+    int           any;
+    int           idx;      /* index of the range in hl->hr[]           */
+    unsigned long lo;
+    unsigned long maxhi;
+};
+
+/* hostspan: the hostnames key + n, for lo <= n <= hi, where n is
+ * written as a len digit zero padded decimal number. key is a hostname
+ * prefix without trailing digits. A hostname without a numeric suffix
+ * is a span with len 0 and key the whole name.
+ *
+ * Unlike hostranges, two spans contain the same hostname only if
+ * they have the same key and len, so set operations can work on spans
+ * a range of hosts at a time. key points into the prefix of the range
+ * the span was taken from, hl->hr[idx].
+ */
+struct hostspan {
+    const char   *key;
+    size_t        klen;     /* length of key                            */
+    int           len;
+    int           idx;
+    unsigned long lo, hi;
+};
+
+/* a growable array of hostspans */
+struct hostspans {
+    struct hostspan *s;
+    size_t           n;
+    size_t           size;
+};
+
+/* hostname generator: A buffer holding a hostrange prefix followed by
+ * a zero padded decimal suffix. The suffix is incremented in place, so
+ * successive hostnames in a range may be produced without reformatting
+ * the prefix or the number on every host.
+ */
+struct hostname_gen {
+    char         *name;     /* prefix + suffix, NUL terminated          */
+    size_t        plen;     /* length of prefix                         */
+    size_t        len;      /* current length of name                   */
+    unsigned long num;      /* current value of numeric suffix          */
+
+    /* inline storage used for name when the hostname is short enough */
+    char          buf[MAXHOSTNAMELEN + 32];
+};
+
+/* hostlist writer: output is staged in buf, and passed to the flush
+ * function whenever buf fills. Data too large for the staging buffer is
+ * passed to flush along with the staged data in a single call.
+ */
+struct hostlist_writer {
+    int (*flush)(struct hostlist_writer *, struct iovec *, int);
+    int     fd;             /* output file descriptor (hostlist_write)  */
+    FILE   *fp;             /* output stream (hostlist_fwrite)          */
+    size_t  len;            /* number of bytes currently staged in buf  */
+    size_t  total;          /* total number of bytes written            */
+    char    buf[HOSTLIST_WRITE_BUFSIZ];
+};
+
 /* The hostlist type: An array based list of hostrange_t's */
 struct hostlist {
 #ifndef NDEBUG
@@ -151,7 +268,10 @@ struct hostlist {
     int magic;
 #endif
 #if    WITH_PTHREADS
-    pthread_mutex_t mutex;
+    pthread_rwlock_t lock;
+
+    /* sequence count for lockless reads of nhosts and nranges */
+    unsigned long seq;
 #endif                /* WITH_PTHREADS */
 
     /* current number of elements available in array */
@@ -169,12 +289,151 @@ struct hostlist {
     /* list of iterators */
     struct hostlist_iterator *ilist;
 
+    /* modification count. Iterators compare this against the epoch
+     * they last saw instead of being patched by every modification */
+    unsigned long epoch;
+
+    /* epoch of the last reordering of hosts (sort, uniq), which
+     * sends all older iterators back to the start of the list */
+    unsigned long reset_epoch;
+
+    /* ring of recent host insertions and deletions, and the epoch
+     * of the newest edit that has dropped out of the ring */
+    struct hostlist_edit edits[HOSTLIST_EDIT_LOG];
+    unsigned long nedits;
+    unsigned long lost_epoch;
+
+    /* count index: cum[n] is the number of hosts in hr[0] .. hr[n-1].
+     * Entries cum[0] .. cum[ncum] are valid. Modifications lower ncum,
+     * and the next lookup which needs the index completes it again.
+     * csize is the allocated length of cum, which only changes while
+     * the write lock is held. cbusy is set by the reader completing
+     * the index. */
+    int *cum;
+    int ncum;
+    int csize;
+    int cbusy;
+
+    /* A frozen hostlist (see hostlist_freeze()) is never modified, so
+     * it is read without locking and shared by reference count. Its
+     * ranges and prefixes are stored in the single allocation block,
+     * and keys indexes the ranges by name for hostlist_find(). */
+    int frozen;
+    int refcnt;
+    void *block;
+    struct hostlist_key *keys;
+
+    /* database whose image holds the prefixes and count index of a
+     * frozen list (see hostlist_db_get()), or NULL */
+    struct hostlist_db *db;
+
+    /* estimated number of ranges which continue the range before
+     * them, left by deletions and insertions, the number of times
+     * the list was compacted automatically because of them, and the
+     * ratio that triggers compaction (see hostlist_set_compact_ratio()) */
+    int njoinable;
+    unsigned long ncompact;
+    double compact_ratio;
+
+    /* Copies of a hostlist share its ranges and count index through
+     * base, a frozen list holding them, until either list is modified
+     * (see hostlist_copy()). NULL if hl owns its ranges. */
+    hostlist_t base;
 };
 
 
-/* a hostset is a wrapper around a hostlist */
+/* a hostset is a wrapper around a hostlist. Hosts added with
+ * hostset_append() are collected unsorted in log, protected by the
+ * lock of hl, until they are merged into hl. */
 struct hostset {
     hostlist_t hl;
+    hostlist_t log;
+
+    /* nonzero if hl may hold ranges of one prefix with different
+     * widths, whose hosts cannot be told apart by number alone */
+    int mixed;
+
+    /* the hosts of log as sorted ranges without gaps, and the number
+     * of hosts in log but not in hl as of epoch lepoch of hl. nlog is
+     * not kept up to date once lmixed is set, until the log is merged */
+    hostrange_t *spans;
+    int nspans;
+    int spansize;
+    long nlog;
+    int lmixed;
+    unsigned long lepoch;
+};
+
+/* hostlist builder shard: the ranges pushed by a single thread. Only
+ * that thread touches a shard until hostlist_builder_finish(), so
+ * shards are not locked. */
+struct hostlist_shard {
+    struct hostlist_shard *next;
+    hostrange_t *hr;
+    int size;
+    int nranges;
+    int nhosts;
+};
+
+/* hostlist builder: a list of shards, one per pushing thread, found
+ * through a thread specific key and added to the list without locking. */
+struct hostlist_builder {
+#if    WITH_PTHREADS
+    pthread_key_t key;
+#endif
+    struct hostlist_shard *shards;
+};
+
+/* hostlist database image (see hostlist_db_build()). All offsets are
+ * from the start of the image, which ends in a NUL byte so that every
+ * string offset within it is NUL terminated. The image is used in
+ * place and never modified, so it contains no pointers, and integers
+ * are in host byte order (checked through byteorder).
+ */
+#define HOSTLIST_DB_MAGIC      "HLDB"
+#define HOSTLIST_DB_VERSION    1
+#define HOSTLIST_DB_BYTEORDER  0x01020304
+
+struct hostlist_db_header {
+    char     magic[4];
+    uint32_t version;
+    uint32_t byteorder;
+    uint32_t ngroups;
+    uint64_t size;          /* length of the image                      */
+    uint64_t groups;        /* offset of ngroups groups, sorted by name */
+};
+
+struct hostlist_db_group {
+    uint64_t name;          /* offset of the group name                 */
+    uint64_t ranges;        /* offset of nranges ranges                 */
+    uint64_t cum;           /* offset of nranges + 1 host counts        */
+    uint32_t nranges;
+    uint32_t pad;
+};
+
+struct hostlist_db_range {
+    uint64_t lo, hi;
+    uint64_t prefix;        /* offset of the prefix                     */
+    int32_t  width;         /* -1 for a single host without suffix      */
+    uint32_t pad;
+};
+
+/* an open hostlist database. Hostlists taken from it point into the
+ * image and hold a reference to the database. */
+struct hostlist_db {
+    const char *image;
+    size_t len;
+    int mapped;             /* image was mapped by hostlist_db_open()   */
+    int refcnt;
+    const struct hostlist_db_header *hdr;
+    const struct hostlist_db_group *groups;
+};
+
+/* a k-ary fanout tree over the positions of a frozen hostlist */
+struct hostlist_tree {
+    hostlist_t hl;
+    int k;
+    int depth;
 };
 
 struct hostlist_iterator {
@@ -193,8 +452,15 @@ struct hostlist_iterator {
     /* current depth we've traversed into range hr */
     int depth;
 
-    /* next ptr for lists of iterators */
+    /* position in hl of the current host (-1 before the first host) */
+    int pos;
+
+    /* value of hl->epoch when idx, hr and depth were last valid */
+    unsigned long epoch;
+
+    /* next and prev ptrs for lists of iterators */
     struct hostlist_iterator *next;
+    struct hostlist_iterator *prev;
 };
 
 
@@ -205,6 +471,8 @@ struct hostlist_iterator {
 static void _error(char *file, int line, char *mesg, ...);
 static char * _next_tok(char *, char **);
 static int    _zero_padded(unsigned long, int);
+static int    _ndigits(unsigned long);
+static int    _numstr(char *, unsigned long, int);
 static int    _width_equiv(unsigned long, int *, unsigned long, int *);
 
 static int           host_prefix_end(const char *);
@@ -224,14 +492,20 @@ static int           hostrange_cmp(hostrange_t, hostrange_t);
 static int           hostrange_prefix_cmp(hostrange_t, hostrange_t);
 static int           hostrange_within_range(hostrange_t, hostrange_t);
 static int           hostrange_width_combine(hostrange_t, hostrange_t);
+static int           hostrange_adjacent(hostrange_t, hostrange_t);
 static int           hostrange_empty(hostrange_t);
 static char *        hostrange_pop(hostrange_t);
 static char *        hostrange_shift(hostrange_t);
 static int           hostrange_join(hostrange_t, hostrange_t);
-static hostrange_t   hostrange_intersect(hostrange_t, hostrange_t);
 static int           hostrange_hn_within(hostrange_t, hostname_t);
 static size_t        hostrange_to_string(hostrange_t hr, size_t, char *, char *);
 static size_t        hostrange_numstr(hostrange_t, size_t, char *);
+static char *        hostrange_host(hostrange_t, unsigned long);
+
+static int           hostname_gen_init(struct hostname_gen *, hostrange_t,
+                                       unsigned long);
+static void          hostname_gen_incr(struct hostname_gen *);
+static void          hostname_gen_fini(struct hostname_gen *);
 
 static hostlist_t  hostlist_new(void);
 static hostlist_t _hostlist_create_bracketed(const char *, char *, char *);
@@ -242,81 +516,191 @@ static int         hostlist_push_hr(hostlist_t, char *, unsigned long,
                                     unsigned long, int);
 static int         hostlist_insert_range(hostlist_t, hostrange_t, int);
 static void        hostlist_delete_range(hostlist_t, int n);
-static void        hostlist_coalesce(hostlist_t hl);
-static void        hostlist_collapse(hostlist_t hl);
 static hostlist_t _hostlist_create(const char *, char *, char *);
-static void        hostlist_shift_iterators(hostlist_t, int, int, int);
+static void       _hostlist_touch(hostlist_t, int);
+static void       _hostlist_edit(hostlist_t, int, int);
+static void       _hostlist_reorder(hostlist_t);
+static void       _hostlist_index(hostlist_t);
+static void       _hostlist_index_reserve(hostlist_t);
+static void       _hostlist_index_complete(hostlist_t);
+static void       _hostlist_autocompact(hostlist_t);
+static int        _hostlist_own(hostlist_t);
+static int        _hostlist_offset(hostlist_t, int);
+static int        _hostlist_range_at(hostlist_t, int);
+static int        _hostlist_find(hostlist_t, hostname_t);
+static int        _hostlist_find_key(hostlist_t, hostname_t);
 static int        _attempt_range_join(hostlist_t, int);
 static int        _is_bracket_needed(hostlist_t, int);
+static ssize_t    _hostlist_write(hostlist_t, struct hostlist_writer *,
+                                  int, const char *);
 
 static hostlist_iterator_t hostlist_iterator_new(void);
+static void               _iterator_sync(hostlist_iterator_t);
+static void               _iterator_set_pos(hostlist_iterator_t, int);
 static void               _iterator_advance(hostlist_iterator_t);
+static void               _iterator_retreat(hostlist_iterator_t);
 static void               _iterator_advance_range(hostlist_iterator_t);
 
 static int hostset_find_host(hostset_t, const char *);
+static void hostset_flush(hostset_t);
+static void _hostset_check_widths(hostset_t);
+static void _hostset_log_reset(hostset_t);
 
 /* ------[ macros ]------ */
 
 #ifdef WITH_PTHREADS
-#  define mutex_init(mutex)                                                  \
+#  define rwlock_init(lock)                                                  \
      do {                                                                    \
-        int e = pthread_mutex_init(mutex, NULL);                             \
+        int e = pthread_rwlock_init(lock, NULL);                             \
         if (e) {                                                             \
             errno = e;                                                       \
-            lsd_fatal_error(__FILE__, __LINE__, "hostlist mutex init:");     \
+            lsd_fatal_error(__FILE__, __LINE__, "hostlist rwlock init:");    \
             abort();                                                         \
         }                                                                    \
      } while (0)
 
-#  define mutex_lock(mutex)                                                  \
+#  define rwlock_rdlock(lock)                                                \
+     do {                                                                    \
+        int e = pthread_rwlock_rdlock(lock);                                 \
+        if (e) {                                                             \
+           errno = e;                                                        \
+           lsd_fatal_error(__FILE__, __LINE__, "hostlist rwlock rdlock:");   \
+           abort();                                                          \
+        }                                                                    \
+     } while (0)
+
+#  define rwlock_wrlock(lock)                                                \
      do {                                                                    \
-        int e = pthread_mutex_lock(mutex);                                   \
+        int e = pthread_rwlock_wrlock(lock);                                 \
         if (e) {                                                             \
            errno = e;                                                        \
-           lsd_fatal_error(__FILE__, __LINE__, "hostlist mutex lock:");      \
+           lsd_fatal_error(__FILE__, __LINE__, "hostlist rwlock wrlock:");   \
            abort();                                                          \
         }                                                                    \
      } while (0)
 
-#  define mutex_unlock(mutex)                                                \
+#  define rwlock_unlock(lock)                                                \
      do {                                                                    \
-        int e = pthread_mutex_unlock(mutex);                                 \
+        int e = pthread_rwlock_unlock(lock);                                 \
         if (e) {                                                             \
             errno = e;                                                       \
-            lsd_fatal_error(__FILE__, __LINE__, "hostlist mutex unlock:");   \
+            lsd_fatal_error(__FILE__, __LINE__, "hostlist rwlock unlock:");  \
             abort();                                                         \
         }                                                                    \
      } while (0)
 
-#  define mutex_destroy(mutex)                                               \
+#  define rwlock_destroy(lock)                                               \
      do {                                                                    \
-        int e = pthread_mutex_destroy(mutex);                                \
+        int e = pthread_rwlock_destroy(lock);                                \
         if (e) {                                                             \
             errno = e;                                                       \
-            lsd_fatal_error(__FILE__, __LINE__, "hostlist mutex destroy:");  \
+            lsd_fatal_error(__FILE__, __LINE__, "hostlist rwlock destroy:"); \
             abort();                                                         \
         }                                                                    \
      } while (0)
 
+/* The sequence count of a hostlist is odd while a writer holds the
+ * lock, so small fields like nhosts may be read without locking by
+ * retrying the read if the count was odd or has changed.
+ */
+#  define seq_write_begin(_hl)                                               \
+     do {                                                                    \
+        __atomic_store_n(&(_hl)->seq, (_hl)->seq + 1, __ATOMIC_RELAXED);     \
+        __atomic_thread_fence(__ATOMIC_RELEASE);                             \
+     } while (0)
+
+#  define seq_write_end(_hl)                                                 \
+        __atomic_store_n(&(_hl)->seq, (_hl)->seq + 1, __ATOMIC_RELEASE)
+
+#  define seq_read_begin(_hl)                                                \
+        __atomic_load_n(&(_hl)->seq, __ATOMIC_ACQUIRE)
+
+#  define seq_read_field(_hl, _field)                                        \
+        __atomic_load_n(&(_hl)->_field, __ATOMIC_RELAXED)
+
+#  define seq_read_retry(_hl, _seq)                                          \
+        (((_seq) & 1)                                                        \
+         || (__atomic_thread_fence(__ATOMIC_ACQUIRE),                        \
+             __atomic_load_n(&(_hl)->seq, __ATOMIC_RELAXED) != (_seq)))
+
+#  define refcnt_incr(_cnt)   __atomic_add_fetch(_cnt, 1, __ATOMIC_RELAXED)
+#  define refcnt_decr(_cnt)   __atomic_sub_fetch(_cnt, 1, __ATOMIC_ACQ_REL)
+#  define refcnt_get(_cnt)    __atomic_load_n(_cnt, __ATOMIC_ACQUIRE)
+
+/* Readers holding the lock for reading may extend the count index of a
+ * hostlist. One of them at a time does so, and publishes the new valid
+ * length with ncum_set() once the entries are written.
+ */
+#  define ncum_get(_hl)       __atomic_load_n(&(_hl)->ncum, __ATOMIC_ACQUIRE)
+#  define ncum_set(_hl, _n)                                                  \
+        __atomic_store_n(&(_hl)->ncum, _n, __ATOMIC_RELEASE)
+#  define cum_trylock(_hl)                                                   \
+        (!__atomic_exchange_n(&(_hl)->cbusy, 1, __ATOMIC_ACQUIRE))
+#  define cum_unlock(_hl)                                                    \
+        __atomic_store_n(&(_hl)->cbusy, 0, __ATOMIC_RELEASE)
+
 #else                /* !WITH_PTHREADS */
 
-#  define mutex_init(mutex)
-#  define mutex_lock(mutex)
-#  define mutex_unlock(mutex)
-#  define mutex_destroy(mutex)
+#  define rwlock_init(lock)
+#  define rwlock_rdlock(lock)
+#  define rwlock_wrlock(lock)
+#  define rwlock_unlock(lock)
+#  define rwlock_destroy(lock)
+
+#  define seq_write_begin(_hl)
+#  define seq_write_end(_hl)
+#  define seq_read_begin(_hl)           0
+#  define seq_read_field(_hl, _field)   ((_hl)->_field)
+#  define seq_read_retry(_hl, _seq)     ((void) (_seq), 0)
+
+#  define refcnt_incr(_cnt)             (++(*(_cnt)))
+#  define refcnt_decr(_cnt)             (--(*(_cnt)))
+#  define refcnt_get(_cnt)              (*(_cnt))
+
+#  define ncum_get(_hl)                 ((_hl)->ncum)
+#  define ncum_set(_hl, _n)             ((_hl)->ncum = (_n))
+#  define cum_trylock(_hl)              1
+#  define cum_unlock(_hl)
 
 #endif                /* WITH_PTHREADS */
 
+/* LOCK_HOSTLIST() takes the hostlist lock for writing. Functions which
+ * only read the list use RDLOCK_HOSTLIST() so they may run concurrently.
+ * Dropping the write lock makes room for the count index, which is
+ * filled in by the next lookup that uses it, so a run of modifications
+ * does not pay for rebuilding it each time. Frozen hostlists are read
+ * without locking.
+ */
 #define LOCK_HOSTLIST(_hl)                                                   \
       do {                                                                   \
           assert(_hl != NULL);                                               \
-          mutex_lock(&(_hl)->mutex);                                         \
+          rwlock_wrlock(&(_hl)->lock);                                       \
+          seq_write_begin(_hl);                                              \
           assert((_hl)->magic == HOSTLIST_MAGIC);                            \
       } while (0)
 
 #define UNLOCK_HOSTLIST(_hl)                                                 \
       do {                                                                   \
-          mutex_unlock(&(_hl)->mutex);                                       \
+          _hostlist_autocompact(_hl);                                        \
+          _hostlist_index_reserve(_hl);                                      \
+          seq_write_end(_hl);                                                \
+          rwlock_unlock(&(_hl)->lock);                                       \
+      } while (0)
+
+#define RDLOCK_HOSTLIST(_hl)                                                 \
+      do {                                                                   \
+          assert(_hl != NULL);                                               \
+          if (!(_hl)->frozen) {                                              \
+              rwlock_rdlock(&(_hl)->lock);                                   \
+          }                                                                  \
+          assert((_hl)->magic == HOSTLIST_MAGIC);                            \
+      } while (0)
+
+#define RDUNLOCK_HOSTLIST(_hl)                                               \
+      do {                                                                   \
+          if (!(_hl)->frozen) {                                              \
+              rwlock_unlock(&(_hl)->lock);                                   \
+          }                                                                  \
       } while (0)
 
 #define seterrno_ret(_errno, _rc)                                            \
@@ -325,6 +709,13 @@ static int hostset_find_host(hostset_t, const char *);
           return _rc;                                                        \
       } while (0)
 
+/* Functions which modify a hostlist fail with EPERM on frozen lists */
+#define CHECK_MUTABLE(_hl, _rc)                                              \
+      do {                                                                   \
+          if ((_hl)->frozen)                                                 \
+              seterrno_ret(EPERM, _rc);                                      \
+      } while (0)
+
 /* ------[ Function Definitions ]------ */
 
 /* ----[ general utility functions ]---- */
@@ -403,6 +794,40 @@ static int _zero_padded(unsigned long num, int width)
     return width > n ? width - n : 0;
 }
 
+/* return the number of decimal digits in "num"
+ */
+static int _ndigits(unsigned long num)
+{
+    int n = 1;
+    while (num >= 10) {
+        num /= 10;
+        n++;
+    }
+    return n;
+}
+
+/* write "num" zero padded to "width" in decimal into buf. buf must have
+ * room for at least MAX(width, _ndigits(num)) chars. No NUL terminator is
+ * written. Returns the number of chars written.
+ */
+static int _numstr(char *buf, unsigned long num, int width)
+{
+    char tmp[32];
+    char *p = tmp + sizeof(tmp);
+    int n, pad;
+
+    do {
+        *--p = '0' + (num % 10);
+        num /= 10;
+    } while (num);
+
+    n = (tmp + sizeof(tmp)) - p;
+    pad = width > n ? width - n : 0;
+    memset(buf, '0', pad);
+    memcpy(buf + pad, p, n);
+    return pad + n;
+}
+
 /* test whether two format `width' parameters are "equivalent"
  * The width arguments "wn" and "wm" for integers "n" and "m"
  * are equivalent if:
@@ -759,6 +1184,16 @@ static int hostrange_width_combine(hostrange_t h0, hostrange_t h1)
     return _width_equiv(h0->lo, &h0->width, h1->lo, &h1->width);
 }
 
+/* returns true if the hosts of h1 are directly followed by those of
+ * h2, so that the two could be a single range.
+ */
+static int hostrange_adjacent(hostrange_t h1, hostrange_t h2)
+{
+    return hostrange_prefix_cmp(h1, h2) == 0
+        && h1->hi == h2->lo - 1
+        && hostrange_width_combine(h1, h2);
+}
+
 
 /* Return true if hostrange hr contains no hosts, i.e. hi < lo
  */
@@ -775,7 +1210,6 @@ static int hostrange_empty(hostrange_t hr)
  */
 static char *hostrange_pop(hostrange_t hr)
 {
-    size_t size = 0;
     char *host = NULL;
 
     assert(hr != NULL);
@@ -784,11 +1218,9 @@ static char *hostrange_pop(hostrange_t hr)
         hr->lo++;    /* effectively set count == 0 */
         host = strdup(hr->prefix);
     } else if (hostrange_count(hr) > 0) {
-        size = strlen(hr->prefix) + hr->width + 16;
-        if (!(host = (char *) malloc(size * sizeof(char))))
+        if (!(host = hostrange_host(hr, hr->hi)))
             out_of_memory("hostrange pop");
-        snprintf(host, size, "%s%0*lu", hr->prefix,
-             hr->width, hr->hi--);
+        hr->hi--;
     }
 
     return host;
@@ -797,7 +1229,6 @@ static char *hostrange_pop(hostrange_t hr)
 /* Same as hostrange_pop(), but remove host from start of range */
 static char *hostrange_shift(hostrange_t hr)
 {
-    size_t size = 0;
     char *host = NULL;
 
     assert(hr != NULL);
@@ -807,11 +1238,9 @@ static char *hostrange_shift(hostrange_t hr)
         if (!(host = strdup(hr->prefix)))
             out_of_memory("hostrange shift");
     } else if (hostrange_count(hr) > 0) {
-        size = strlen(hr->prefix) + hr->width + 16;
-        if (!(host = (char *) malloc(size * sizeof(char))))
+        if (!(host = hostrange_host(hr, hr->lo)))
             out_of_memory("hostrange shift");
-        snprintf(host, size, "%s%0*lu", hr->prefix,
-             hr->width, hr->lo++);
+        hr->lo++;
     }
 
     return host;
@@ -859,37 +1288,6 @@ static int hostrange_join(hostrange_t h1, hostrange_t h2)
     return duplicated;
 }
 
-/* hostrange intersect returns the intersection (common hosts)
- * of hostrange objects h1 and h2. If there is no intersection,
- * NULL is returned.
- *
- * It is assumed that h1 <= h2 (i.e. h1->lo <= h2->lo)
- */
-static hostrange_t hostrange_intersect(hostrange_t h1, hostrange_t h2)
-{
-    hostrange_t new = NULL;
-
-    assert(h1 != NULL);
-    assert(h2 != NULL);
-
-    if (h1->singlehost || h2->singlehost)
-        return NULL;
-
-    assert(hostrange_cmp(h1, h2) <= 0);
-
-    if ((hostrange_prefix_cmp(h1, h2) == 0)
-        && (h1->hi > h2->lo)
-        && (hostrange_width_combine(h1, h2))) {
-
-        if (!(new = hostrange_copy(h1)))
-            return NULL;
-        new->lo = h2->lo;
-        new->hi = h2->hi < h1->hi ? h2->hi : h1->hi;
-    }
-
-    return new;
-}
-
 /* return offset of hn if it is in the hostlist or
  *        -1 if not.
  */
@@ -976,7 +1374,8 @@ static int hostrange_hn_within(hostrange_t hr, hostname_t hn)
         && (hn->num <= hr->hi)
         && (hn->num >= hr->lo)) {
         int width = hostname_suffix_width (hn);
-        if (!_width_equiv(hr->lo, &hr->width, hn->num, &width))
+        int hrwidth = hr->width;
+        if (!_width_equiv(hr->lo, &hrwidth, hn->num, &width))
             return -1;
         return (hn->num - hr->lo);
     }
@@ -991,9 +1390,9 @@ static int hostrange_hn_within(hostrange_t hr, hostname_t hn)
 static size_t
 hostrange_to_string(hostrange_t hr, size_t n, char *buf, char *separator)
 {
+    struct hostname_gen g;
     unsigned long i;
-    int truncated = 0;
-    int len = 0;
+    size_t len = 0;
     char sep = separator == NULL ? ',' : separator[0];
 
     if (n == 0)
@@ -1002,27 +1401,30 @@ hostrange_to_string(hostrange_t hr, size_t n, char *buf, char *separator)
     if (hr->singlehost)
         return snprintf(buf, n, "%s", hr->prefix);
 
+    if (hostname_gen_init(&g, hr, hr->lo) < 0)
+        return -1;
+
     for (i = hr->lo; i <= hr->hi; i++) {
-        size_t m = (n - len) <= n ? n - len : 0; /* check for < 0 */
-        int ret = snprintf(buf + len, m, "%s%0*lu",
-                   hr->prefix, hr->width, i);
-        if (ret < 0 || ret >= m) {
-            len = n;
-            truncated = 1;
-            break;
+        if (len + g.len >= n) {
+            /* truncated: copy what fits and NUL terminate */
+            if (len < n)
+                memcpy(buf + len, g.name, n - len - 1);
+            buf[n-1] = '\0';
+            hostname_gen_fini(&g);
+            return -1;
         }
-        len+=ret;
+        memcpy(buf + len, g.name, g.len);
+        len += g.len;
         buf[len++] = sep;
+        if (i == hr->hi)
+            break;
+        hostname_gen_incr(&g);
     }
+    hostname_gen_fini(&g);
 
-    if (truncated) {
-        buf[n-1] = '\0';
-        return -1;
-    } else {
-        /* back up over final separator */
-        buf[--len] = '\0';
-        return len;
-    }
+    /* back up over final separator */
+    buf[--len] = '\0';
+    return len;
 }
 
 /* Place the string representation of the numeric part of hostrange into buf
@@ -1051,6 +1453,94 @@ static size_t hostrange_numstr(hostrange_t hr, size_t n, char *buf)
 }
 
 
+/* Return a newly allocated string representation of host number num
+ * in hostrange hr, or NULL if memory allocation fails.
+ */
+static char *hostrange_host(hostrange_t hr, unsigned long num)
+{
+    size_t plen;
+    char *host;
+    int len;
+
+    assert(hr != NULL);
+
+    if (hr->singlehost)
+        return strdup(hr->prefix);
+
+    plen = strlen(hr->prefix);
+    len = _ndigits(num);
+    if (hr->width > len)
+        len = hr->width;
+    if (!(host = malloc(plen + len + 1)))
+        return NULL;
+
+    memcpy(host, hr->prefix, plen);
+    len = _numstr(host + plen, num, hr->width);
+    host[plen + len] = '\0';
+    return host;
+}
+
+
+/* ----[ hostname generator functions ]---- */
+
+/* Initialize hostname generator g with the name of host number num
+ * in hostrange hr. Returns 0 on success, -1 if memory allocation fails.
+ */
+static int hostname_gen_init(struct hostname_gen *g, hostrange_t hr,
+                             unsigned long num)
+{
+    size_t size;
+
+    assert(hr != NULL);
+
+    g->plen = strlen(hr->prefix);
+    g->num = num;
+
+    /* leave room for the widest possible suffix, so that carries
+     *  which lengthen the suffix (e.g. 999 -> 1000) always fit */
+    size = g->plen + (hr->width > 20 ? hr->width : 20) + 2;
+    if (size <= sizeof(g->buf))
+        g->name = g->buf;
+    else if (!(g->name = malloc(size)))
+        seterrno_ret(ENOMEM, -1);
+
+    memcpy(g->name, hr->prefix, g->plen);
+    g->len = g->plen;
+    if (!hr->singlehost)
+        g->len += _numstr(g->name + g->plen, num, hr->width);
+    g->name[g->len] = '\0';
+    return 0;
+}
+
+/* Advance hostname generator g to the next host in its range
+ */
+static void hostname_gen_incr(struct hostname_gen *g)
+{
+    char *start = g->name + g->plen;
+    char *p = g->name + g->len - 1;
+
+    g->num++;
+    while (p >= start && *p == '9')
+        *p-- = '0';
+
+    if (p >= start)
+        (*p)++;
+    else {
+        /* carry out of the most significant digit: grow suffix by one */
+        memmove(start + 1, start, g->len - g->plen);
+        *start = '1';
+        g->name[++g->len] = '\0';
+    }
+}
+
+static void hostname_gen_fini(struct hostname_gen *g)
+{
+    if (g->name != g->buf)
+        free(g->name);
+    g->name = NULL;
+}
+
+
 /* ----[ hostlist functions ]---- */
 
 /* Create a new hostlist object.
@@ -1064,7 +1554,10 @@ static hostlist_t hostlist_new(void)
         goto fail1;
 
     assert((new->magic = HOSTLIST_MAGIC));
-    mutex_init(&new->mutex);
+    rwlock_init(&new->lock);
+#if    WITH_PTHREADS
+    new->seq = 0;
+#endif
 
     new->hr = (hostrange_t *) malloc(HOSTLIST_CHUNK * sizeof(hostrange_t));
     if (!new->hr)
@@ -1078,6 +1571,23 @@ static hostlist_t hostlist_new(void)
     new->nranges = 0;
     new->nhosts = 0;
     new->ilist = NULL;
+    new->epoch = 0;
+    new->reset_epoch = 0;
+    new->nedits = 0;
+    new->lost_epoch = 0;
+    new->cum = NULL;
+    new->ncum = 0;
+    new->csize = 0;
+    new->cbusy = 0;
+    new->frozen = 0;
+    new->refcnt = 1;
+    new->block = NULL;
+    new->keys = NULL;
+    new->base = NULL;
+    new->db = NULL;
+    new->njoinable = 0;
+    new->ncompact = 0;
+    new->compact_ratio = HOSTLIST_COMPACT_RATIO;
     return new;
 
   fail2:
@@ -1135,11 +1645,16 @@ static int hostlist_push_range(hostlist_t hl, hostrange_t hr)
     assert(hr != NULL);
     LOCK_HOSTLIST(hl);
 
+    if (!_hostlist_own(hl))
+        goto error;
+
     tail = (hl->nranges > 0) ? hl->hr[hl->nranges-1] : hl->hr[0];
 
     if (hl->size == hl->nranges && !hostlist_expand(hl))
         goto error;
 
+    _hostlist_touch(hl, hl->nranges > 0 ? hl->nranges - 1 : 0);
+
     if (hl->nranges > 0
         && hostrange_prefix_cmp(tail, hr) == 0
         && tail->hi == hr->lo - 1
@@ -1177,13 +1692,12 @@ hostlist_push_hr(hostlist_t hl, char *prefix, unsigned long lo,
 }
 
 /* Insert a range object hr into position n of the hostlist hl
- * Assumes that hl->mutex is already held by calling process
+ * Assumes that hl->lock is already held for writing by calling process
  */
 static int hostlist_insert_range(hostlist_t hl, hostrange_t hr, int n)
 {
     int i;
     hostrange_t tmp;
-    hostlist_iterator_t hli;
 
     assert(hl != NULL);
     assert((hl->magic == HOSTLIST_MAGIC));
@@ -1206,12 +1720,12 @@ static int hostlist_insert_range(hostlist_t hl, hostrange_t hr, int n)
         tmp = last;
     }
     hl->nranges++;
+    _hostlist_touch(hl, n);
 
-    /* adjust hostlist iterators if needed */
-    for (hli = hl->ilist; hli; hli = hli->next) {
-        if (hli->idx >= n)
-            hli->hr = hli->hl->hr[++hli->idx];
-    }
+    if (n > 0 && hostrange_adjacent(hl->hr[n - 1], hl->hr[n]))
+        hl->njoinable++;
+    if (n < hl->nranges - 1 && hostrange_adjacent(hl->hr[n], hl->hr[n + 1]))
+        hl->njoinable++;
 
     return 1;
 }
@@ -1233,7 +1747,11 @@ static void hostlist_delete_range(hostlist_t hl, int n)
         hl->hr[i] = hl->hr[i + 1];
     hl->nranges--;
     hl->hr[hl->nranges] = NULL;
-    hostlist_shift_iterators(hl, n, 0, 1);
+    _hostlist_touch(hl, n);
+
+    if (n > 0 && n < hl->nranges
+        && hostrange_adjacent(hl->hr[n - 1], hl->hr[n]))
+        hl->njoinable++;
 
     /* XXX caller responsible for adjusting nhosts */
     /* hl->nhosts -= hostrange_count(old) */
@@ -1241,66 +1759,301 @@ static void hostlist_delete_range(hostlist_t hl, int n)
     hostrange_destroy(old);
 }
 
-#if WANT_RECKLESS_HOSTRANGE_EXPANSION
+/* Note a modification of the range at position n (or of the layout of
+ * ranges from n onward) in hostlist hl. Iterators notice the change
+ * of epoch the next time they are used, so modifications never need
+ * to visit them. Assumes the hostlist lock is already held.
+ */
+static void _hostlist_touch(hostlist_t hl, int n)
+{
+    hl->epoch++;
+    if (hl->ncum > n)
+        hl->ncum = n;
+}
 
-/* The reckless hostrange expansion function.
- * See comment in hostlist.h:hostlist_create() for more info on
- * the different choices for hostlist notation.
+/* Record that delta hosts were inserted (delta > 0) or removed
+ * (delta < 0) at host position pos, so that iterators created before
+ * the change may keep their place. Assumes the hostlist lock is held.
  */
-hostlist_t _hostlist_create(const char *hostlist, char *sep, char *r_op)
+static void _hostlist_edit(hostlist_t hl, int pos, int delta)
 {
-    char *str, *orig;
-    char *tok, *cur;
-    int high, low, fmt = 0;
-    char prefix[256] = "";
-    int pos = 0;
-    int error = 0;
-    char range_op = r_op[0];/* XXX support > 1 char range ops in future? */
+    struct hostlist_edit *e = &hl->edits[hl->nedits % HOSTLIST_EDIT_LOG];
+
+    if (hl->nedits >= HOSTLIST_EDIT_LOG)
+        hl->lost_epoch = e->epoch;
+    e->epoch = ++hl->epoch;
+    e->pos = pos;
+    e->delta = delta;
+    hl->nedits++;
+}
 
-    hostlist_t new = hostlist_new();
+/* Note that the hosts in hl have been reordered. All existing
+ * iterators will be reset. Assumes the hostlist lock is held.
+ */
+static void _hostlist_reorder(hostlist_t hl)
+{
+    hl->reset_epoch = ++hl->epoch;
+    hl->ncum = 0;
+}
 
-    orig = str = strdup(hostlist);
+/* Return the base list holding the ranges of hl for sharing with a
+ * copy, first moving the ranges of hl into a new one if needed.
+ * Assumes the hostlist lock is held for writing.
+ */
+static hostlist_t _hostlist_base(hostlist_t hl)
+{
+    hostlist_t base;
 
-    /* return an empty list if an empty string was passed in */
-    if (str == NULL || strlen(str) == 0)
-        goto done;
+    if (hl->base)
+        return hl->base;
+    if (!(base = hostlist_new()))
+        return NULL;
 
-    /* Use hostlist_create_bracketed if we see "[" */
-    if (strchr(str, '[') != NULL)
-        return _hostlist_create_bracketed(hostlist, sep, r_op);
+    /* base is frozen, so its count index is completed here or never */
+    _hostlist_index(hl);
+
+    free(base->hr);
+    base->hr = hl->hr;
+    base->size = hl->size;
+    base->nranges = hl->nranges;
+    base->nhosts = hl->nhosts;
+    base->cum = hl->cum;
+    base->ncum = hl->ncum;
+    base->csize = hl->csize;
+    base->frozen = 1;
+
+    hl->base = base;
+    return base;
+}
 
-    while ((tok = _next_tok(sep, &str)) != NULL) {
+/* Make hl share the ranges and count index of frozen hostlist base.
+ * hl must be empty.
+ */
+static void _hostlist_share(hostlist_t hl, hostlist_t base)
+{
+    assert(hl->nranges == 0);
 
-        /* save the current string for error messages */
-        cur = tok;
+    refcnt_incr(&base->refcnt);
+    free(hl->hr);
+    hl->hr = base->hr;
+    hl->size = base->size;
+    hl->nranges = base->nranges;
+    hl->nhosts = base->nhosts;
+    hl->cum = base->cum;
+    hl->ncum = base->ncum;
+    hl->csize = base->csize;
+    hl->base = base;
+}
 
-        high = low = 0;
+/* Give hl its own copy of the ranges it shares with its base list.
+ * Called before any modification of the ranges of hl. Returns 0 and
+ * sets errno if memory could not be allocated.
+ * Assumes the hostlist lock is held for writing.
+ */
+static int _hostlist_own(hostlist_t hl)
+{
+    hostlist_t base = hl->base;
+    hostrange_t *hr;
+    int *cum = NULL;
+    int i;
 
-        /* find end of alpha part
-         *   do this by finding last occurence of range_op in str */
-        pos = strlen(tok) - 1;
-        if (strstr(tok, r_op) != NULL) {
-            while (pos >= 0 && (char) tok[pos] != range_op)
-                pos--;
-        }
+    if (base == NULL)
+        return 1;
 
-        /* now back up past any digits */
-        while (pos >= 0 && isdigit((char) tok[--pos])) {;}
+    /* the ranges move and iterators must pick up their new location */
+    hl->epoch++;
 
-        /* Check for valid x-y range (x must be a digit)
-         *   Reset pos if the range is not valid         */
-        if (!isdigit((char) tok[++pos]))
-            pos = strlen(tok) - 1;
+    if (base->block == NULL && refcnt_get(&base->refcnt) == 1) {
+        /* no other list shares the ranges, so take them over */
+        base->hr = NULL;
+        base->cum = NULL;
+        base->nranges = 0;
+        hl->base = NULL;
+        hostlist_destroy(base);
+        return 1;
+    }
 
-        /* create prefix string
-         * if prefix will be zero length, but prefix already exists
-         * use the previous prefix and fmt
-         */
-        if ((pos > 0) || (prefix[0] == '\0')) {
-            memcpy(prefix, tok, (size_t) pos * sizeof(char));
-            prefix[pos] = '\0';
+    if (!(hr = malloc(hl->size * sizeof(*hr))))
+        seterrno_ret(ENOMEM, 0);
+    if (hl->csize > 0 && !(cum = malloc(hl->csize * sizeof(*cum)))) {
+        free(hr);
+        seterrno_ret(ENOMEM, 0);
+    }
 
-            /* push pointer past prefix */
+    for (i = 0; i < hl->size; i++)
+        hr[i] = i < hl->nranges ? hostrange_copy(hl->hr[i]) : NULL;
+    if (cum != NULL)
+        memcpy(cum, hl->cum, hl->csize * sizeof(*cum));
+
+    hl->hr = hr;
+    hl->cum = cum;
+    hl->base = NULL;
+    hostlist_destroy(base);
+    return 1;
+}
+
+/* Make room in the count index of hl for all of its ranges. Called
+ * when the write lock is dropped, so that readers never reallocate it.
+ * If the index cannot be allocated it is left incomplete, and lookups
+ * fall back to counting.
+ */
+static void _hostlist_index_reserve(hostlist_t hl)
+{
+    int *cum;
+
+    if (hl->csize >= hl->nranges + 1 || hl->base || hl->frozen)
+        return;
+    if (!(cum = realloc(hl->cum, (hl->size + 1) * sizeof(int))))
+        return;
+    hl->cum = cum;
+    hl->csize = hl->size + 1;
+    hl->cum[0] = 0;
+}
+
+/* Bring the count index of hl up to date with its ranges. May be
+ * called with the lock held only for reading: entries past ncum are
+ * not read by anyone until ncum is raised, and a reader which finds
+ * another one completing the index leaves it alone and counts.
+ */
+static void _hostlist_index_complete(hostlist_t hl)
+{
+    int i, n;
+
+    if (hl->base || hl->frozen || hl->csize < hl->nranges + 1
+        || ncum_get(hl) >= hl->nranges || !cum_trylock(hl))
+        return;
+
+    for (i = n = hl->ncum; i < hl->nranges; i++)
+        hl->cum[i + 1] = hl->cum[i] + hostrange_count(hl->hr[i]);
+    if (n < hl->nranges)
+        ncum_set(hl, hl->nranges);
+    cum_unlock(hl);
+}
+
+/* Allocate and complete the count index of hl. Assumes hl is locked
+ * for writing or not yet visible to other threads.
+ */
+static void _hostlist_index(hostlist_t hl)
+{
+    _hostlist_index_reserve(hl);
+    _hostlist_index_complete(hl);
+}
+
+/* Return the number of hosts in ranges hr[0] .. hr[n-1], using the
+ * count index as far as it is valid. Only completes the index, so may
+ * be called with the lock held for reading.
+ */
+static int _hostlist_offset(hostlist_t hl, int n)
+{
+    int i, count;
+
+    assert(n >= 0 && n <= hl->nranges);
+
+    _hostlist_index_complete(hl);
+    if (hl->cum == NULL)
+        i = count = 0;
+    else if (n <= (i = ncum_get(hl)))
+        return hl->cum[n];
+    else
+        count = hl->cum[i];
+
+    for (; i < n; i++)
+        count += hostrange_count(hl->hr[i]);
+    return count;
+}
+
+/* Return the index of the range holding the host at position pos
+ * (0 <= pos < hl->nhosts) using a binary search of the count index.
+ * Assumes the hostlist lock is held.
+ */
+static int _hostlist_range_at(hostlist_t hl, int pos)
+{
+    int lo = 0, hi = hl->nranges - 1;
+
+    assert(pos >= 0 && pos < hl->nhosts);
+
+    _hostlist_index_complete(hl);
+    if (hl->cum == NULL || ncum_get(hl) < hl->nranges) {
+        /* count index is not available, scan the ranges */
+        int count = 0;
+        for (lo = 0; lo < hi; lo++) {
+            count += hostrange_count(hl->hr[lo]);
+            if (pos < count)
+                break;
+        }
+        return lo;
+    }
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (hl->cum[mid] <= pos)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+#if WANT_RECKLESS_HOSTRANGE_EXPANSION
+
+/* The reckless hostrange expansion function.
+ * See comment in hostlist.h:hostlist_create() for more info on
+ * the different choices for hostlist notation.
+ */
+hostlist_t _hostlist_create(const char *hostlist, char *sep, char *r_op)
+{
+    char *str, *orig;
+    char *tok, *cur;
+    int high, low, fmt = 0;
+    char prefix[256] = "";
+    int pos = 0;
+    int error = 0;
+    char range_op = r_op[0];/* XXX support > 1 char range ops in future? */
+
+    hostlist_t new = hostlist_new();
+
+    orig = str = strdup(hostlist);
+
+    /* return an empty list if an empty string was passed in */
+    if (str == NULL || strlen(str) == 0)
+        goto done;
+
+    /* Use hostlist_create_bracketed if we see "[" */
+    if (strchr(str, '[') != NULL)
+        return _hostlist_create_bracketed(hostlist, sep, r_op);
+
+    while ((tok = _next_tok(sep, &str)) != NULL) {
+
+        /* save the current string for error messages */
+        cur = tok;
+
+        high = low = 0;
+
+        /* find end of alpha part
+         *   do this by finding last occurence of range_op in str */
+        pos = strlen(tok) - 1;
+        if (strstr(tok, r_op) != NULL) {
+            while (pos >= 0 && (char) tok[pos] != range_op)
+                pos--;
+        }
+
+        /* now back up past any digits */
+        while (pos >= 0 && isdigit((char) tok[--pos])) {;}
+
+        /* Check for valid x-y range (x must be a digit)
+         *   Reset pos if the range is not valid         */
+        if (!isdigit((char) tok[++pos]))
+            pos = strlen(tok) - 1;
+
+        /* create prefix string
+         * if prefix will be zero length, but prefix already exists
+         * use the previous prefix and fmt
+         */
+        if ((pos > 0) || (prefix[0] == '\0')) {
+            memcpy(prefix, tok, (size_t) pos * sizeof(char));
+            prefix[pos] = '\0';
+
+            /* push pointer past prefix */
             tok += pos;
 
             /* count number of digits for ouput fmt */
@@ -1560,26 +2313,178 @@ hostlist_t hostlist_create(const char *str)
 
 hostlist_t hostlist_copy(const hostlist_t hl)
 {
+    hostlist_t new, base;
+
+    if (hl == NULL)
+        return NULL;
+
+    if (!(new = hostlist_new()))
+        return NULL;
+
+    /* The copy shares the ranges of hl until either list is modified.
+     * Frozen lists are shared directly, other lists first hand their
+     * ranges over to a frozen base list.
+     */
+    if (hl->frozen) {
+        _hostlist_share(new, hl);
+        return new;
+    }
+
+    LOCK_HOSTLIST(hl);
+    if ((base = _hostlist_base(hl)))
+        _hostlist_share(new, base);
+    new->compact_ratio = hl->compact_ratio;
+    UNLOCK_HOSTLIST(hl);
+
+    if (base == NULL) {
+        hostlist_destroy(new);
+        out_of_memory("hostlist_copy");
+    }
+    return new;
+}
+
+
+/* Return the length of the key under which a single host with name
+ * prefix is found in the find index, i.e. the length of the prefix
+ * hostname_create() would give it.
+ */
+static size_t _hostname_key_len(const char *prefix)
+{
+    size_t len = strlen(prefix);
+    int idx = host_prefix_end(prefix);
+
+    if (idx == len - 1 || strtoul(prefix + idx + 1, NULL, 10) > MAX_HOST_SUFFIX)
+        return len;
+    return idx + 1;
+}
+
+/* Order find index entries by key, then `any' entries first, then lo.
+ */
+static int _hostlist_key_cmp(const void *k1, const void *k2)
+{
+    const struct hostlist_key *a = k1;
+    const struct hostlist_key *b = k2;
+    size_t len = a->len < b->len ? a->len : b->len;
+    int retval;
+
+    if ((retval = memcmp(a->key, b->key, len)) != 0)
+        return retval;
+    if (a->len != b->len)
+        return a->len < b->len ? -1 : 1;
+    if (a->any != b->any)
+        return b->any - a->any;
+    if (a->lo != b->lo)
+        return a->lo < b->lo ? -1 : 1;
+    return a->idx - b->idx;
+}
+
+/* Build the find index of frozen hostlist hl. If it cannot be
+ * allocated, hostlist_find() falls back to a scan of the ranges.
+ */
+static void _hostlist_index_keys(hostlist_t hl)
+{
+    struct hostlist_key *k;
     int i;
+
+    if (!(k = malloc((hl->nranges + 1) * sizeof(*k))))
+        return;
+
+    for (i = 0; i < hl->nranges; i++) {
+        hostrange_t hr = hl->hr[i];
+        k[i].key = hr->prefix;
+        k[i].idx = i;
+        if (hr->singlehost) {
+            k[i].len = _hostname_key_len(hr->prefix);
+            k[i].any = 1;
+            k[i].lo = k[i].maxhi = 0;
+        } else {
+            k[i].len = host_prefix_end(hr->prefix) + 1;
+            k[i].any = (hr->prefix[k[i].len] != '\0');
+            k[i].lo = hr->lo;
+            k[i].maxhi = hr->hi;
+        }
+    }
+    qsort(k, hl->nranges, sizeof(*k), &_hostlist_key_cmp);
+
+    for (i = 1; i < hl->nranges; i++) {
+        if (!k[i].any && !k[i - 1].any
+            && k[i].len == k[i - 1].len
+            && memcmp(k[i].key, k[i - 1].key, k[i].len) == 0
+            && k[i - 1].maxhi > k[i].maxhi)
+            k[i].maxhi = k[i - 1].maxhi;
+    }
+    hl->keys = k;
+}
+
+hostlist_t hostlist_freeze(hostlist_t hl)
+{
     hostlist_t new;
+    hostrange_t hr;
+    char *names;
+    size_t len = 0;
+    int i, n = 0;
 
     if (hl == NULL)
         return NULL;
 
-    LOCK_HOSTLIST(hl);
+    if (hl->frozen) {
+        refcnt_incr(&hl->refcnt);
+        return hl;
+    }
+
     if (!(new = hostlist_new()))
-        goto done;
+        return NULL;
 
-    new->nranges = hl->nranges;
-    new->nhosts = hl->nhosts;
-    if (new->nranges > new->size)
-        hostlist_resize(new, new->nranges);
+    RDLOCK_HOSTLIST(hl);
 
     for (i = 0; i < hl->nranges; i++)
-        new->hr[i] = hostrange_copy(hl->hr[i]);
+        len += strlen(hl->hr[i]->prefix) + 1;
+
+    if ((hl->nranges > new->size && !hostlist_resize(new, hl->nranges))
+        || !(new->block = malloc(hl->nranges * sizeof(*hr) + len + 1))) {
+        RDUNLOCK_HOSTLIST(hl);
+        hostlist_destroy(new);
+        out_of_memory("hostlist_freeze");
+    }
+
+    /* Ranges are stored contiguously, followed by their prefixes.
+     * Adjacent ranges which can be joined are, and adjacent ranges
+     * with the same prefix share one copy of it.
+     */
+    hr = new->block;
+    names = (char *) (hr + hl->nranges);
+
+    for (i = 0; i < hl->nranges; i++) {
+        struct hostrange_components r = *hl->hr[i];
+        hostrange_t prev = n > 0 ? &hr[n - 1] : NULL;
+
+        if (prev && hostrange_prefix_cmp(prev, &r) == 0
+            && prev->hi == r.lo - 1
+            && hostrange_width_combine(prev, &r)) {
+            prev->hi = r.hi;
+            continue;
+        }
+
+        if (prev && strcmp(prev->prefix, r.prefix) == 0)
+            r.prefix = prev->prefix;
+        else {
+            r.prefix = strcpy(names, r.prefix);
+            names += strlen(names) + 1;
+        }
+
+        hr[n] = r;
+        new->hr[n] = &hr[n];
+        n++;
+    }
+    new->nranges = n;
+    new->nhosts = hl->nhosts;
+
+    RDUNLOCK_HOSTLIST(hl);
+
+    _hostlist_index(new);
+    _hostlist_index_keys(new);
+    new->frozen = 1;
 
-  done:
-    UNLOCK_HOSTLIST(hl);
     return new;
 }
 
@@ -1589,18 +2494,42 @@ void hostlist_destroy(hostlist_t hl)
     int i;
     if (hl == NULL)
         return;
-    LOCK_HOSTLIST(hl);
-    while (hl->ilist) {
-        mutex_unlock(&hl->mutex);
-        hostlist_iterator_destroy(hl->ilist);
-        mutex_lock(&hl->mutex);
+    if (hl->frozen) {
+        if (refcnt_decr(&hl->refcnt) > 0)
+            return;
+        if (hl->block == NULL) {
+            for (i = 0; i < hl->nranges; i++)
+                hostrange_destroy(hl->hr[i]);
+        }
+    } else {
+        LOCK_HOSTLIST(hl);
+        while (hl->ilist) {
+            UNLOCK_HOSTLIST(hl);
+            hostlist_iterator_destroy(hl->ilist);
+            LOCK_HOSTLIST(hl);
+        }
+        if (hl->base) {
+            /* the ranges belong to the base list */
+            hostlist_destroy(hl->base);
+            hl->hr = NULL;
+            hl->cum = NULL;
+        } else {
+            for (i = 0; i < hl->nranges; i++)
+                hostrange_destroy(hl->hr[i]);
+        }
+        rwlock_unlock(&hl->lock);
+    }
+    if (hl->db) {
+        /* the count index belongs to the database image */
+        hl->cum = NULL;
+        hostlist_db_close(hl->db);
     }
-    for (i = 0; i < hl->nranges; i++)
-        hostrange_destroy(hl->hr[i]);
     free(hl->hr);
+    free(hl->cum);
+    free(hl->keys);
+    free(hl->block);
     assert((hl->magic = 0x1));
-    UNLOCK_HOSTLIST(hl);
-    mutex_destroy(&hl->mutex);
+    rwlock_destroy(&hl->lock);
     free(hl);
 }
 
@@ -1611,12 +2540,11 @@ int hostlist_push(hostlist_t hl, const char *hosts)
     int retval;
     if (hosts == NULL)
         return 0;
+    CHECK_MUTABLE(hl, 0);
     new = hostlist_create(hosts);
     if (!new)
         return 0;
-    mutex_lock(&new->mutex);
-    retval = new->nhosts;
-    mutex_unlock(&new->mutex);
+    retval = hostlist_count(new);
     hostlist_push_list(hl, new);
     hostlist_destroy(new);
     return retval;
@@ -1629,6 +2557,7 @@ int hostlist_push_host(hostlist_t hl, const char *str)
 
     if (str == NULL)
         return 0;
+    CHECK_MUTABLE(hl, 0);
 
     hn = hostname_create(str);
 
@@ -1652,13 +2581,14 @@ int hostlist_push_list(hostlist_t h1, hostlist_t h2)
 
     if (h2 == NULL)
         return 0;
+    CHECK_MUTABLE(h1, 0);
 
-    LOCK_HOSTLIST(h2);
+    RDLOCK_HOSTLIST(h2);
 
     for (i = 0; i < h2->nranges; i++)
         n += hostlist_push_range(h1, h2->hr[i]);
 
-    UNLOCK_HOSTLIST(h2);
+    RDUNLOCK_HOSTLIST(h2);
 
     return n;
 }
@@ -1668,11 +2598,13 @@ char *hostlist_pop(hostlist_t hl)
 {
     char *host = NULL;
 
+    CHECK_MUTABLE(hl, NULL);
     LOCK_HOSTLIST(hl);
-    if (hl->nhosts > 0) {
+    if (hl->nhosts > 0 && _hostlist_own(hl)) {
         hostrange_t hr = hl->hr[hl->nranges - 1];
         host = hostrange_pop(hr);
         hl->nhosts--;
+        _hostlist_touch(hl, hl->nranges - 1);
         if (hostrange_empty(hr)) {
             hostrange_destroy(hl->hr[--hl->nranges]);
             hl->hr[hl->nranges] = NULL;
@@ -1682,34 +2614,14 @@ char *hostlist_pop(hostlist_t hl)
     return host;
 }
 
-/* find all iterators affected by a shift (or deletion) at
- * hl->hr[idx], depth, with the deletion of n ranges */
-static void
-hostlist_shift_iterators(hostlist_t hl, int idx, int depth, int n)
-{
-    hostlist_iterator_t i;
-    for (i = hl->ilist; i; i = i->next) {
-        if (n == 0) {
-            if (i->idx == idx && i->depth >= depth)
-                i->depth = i->depth > -1 ? i->depth - 1 : -1;
-        } else {
-            if (i->idx >= idx) {
-                if ((i->idx -= n) >= 0)
-                    i->hr = i->hl->hr[i->idx];
-                else
-                    hostlist_iterator_reset(i);
-            }
-        }
-    }
-}
-
 char *hostlist_shift(hostlist_t hl)
 {
     char *host = NULL;
 
+    CHECK_MUTABLE(hl, NULL);
     LOCK_HOSTLIST(hl);
 
-    if (hl->nhosts > 0) {
+    if (hl->nhosts > 0 && _hostlist_own(hl)) {
         hostrange_t hr = hl->hr[0];
 
         host = hostrange_shift(hr);
@@ -1719,7 +2631,8 @@ char *hostlist_shift(hostlist_t hl)
             hostlist_delete_range(hl, 0);
             /* hl->nranges--; */
         } else
-            hostlist_shift_iterators(hl, 0, 0, 0);
+            _hostlist_touch(hl, 0);
+        _hostlist_edit(hl, 0, -1);
     }
 
     UNLOCK_HOSTLIST(hl);
@@ -1735,8 +2648,10 @@ char *hostlist_pop_range(hostlist_t hl)
     hostlist_t hltmp;
     hostrange_t tail;
 
+    CHECK_MUTABLE(hl, NULL);
     LOCK_HOSTLIST(hl);
-    if (hl->nranges < 1 || !(hltmp = hostlist_new())) {
+    if (hl->nranges < 1 || !_hostlist_own(hl)
+        || !(hltmp = hostlist_new())) {
         UNLOCK_HOSTLIST(hl);
         return NULL;
     }
@@ -1746,7 +2661,8 @@ char *hostlist_pop_range(hostlist_t hl)
     while (i >= 0 && hostrange_within_range(tail, hl->hr[i]))
         i--;
 
-    for (i++; i < hl->nranges; i++) {
+    _hostlist_touch(hl, ++i);
+    for (; i < hl->nranges; i++) {
         hostlist_push_range(hltmp, hl->hr[i]);
         hostrange_destroy(hl->hr[i]);
         hl->hr[i] = NULL;
@@ -1765,13 +2681,15 @@ char *hostlist_shift_range(hostlist_t hl)
 {
     int i;
     char buf[1024];
-    hostlist_t hltmp = hostlist_new();
-    if (!hltmp)
+    hostlist_t hltmp;
+
+    CHECK_MUTABLE(hl, NULL);
+    if (!(hltmp = hostlist_new()))
         return NULL;
 
     LOCK_HOSTLIST(hl);
 
-    if (hl->nranges == 0) {
+    if (hl->nranges == 0 || !_hostlist_own(hl)) {
         hostlist_destroy(hltmp);
         UNLOCK_HOSTLIST(hl);
         return NULL;
@@ -1784,8 +2702,6 @@ char *hostlist_shift_range(hostlist_t hl)
     } while ( (++i < hl->nranges)
             && hostrange_within_range(hltmp->hr[0], hl->hr[i]) );
 
-    hostlist_shift_iterators(hl, i, 0, hltmp->nranges);
-
     /* shift rest of ranges back in hl */
     for (; i < hl->nranges; i++) {
         hl->hr[i - hltmp->nranges] = hl->hr[i];
@@ -1793,6 +2709,8 @@ char *hostlist_shift_range(hostlist_t hl)
     }
     hl->nhosts -= hltmp->nhosts;
     hl->nranges -= hltmp->nranges;
+    _hostlist_touch(hl, 0);
+    _hostlist_edit(hl, 0, -hltmp->nhosts);
 
     UNLOCK_HOSTLIST(hl);
 
@@ -1809,6 +2727,7 @@ int hostlist_delete(hostlist_t hl, const char *hosts)
     char *hostname = NULL;
     hostlist_t hltmp;
 
+    CHECK_MUTABLE(hl, 0);
     if (!(hltmp = hostlist_create(hosts)))
         seterrno_ret(EINVAL, 0);
 
@@ -1825,7 +2744,9 @@ int hostlist_delete(hostlist_t hl, const char *hosts)
 /* XXX watch out! poor implementation follows! (fix it at some point) */
 int hostlist_delete_host(hostlist_t hl, const char *hostname)
 {
-    int n = hostlist_find(hl, hostname);
+    int n;
+    CHECK_MUTABLE(hl, 0);
+    n = hostlist_find(hl, hostname);
     if (n >= 0)
         hostlist_delete_nth(hl, n);
     return n >= 0 ? 1 : 0;
@@ -1835,33 +2756,20 @@ int hostlist_delete_host(hostlist_t hl, const char *hostname)
 static char *
 _hostrange_string(hostrange_t hr, int depth)
 {
-    char buf[MAXHOSTNAMELEN + 16];
-    int  len = snprintf(buf, MAXHOSTNAMELEN + 15, "%s", hr->prefix);
-
-    if (!hr->singlehost)
-        snprintf(buf+len, MAXHOSTNAMELEN+15 - len, "%0*lu",
-                 hr->width, hr->lo + depth);
-    return strdup(buf);
+    return hostrange_host(hr, hr->lo + depth);
 }
 
 char * hostlist_nth(hostlist_t hl, int n)
 {
     char *host = NULL;
-    int   i, count;
-
-    LOCK_HOSTLIST(hl);
-    count = 0;
-    for (i = 0; i < hl->nranges; i++) {
-        int num_in_range = hostrange_count(hl->hr[i]);
+    int   i;
 
-        if (n <= (num_in_range - 1 + count)) {
-            host = _hostrange_string(hl->hr[i], n - count);
-            break;
-        } else
-            count += num_in_range;
+    RDLOCK_HOSTLIST(hl);
+    if (n >= 0 && n < hl->nhosts) {
+        i = _hostlist_range_at(hl, n);
+        host = _hostrange_string(hl->hr[i], n - _hostlist_offset(hl, i));
     }
-
-    UNLOCK_HOSTLIST(hl);
+    RDUNLOCK_HOSTLIST(hl);
 
     return host;
 }
@@ -1871,8 +2779,13 @@ int hostlist_delete_nth(hostlist_t hl, int n)
 {
     int i, count;
 
+    CHECK_MUTABLE(hl, 0);
     LOCK_HOSTLIST(hl);
     assert(n >= 0 && n <= hl->nhosts);
+    if (!_hostlist_own(hl)) {
+        UNLOCK_HOSTLIST(hl);
+        return 0;
+    }
 
     count = 0;
 
@@ -1884,6 +2797,7 @@ int hostlist_delete_nth(hostlist_t hl, int n)
             unsigned long num = hr->lo + n - count;
             hostrange_t new;
 
+            _hostlist_touch(hl, i);
             if (hr->singlehost) { /* this wasn't a range */
                 hostlist_delete_range(hl, i);
             } else if ((new = hostrange_delete_host(hr, num))) {
@@ -1900,312 +2814,3422 @@ int hostlist_delete_nth(hostlist_t hl, int n)
 
   done:
     hl->nhosts--;
+    _hostlist_edit(hl, n, -1);
     UNLOCK_HOSTLIST(hl);
     return 1;
 }
 
-int hostlist_count(hostlist_t hl)
+/* Clamp the host positions [*start, *end) to those of hl, and return
+ * the number of hosts between them.
+ */
+static int _hostlist_clamp(hostlist_t hl, int *start, int *end)
 {
-    int retval;
-    LOCK_HOSTLIST(hl);
-    retval = hl->nhosts;
-    UNLOCK_HOSTLIST(hl);
-    return retval;
+    if (*start < 0)
+        *start = 0;
+    if (*end > hl->nhosts)
+        *end = hl->nhosts;
+    if (*start >= *end)
+        *start = *end = 0;
+    return *end - *start;
 }
 
-int hostlist_find(hostlist_t hl, const char *hostname)
+hostlist_t hostlist_slice(hostlist_t hl, int start, int end)
 {
-    int i, count, ret = -1;
-    hostname_t hn;
-
-    if (!hostname)
-        return -1;
+    hostlist_t new;
+    hostrange_t hr;
+    int i, first, last;
 
-    hn = hostname_create(hostname);
+    if (hl == NULL)
+        seterrno_ret(EINVAL, NULL);
+    if (!(new = hostlist_new()))
+        return NULL;
 
-    LOCK_HOSTLIST(hl);
+    RDLOCK_HOSTLIST(hl);
+    if (_hostlist_clamp(hl, &start, &end) == 0)
+        goto done;
 
-    for (i = 0, count = 0; i < hl->nranges; i++) {
-        int offset = hostrange_hn_within(hl->hr[i], hn);
-        if (offset >= 0) {
-            ret = count + offset;
-            break;
-        }
-        else
-            count += hostrange_count(hl->hr[i]);
+    /* only the first and last ranges of the slice need cutting */
+    first = _hostlist_range_at(hl, start);
+    last = _hostlist_range_at(hl, end - 1);
+    if (last - first + 1 > new->size
+        && !hostlist_resize(new, last - first + 1))
+        goto error;
+    for (i = first; i <= last; i++) {
+        if (!(new->hr[new->nranges] = hostrange_copy(hl->hr[i])))
+            goto error;
+        new->nranges++;
     }
 
-    UNLOCK_HOSTLIST(hl);
-    hostname_destroy(hn);
-    return ret;
-}
+    hr = new->hr[new->nranges - 1];
+    if (!hr->singlehost)
+        hr->hi = hr->lo + (end - 1 - _hostlist_offset(hl, last));
+    hr = new->hr[0];
+    if (!hr->singlehost)
+        hr->lo += start - _hostlist_offset(hl, first);
+    new->nhosts = end - start;
+    _hostlist_index(new);
 
-/* hostrange compare with void * arguments to allow use with
- * libc qsort()
- */
-int _cmp(const void *hr1, const void *hr2)
-{
-    hostrange_t *h1 = (hostrange_t *) hr1;
-    hostrange_t *h2 = (hostrange_t *) hr2;
-    return hostrange_cmp((hostrange_t) * h1, (hostrange_t) * h2);
-}
+  done:
+    RDUNLOCK_HOSTLIST(hl);
+    return new;
 
+  error:
+    RDUNLOCK_HOSTLIST(hl);
+    hostlist_destroy(new);
+    seterrno_ret(ENOMEM, NULL);
+}
 
-void hostlist_sort(hostlist_t hl)
+int hostlist_truncate(hostlist_t hl, int start, int end)
 {
-    hostlist_iterator_t i;
-    LOCK_HOSTLIST(hl);
+    hostrange_t hr;
+    int i, n, first, last, nhosts;
 
-    if (hl->nranges <= 1) {
+    CHECK_MUTABLE(hl, 0);
+    LOCK_HOSTLIST(hl);
+    if (!_hostlist_own(hl)) {
         UNLOCK_HOSTLIST(hl);
-        return;
+        return 0;
     }
 
-    qsort(hl->hr, hl->nranges, sizeof(hostrange_t), &_cmp);
+    nhosts = hl->nhosts;
+    if ((n = _hostlist_clamp(hl, &start, &end)) == nhosts) {
+        UNLOCK_HOSTLIST(hl);
+        return 0;
+    }
 
-    /* reset all iterators */
-    for (i = hl->ilist; i; i = i->next)
-        hostlist_iterator_reset(i);
+    if (n > 0) {
+        first = _hostlist_range_at(hl, start);
+        last = _hostlist_range_at(hl, end - 1);
+        hr = hl->hr[last];
+        if (!hr->singlehost)
+            hr->hi = hr->lo + (end - 1 - _hostlist_offset(hl, last));
+        hr = hl->hr[first];
+        if (!hr->singlehost)
+            hr->lo += start - _hostlist_offset(hl, first);
+    } else {
+        first = 0;
+        last = -1;
+    }
 
+    for (i = 0; i < first; i++)
+        hostrange_destroy(hl->hr[i]);
+    for (i = last + 1; i < hl->nranges; i++)
+        hostrange_destroy(hl->hr[i]);
+    for (i = first; i <= last; i++)
+        hl->hr[i - first] = hl->hr[i];
+    for (i = last - first + 1; i < hl->nranges; i++)
+        hl->hr[i] = NULL;
+    hl->nranges = last - first + 1;
+    hl->nhosts = n;
+
+    _hostlist_touch(hl, 0);
+    if (end < nhosts)
+        _hostlist_edit(hl, end, end - nhosts);
+    if (start > 0)
+        _hostlist_edit(hl, 0, -start);
     UNLOCK_HOSTLIST(hl);
 
-    hostlist_coalesce(hl);
+    return nhosts - n;
+}
+
+/* Return the host position at which part p of a cut of n hosts starts:
+ * parts of size hosts if size > 0, the last holding any left over,
+ * or else k parts of which the first n % k get one host more than
+ * the others. Part k starts at n.
+ */
+static int _hostlist_cut_bound(int p, int k, int size, int n)
+{
+    if (size > 0)
+        return p < k ? p * size : n;
+    return p * (n / k) + (p < n % k ? p : n % k);
+}
+
+/* Cut hl into new hostlists of consecutive hosts as described for
+ * _hostlist_cut_bound(), in one pass over the ranges of hl. If size
+ * > 0 the number of parts follows from the host count of hl, and k is
+ * ignored. The count is taken under the same lock as the cut, so the
+ * parts always cover the whole list. The number of parts is stored in
+ * *np. Returns a malloc'd array of the parts, or NULL with errno set.
+ */
+static hostlist_t *_hostlist_cut(hostlist_t hl, int k, int size, int *np)
+{
+    hostlist_t *parts;
+    int p, i = 0, off = 0, n;
+
+    RDLOCK_HOSTLIST(hl);
+    n = hl->nhosts;
+    if (size > 0)
+        k = n / size + (n % size ? 1 : 0);
+    if (!(parts = calloc(k > 0 ? k : 1, sizeof(hostlist_t)))) {
+        RDUNLOCK_HOSTLIST(hl);
+        seterrno_ret(ENOMEM, NULL);
+    }
+
+    for (p = 0; p < k; p++) {
+        hostlist_t new = parts[p] = hostlist_new();
+        int start = _hostlist_cut_bound(p, k, size, n);
+        int end = _hostlist_cut_bound(p + 1, k, size, n);
+        if (new == NULL)
+            goto error;
+
+        while (off < end && i < hl->nranges) {
+            hostrange_t hr = hl->hr[i];
+            int count = hostrange_count(hr);
+            int lo = start > off ? start - off : 0;
+            int hi = end < off + count ? end - off : count;
+
+            if (new->nranges == new->size && !hostlist_expand(new))
+                goto error;
+            if (!(hr = new->hr[new->nranges] = hostrange_copy(hr)))
+                goto error;
+            new->nranges++;
+            if (!hr->singlehost) {
+                hr->hi = hr->lo + hi - 1;
+                hr->lo += lo;
+            }
+            new->nhosts += hi - lo;
+            if (hi < count)
+                break;
+            off += count;
+            i++;
+        }
+        _hostlist_index(new);
+    }
+    RDUNLOCK_HOSTLIST(hl);
+    if (np)
+        *np = k;
+    return parts;
+
+  error:
+    RDUNLOCK_HOSTLIST(hl);
+    for (p = 0; p < k; p++)
+        hostlist_destroy(parts[p]);
+    free(parts);
+    seterrno_ret(ENOMEM, NULL);
+}
+
+hostlist_t *hostlist_partition(hostlist_t hl, int k)
+{
+    if (hl == NULL || k < 1)
+        seterrno_ret(EINVAL, NULL);
+    return _hostlist_cut(hl, k, 0, NULL);
+}
+
+hostlist_t *hostlist_chunks(hostlist_t hl, int size, int *np)
+{
+    if (hl == NULL || size < 1)
+        seterrno_ret(EINVAL, NULL);
+    return _hostlist_cut(hl, 0, size, np);
+}
+
+int hostlist_count(hostlist_t hl)
+{
+    unsigned long seq;
+    int retval;
+    assert(hl != NULL);
+    do {
+        seq = seq_read_begin(hl);
+        retval = seq_read_field(hl, nhosts);
+    } while (seq_read_retry(hl, seq));
+    return retval;
+}
+
+int hostlist_nranges(hostlist_t hl)
+{
+    unsigned long seq;
+    int retval;
+    assert(hl != NULL);
+    do {
+        seq = seq_read_begin(hl);
+        retval = seq_read_field(hl, nranges);
+    } while (seq_read_retry(hl, seq));
+    return retval;
+}
+
+size_t hostlist_memsize(hostlist_t hl)
+{
+    size_t n = sizeof(*hl), len = 0;
+    int i, step, nsample = 0;
+
+    if (hl == NULL)
+        return 0;
+
+    RDLOCK_HOSTLIST(hl);
+    /* ranges shared through a base list are not counted */
+    if (hl->base == NULL) {
+        n += hl->size * sizeof(hostrange_t);
+        n += hl->nranges * sizeof(struct hostrange_components);
+        if (hl->keys)
+            n += (hl->nranges + 1) * sizeof(*hl->keys);
+        /* prefixes and counts of database lists are in the image */
+        if (hl->db == NULL) {
+            n += hl->csize * sizeof(int);
+            /* measure the prefixes of evenly spaced ranges only, so
+             * the cost does not grow with the list */
+            step = hl->nranges / HOSTLIST_MEMSIZE_SAMPLE + 1;
+            for (i = 0; i < hl->nranges; i += step, nsample++)
+                len += strlen(hl->hr[i]->prefix) + 1;
+            if (nsample > 0)
+                n += len * hl->nranges / nsample;
+        }
+    }
+    RDUNLOCK_HOSTLIST(hl);
+    return n;
+}
+
+int hostlist_get_range(hostlist_t hl, int n, const char **prefix,
+                       unsigned long *lo, unsigned long *hi, int *width)
+{
+    hostrange_t hr;
+
+    RDLOCK_HOSTLIST(hl);
+    if (n < 0 || n >= hl->nranges) {
+        RDUNLOCK_HOSTLIST(hl);
+        seterrno_ret(EINVAL, -1);
+    }
+    hr = hl->hr[n];
+    if (prefix)
+        *prefix = hr->prefix;
+    if (lo)
+        *lo = hr->singlehost ? 0 : hr->lo;
+    if (hi)
+        *hi = hr->singlehost ? 0 : hr->hi;
+    if (width)
+        *width = hr->singlehost ? -1 : hr->width;
+    RDUNLOCK_HOSTLIST(hl);
+    return 0;
+}
+
+/* Return the position of the first occurrence of hn in hl, or -1.
+ * Assumes the hostlist lock is held.
+ */
+static int _hostlist_find(hostlist_t hl, hostname_t hn)
+{
+    int i, count;
+
+    if (hl->keys)
+        return _hostlist_find_key(hl, hn);
+    if (hl->base && hl->base->keys)
+        return _hostlist_find_key(hl->base, hn);
+
+    for (i = 0, count = 0; i < hl->nranges; i++) {
+        int offset = hostrange_hn_within(hl->hr[i], hn);
+        if (offset >= 0)
+            return count + offset;
+        count += hostrange_count(hl->hr[i]);
+    }
+    return -1;
+}
+
+/* Compare the key of find index entry k with the first len chars of s
+ */
+static int _key_cmp(struct hostlist_key *k, const char *s, size_t len)
+{
+    int retval = memcmp(k->key, s, k->len < len ? k->len : len);
+    if (retval == 0 && k->len != len)
+        retval = k->len < len ? -1 : 1;
+    return retval;
+}
+
+/* _hostlist_find() using the find index of a frozen hostlist. Only
+ * ranges with the same key as hn, which may contain its suffix, are
+ * checked.
+ */
+static int _hostlist_find_key(hostlist_t hl, hostname_t hn)
+{
+    struct hostlist_key *k = hl->keys;
+    size_t len = strlen(hn->prefix);
+    unsigned long num = hostname_suffix_is_valid(hn) ? hn->num : 0;
+    int lo, hi, first, last, j;
+    int best = -1, offset = -1;
+
+    /* find the entries [first, last) with the key of hn */
+    lo = 0;
+    hi = hl->nranges;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (_key_cmp(&k[mid], hn->prefix, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    first = lo;
+    hi = hl->nranges;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (_key_cmp(&k[mid], hn->prefix, len) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    last = lo;
+
+    /* hn may match the first range with a smaller index, so check
+     * every candidate and keep the earliest match */
+    for (j = first; j < last && k[j].any; j++) {
+        if (best < 0 || k[j].idx < best) {
+            int rc = hostrange_hn_within(hl->hr[k[j].idx], hn);
+            if (rc >= 0) {
+                best = k[j].idx;
+                offset = rc;
+            }
+        }
+    }
+
+    /* the rest are ordered by lo: skip those starting after num, and
+     * stop once no earlier range reaches num */
+    first = j;
+    lo = first;
+    hi = last;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (k[mid].lo <= num)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (j = lo - 1; j >= first && k[j].maxhi >= num; j--) {
+        if (best < 0 || k[j].idx < best) {
+            int rc = hostrange_hn_within(hl->hr[k[j].idx], hn);
+            if (rc >= 0) {
+                best = k[j].idx;
+                offset = rc;
+            }
+        }
+    }
+
+    return best < 0 ? -1 : _hostlist_offset(hl, best) + offset;
+}
+
+int hostlist_find(hostlist_t hl, const char *hostname)
+{
+    int ret;
+    hostname_t hn;
+
+    if (!hostname)
+        return -1;
+
+    hn = hostname_create(hostname);
+
+    RDLOCK_HOSTLIST(hl);
+    ret = _hostlist_find(hl, hn);
+    RDUNLOCK_HOSTLIST(hl);
+
+    hostname_destroy(hn);
+    return ret;
+}
+
+static int hostlist_threads = 0;
+
+void hostlist_set_threads(int n)
+{
+    hostlist_threads = n > HOSTLIST_MAX_THREADS ? HOSTLIST_MAX_THREADS : n;
+}
+
+/* Return the number of threads to use for an operation on nitems
+ * items: at most one per HOSTLIST_PARALLEL_MIN items.
+ */
+static int _hostlist_nthreads(size_t nitems)
+{
+#if WITH_PTHREADS
+    long n = hostlist_threads;
+    if (n <= 0 && (n = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+        n = 1;
+    if (n > HOSTLIST_MAX_THREADS)
+        n = HOSTLIST_MAX_THREADS;
+    if (n > nitems / HOSTLIST_PARALLEL_MIN)
+        n = nitems / HOSTLIST_PARALLEL_MIN;
+    return n > 1 ? n : 1;
+#else
+    return 1;
+#endif
+}
+
+/* Call fn(arg + i * size) for 0 <= i < n, in n threads including the
+ * caller, and wait for all of them. If a thread cannot be created its
+ * work is done by the caller.
+ */
+static void _hostlist_fork(int n, void *(*fn)(void *), void *arg, size_t size)
+{
+#if WITH_PTHREADS
+    pthread_t tid[HOSTLIST_MAX_THREADS];
+    int created[HOSTLIST_MAX_THREADS];
+    int i;
+
+    assert(n <= HOSTLIST_MAX_THREADS);
+
+    for (i = 1; i < n; i++)
+        created[i] = !pthread_create(&tid[i], NULL, fn,
+                                     (char *) arg + i * size);
+    fn(arg);
+    for (i = 1; i < n; i++) {
+        if (created[i])
+            pthread_join(tid[i], NULL);
+        else
+            fn((char *) arg + i * size);
+    }
+#else
+    int i;
+    for (i = 0; i < n; i++)
+        fn((char *) arg + i * size);
+#endif
+}
+
+/* parallel merge sort: pieces are sorted with qsort() by separate
+ * threads, then merged pairwise, also in parallel.
+ */
+struct _psort {
+    char   *src, *dst;      /* sort src[lo..mid) and src[mid..hi) into dst */
+    size_t  lo, mid, hi;
+    size_t  size;
+    int   (*cmp)(const void *, const void *);
+};
+
+static void *_psort_qsort(void *arg)
+{
+    struct _psort *p = arg;
+    qsort(p->src + p->lo * p->size, p->hi - p->lo, p->size, p->cmp);
+    return NULL;
+}
+
+static void *_psort_merge(void *arg)
+{
+    struct _psort *p = arg;
+    size_t i = p->lo, j = p->mid, k = p->lo;
+
+    while (i < p->mid && j < p->hi) {
+        /* take from the left run on ties to keep runs in order */
+        if (p->cmp(p->src + j * p->size, p->src + i * p->size) < 0)
+            memcpy(p->dst + k++ * p->size, p->src + j++ * p->size, p->size);
+        else
+            memcpy(p->dst + k++ * p->size, p->src + i++ * p->size, p->size);
+    }
+    memcpy(p->dst + k * p->size, p->src + i * p->size, (p->mid - i) * p->size);
+    k += p->mid - i;
+    memcpy(p->dst + k * p->size, p->src + j * p->size, (p->hi - j) * p->size);
+    return NULL;
+}
+
+/* Sort n items of size bytes at base, like qsort(), with up to
+ * nthreads threads. Returns 0 if memory for merging could not be
+ * allocated, in which case base is sorted with qsort().
+ */
+static int _hostlist_qsort(void *base, size_t n, size_t size,
+                           int (*cmp)(const void *, const void *),
+                           int nthreads)
+{
+    struct _psort p[HOSTLIST_MAX_THREADS];
+    size_t bounds[HOSTLIST_MAX_THREADS + 1];
+    int i, nruns;
+    char *tmp, *src, *dst;
+
+    if (nthreads <= 1 || !(tmp = malloc(n * size))) {
+        qsort(base, n, size, cmp);
+        return nthreads <= 1;
+    }
+
+    for (i = 0; i <= nthreads; i++)
+        bounds[i] = n * i / nthreads;
+    for (i = 0; i < nthreads; i++) {
+        p[i].src = base;
+        p[i].lo = bounds[i];
+        p[i].hi = bounds[i + 1];
+        p[i].size = size;
+        p[i].cmp = cmp;
+    }
+    _hostlist_fork(nthreads, _psort_qsort, p, sizeof(p[0]));
+
+    src = base;
+    dst = tmp;
+    for (nruns = nthreads; nruns > 1; nruns = (nruns + 1) / 2) {
+        int nmerge = nruns / 2;
+        for (i = 0; i < nmerge; i++) {
+            p[i].src = src;
+            p[i].dst = dst;
+            p[i].lo = bounds[2 * i];
+            p[i].mid = bounds[2 * i + 1];
+            p[i].hi = bounds[2 * i + 2];
+            bounds[i] = bounds[2 * i];
+        }
+        if (nruns % 2) {
+            /* odd run out is carried over as is */
+            memcpy(dst + bounds[nruns - 1] * size,
+                   src + bounds[nruns - 1] * size,
+                   (n - bounds[nruns - 1]) * size);
+            bounds[nmerge] = bounds[nruns - 1];
+        }
+        bounds[(nruns + 1) / 2] = n;
+        _hostlist_fork(nmerge, _psort_merge, p, sizeof(p[0]));
+        src = dst;
+        dst = (src == base) ? tmp : base;
+    }
+
+    if (src != base)
+        memcpy(base, src, n * size);
+    free(tmp);
+    return 1;
+}
+
+/* compare hostranges with widths set by _hostlist_sort_ranges(): by
+ * prefix, then width, then suffixes. Unlike hostrange_cmp() this is a
+ * total order, so the result of a sort does not depend on the order
+ * of the input or on the sort algorithm.
+ */
+static int _sort_cmp(const void *hr1, const void *hr2)
+{
+    hostrange_t h1 = *(hostrange_t *) hr1;
+    hostrange_t h2 = *(hostrange_t *) hr2;
+    int retval;
+
+    if ((retval = hostrange_prefix_cmp(h1, h2)) != 0)
+        return retval;
+    if (h1->width != h2->width)
+        return h1->width - h2->width;
+    if (h1->lo != h2->lo)
+        return h1->lo < h2->lo ? -1 : 1;
+    if (h1->hi != h2->hi)
+        return h1->hi < h2->hi ? -1 : 1;
+    return 0;
+}
+
+/* Sort the ranges of hl with up to nthreads threads.
+ *
+ * hostrange_cmp() lets a range with no zero padding, e.g. n[10-20],
+ * sort with either unpadded or padded ranges of the same prefix, so
+ * that both n[1-9],n[10-20] and n[01-09],n[10-20] can be joined.
+ * That makes it inconsistent with more than two widths, and the
+ * order qsort() leaves such ranges in is arbitrary. Instead, the
+ * width of each unpadded range is set to the widest padded width of
+ * its prefix it can join, or to 1. This does not change any hostname.
+ * Ranges which can be joined then have equal widths, and are sorted
+ * with _sort_cmp(). Assumes the hostlist lock is held.
+ */
+static void _hostlist_sort_ranges(hostlist_t hl, int nthreads)
+{
+    int i, j, k, regroup;
+
+    for (i = 0; i < hl->nranges; i++) {
+        hostrange_t hr = hl->hr[i];
+        if (!hr->singlehost && _zero_padded(hr->lo, hr->width) == 0)
+            hr->width = 1;
+    }
+
+    _hostlist_qsort(hl->hr, hl->nranges, sizeof(hostrange_t), &_sort_cmp,
+                    nthreads);
+
+    /* Unpadded ranges now lead each prefix. Move those which can join
+     * a padded range of the same prefix behind it.
+     */
+    for (i = 0; i < hl->nranges; i = j) {
+        int widest[HOSTSPAN_MAX_DIGITS + 3];
+        hostrange_t hr = hl->hr[i];
+
+        for (j = i + 1; j < hl->nranges; j++) {
+            if (hostrange_prefix_cmp(hr, hl->hr[j]) != 0)
+                break;
+        }
+        if (hr->singlehost || hr->width != 1 || hl->hr[j - 1]->width == 1)
+            continue;
+
+        memset(widest, 0, sizeof(widest));
+        for (k = j - 1; k > i && hl->hr[k]->width > 1; k--) {
+            if (hl->hr[k]->width < sizeof(widest) / sizeof(int))
+                widest[hl->hr[k]->width] = hl->hr[k]->width;
+        }
+        for (k = 1; k < sizeof(widest) / sizeof(int); k++) {
+            if (widest[k] < widest[k - 1])
+                widest[k] = widest[k - 1];
+        }
+
+        regroup = 0;
+        for (k = i; k < j && hl->hr[k]->width == 1; k++) {
+            int w = widest[_ndigits(hl->hr[k]->lo)];
+            if (w > 1) {
+                hl->hr[k]->width = w;
+                regroup = 1;
+            }
+        }
+        if (regroup)
+            qsort(hl->hr + i, j - i, sizeof(hostrange_t), &_sort_cmp);
+    }
+}
+
+/* returns true if h1 and h2 are sorted together by _sort_cmp(), i.e.
+ * they have the same prefix and width and may share hosts */
+static int _sort_group(hostrange_t h1, hostrange_t h2)
+{
+    return hostrange_prefix_cmp(h1, h2) == 0 && h1->width == h2->width;
+}
+
+static int _ulong_cmp(const void *p1, const void *p2)
+{
+    unsigned long a = *(const unsigned long *) p1;
+    unsigned long b = *(const unsigned long *) p2;
+    return a < b ? -1 : a > b;
+}
+
+/* Coalesce the hosts of the sorted ranges of one group (see
+ * _sort_group()), with lo[0..m) their lowest and hi[0..m) their highest
+ * hosts, both sorted. The hosts are taken in order, duplicates included,
+ * and split into runs of consecutive numbers: a run ends where the next
+ * host is the same or not the next number, so n[1-5],n[3-7] becomes
+ * n[1-3,3-4,4-5,5-7]. The runs are found from the number of ranges
+ * covering each stretch of hosts, without going through the hosts one
+ * at a time where they are covered once.
+ *
+ * If out is NULL the runs are only counted, else the lo and hi of
+ * out[0..n) are set to those of the n runs. Returns n.
+ */
+static size_t _coalesce_runs(const unsigned long *lo, const unsigned long *hi,
+                             size_t m, hostrange_t *out)
+{
+    size_t si = 0, ei = 0, c = 0, n = 0, k;
+    unsigned long x = lo[0], y = 0, h, start = 0;
+    int open = 0;
+
+#define RUN(a, b)                                                            \
+    do {                                                                     \
+        if (out) {                                                           \
+            out[n]->lo = (a);                                                \
+            out[n]->hi = (b);                                                \
+        }                                                                    \
+        n++;                                                                 \
+    } while (0)
+
+    while (ei < m) {
+        /* hosts x..y are covered by c ranges */
+        while (si < m && lo[si] <= x) {
+            si++;
+            c++;
+        }
+        y = hi[ei];
+        if (si < m && lo[si] - 1 < y)
+            y = lo[si] - 1;
+
+        if (c == 1) {
+            if (!open)
+                start = x;
+            open = 1;
+        } else if (!out) {
+            /* each host ends a run, then is a run c - 2 times, then
+             * starts a run */
+            n += (y - x + 1) * (c - 1);
+            open = 1;
+        } else {
+            for (h = x; ; h++) {
+                RUN(open ? start : h, h);
+                for (k = 2; k < c; k++)
+                    RUN(h, h);
+                start = h;
+                open = 1;
+                if (h == y)
+                    break;
+            }
+        }
+
+        while (ei < m && hi[ei] == y) {
+            ei++;
+            c--;
+        }
+        if (c > 0)
+            x = y + 1;
+        else if (si < m) {
+            if (lo[si] - 1 > y) {
+                RUN(start, y);
+                open = 0;
+            }
+            x = lo[si];
+        }
+    }
+    RUN(start, y);
+#undef RUN
+    return n;
+}
+
+/* coalesce the sorted ranges hr[lo..hi) into out
+ */
+struct _pcoal {
+    hostrange_t   *hr;
+    int            lo, hi;
+    unsigned long *rlo, *rhi;   /* lo and hi of each range, by group  */
+    hostrange_t   *out;
+    size_t         n;           /* number of resulting ranges         */
+    int            err;
+};
+
+/* Count the ranges coalescing hr[lo..hi) gives, keeping the sorted lo
+ * and hi of each group for _pcoal_write().
+ */
+static void *_pcoal_count(void *arg)
+{
+    struct _pcoal *p = arg;
+    int i, j, k, m, sorted;
+
+    p->n = 0;
+    if (p->lo >= p->hi)
+        return NULL;
+    p->rlo = malloc((p->hi - p->lo) * sizeof(unsigned long));
+    p->rhi = malloc((p->hi - p->lo) * sizeof(unsigned long));
+    if (!p->rlo || !p->rhi) {
+        p->err = 1;
+        return NULL;
+    }
+
+    for (i = p->lo; i < p->hi; i = j) {
+        unsigned long *rlo = p->rlo + (i - p->lo);
+        unsigned long *rhi = p->rhi + (i - p->lo);
+
+        for (j = i + 1; j < p->hi && _sort_group(p->hr[i], p->hr[j]); j++)
+            ;
+        m = j - i;
+        if (p->hr[i]->singlehost) {
+            p->n += m;
+            continue;
+        }
+        for (k = 0, sorted = 1; k < m; k++) {
+            rlo[k] = p->hr[i + k]->lo;
+            rhi[k] = p->hr[i + k]->hi;
+            if (k > 0 && rhi[k] < rhi[k - 1])
+                sorted = 0;
+        }
+        if (!sorted)
+            qsort(rhi, m, sizeof(unsigned long), &_ulong_cmp);
+        p->n += _coalesce_runs(rlo, rhi, m, NULL);
+    }
+    return NULL;
+}
 
+/* Write the coalesced ranges of hr[lo..hi) to out[0..n). The ranges of
+ * each group are reused for its runs, and copied if there are more runs
+ * than ranges. If a copy fails, the ranges of the group are written as
+ * they are, and n is reduced.
+ */
+static void *_pcoal_write(void *arg)
+{
+    struct _pcoal *p = arg;
+    int i, j, m;
+    size_t k, n = 0, nruns;
+
+    for (i = p->lo; i < p->hi; i = j) {
+        unsigned long *rlo = p->rlo + (i - p->lo);
+        unsigned long *rhi = p->rhi + (i - p->lo);
+
+        for (j = i + 1; j < p->hi && _sort_group(p->hr[i], p->hr[j]); j++)
+            ;
+        m = j - i;
+        nruns = p->hr[i]->singlehost ? m : _coalesce_runs(rlo, rhi, m, NULL);
+
+        for (k = 0; k < nruns && k < m; k++)
+            p->out[n + k] = p->hr[i + k];
+        for (; k < nruns; k++) {
+            if (!(p->out[n + k] = hostrange_copy(p->hr[i])))
+                break;
+        }
+        if (k < nruns) {
+            while (k-- > m)
+                hostrange_destroy(p->out[n + k]);
+            p->err = 1;
+            n += m;
+            continue;
+        }
+        if (!p->hr[i]->singlehost)
+            _coalesce_runs(rlo, rhi, m, p->out + n);
+        for (k = nruns; k < m; k++)
+            hostrange_destroy(p->hr[i + k]);
+        n += nruns;
+    }
+    p->n = n;
+    return NULL;
+}
+
+/* Coalesce the sorted ranges of hl with up to nthreads threads: the
+ * ranges of each group are replaced by the runs of their hosts, see
+ * _coalesce_runs(). The list is cut into pieces where no range overlaps
+ * the ranges of its group before it, each piece is coalesced by one
+ * thread, then the first range of each piece is joined to the end of
+ * the one before if it continues it, giving the same result as a single
+ * pass. If out of memory, sets errno and leaves ranges uncoalesced.
+ * Assumes the hostlist lock is held.
+ */
+static void _hostlist_coalesce(hostlist_t hl, int nthreads)
+{
+    struct _pcoal p[HOSTLIST_MAX_THREADS];
+    hostrange_t *out = NULL;
+    unsigned long maxhi = 0;
+    size_t total = 0, k;
+    int i = 0, t, n;
+
+    memset(p, 0, sizeof(p));
+    for (t = 1; t < nthreads; t++) {
+        int b = (long) hl->nranges * t / nthreads;
+        for (; i < hl->nranges; i++) {
+            hostrange_t hr = hl->hr[i];
+            if (i == 0 || !_sort_group(hl->hr[i - 1], hr) || hr->lo > maxhi) {
+                if (i >= b)
+                    break;
+                maxhi = hr->hi;
+            } else if (hr->hi > maxhi)
+                maxhi = hr->hi;
+        }
+        p[t - 1].hi = p[t].lo = i;
+    }
+    p[nthreads - 1].hi = hl->nranges;
+    for (t = 0; t < nthreads; t++)
+        p[t].hr = hl->hr;
+    _hostlist_fork(nthreads, _pcoal_count, p, sizeof(p[0]));
+
+    for (t = 0; t < nthreads; t++) {
+        if (p[t].err)
+            goto nomem;
+        total += p[t].n;
+    }
+    if (!(out = malloc(total * sizeof(hostrange_t)))
+        || (total > hl->size && !hostlist_resize(hl, total)))
+        goto nomem;
+    for (t = 0, k = 0; t < nthreads; t++) {
+        p[t].hr = hl->hr;
+        p[t].out = out + k;
+        k += p[t].n;
+    }
+    _hostlist_fork(nthreads, _pcoal_write, p, sizeof(p[0]));
+
+    n = 0;
+    for (t = 0; t < nthreads; t++) {
+        for (k = 0; k < p[t].n; k++) {
+            hostrange_t hr = p[t].out[k];
+            if (k == 0 && n > 0 && !hr->singlehost
+                && _sort_group(hl->hr[n - 1], hr)
+                && hl->hr[n - 1]->hi == hr->lo - 1) {
+                hl->hr[n - 1]->hi = hr->hi;
+                hostrange_destroy(hr);
+            } else
+                hl->hr[n++] = hr;
+        }
+        if (p[t].err)
+            errno = ENOMEM;
+    }
+    for (i = n; i < hl->nranges; i++)
+        hl->hr[i] = NULL;
+    hl->nranges = n;
+    hl->njoinable = 0;
+    goto done;
+
+  nomem:
+    errno = ENOMEM;
+  done:
+    free(out);
+    for (t = 0; t < nthreads; t++) {
+        free(p[t].rlo);
+        free(p[t].rhi);
+    }
+}
+
+static void _hostlist_sort(hostlist_t hl, int mt)
+{
+    int nthreads;
+
+    if (hl->frozen) {
+        errno = EPERM;
+        return;
+    }
+    LOCK_HOSTLIST(hl);
+
+    if (hl->nranges <= 1 || !_hostlist_own(hl)) {
+        UNLOCK_HOSTLIST(hl);
+        return;
+    }
+    nthreads = mt ? _hostlist_nthreads(hl->nranges) : 1;
+
+    _hostlist_sort_ranges(hl, nthreads);
+    _hostlist_coalesce(hl, nthreads);
+
+    /* reset all iterators */
+    _hostlist_reorder(hl);
+
+    UNLOCK_HOSTLIST(hl);
+}
+
+void hostlist_sort(hostlist_t hl)
+{
+    _hostlist_sort(hl, 0);
+}
+
+void hostlist_sort_mt(hostlist_t hl)
+{
+    _hostlist_sort(hl, 1);
+}
+
+
+/* Join each range of hl with the ranges after it which continue it.
+ * The order of hosts does not change, so iterators keep their place.
+ * Assumes the hostlist lock is held.
+ */
+static void _hostlist_compact(hostlist_t hl)
+{
+    int i, n = 0, first = -1;
+
+    for (i = 1; i < hl->nranges; i++) {
+        if (hostrange_adjacent(hl->hr[n], hl->hr[i])) {
+            hl->hr[n]->hi = hl->hr[i]->hi;
+            hostrange_destroy(hl->hr[i]);
+            if (first < 0)
+                first = n;
+        } else
+            hl->hr[++n] = hl->hr[i];
+    }
+    if (first >= 0) {
+        for (i = n + 1; i < hl->nranges; i++)
+            hl->hr[i] = NULL;
+        hl->nranges = n + 1;
+        _hostlist_touch(hl, first);
+    }
+    hl->njoinable = 0;
+}
+
+void hostlist_set_compact_ratio(hostlist_t hl, double ratio)
+{
+    /* frozen lists are never modified, so never compacted */
+    if (hl->frozen)
+        return;
+
+    LOCK_HOSTLIST(hl);
+    hl->compact_ratio = ratio;
+    UNLOCK_HOSTLIST(hl);
+}
+
+/* Compact hl if enough of its ranges could be joined. Called when
+ * the write lock is dropped.
+ */
+static void _hostlist_autocompact(hostlist_t hl)
+{
+    /* ranges shared with a base list are never modified in place */
+    if (hl->base || hl->njoinable < HOSTLIST_COMPACT_MIN
+        || hl->compact_ratio <= 0)
+        return;
+    if (hl->nranges < hl->compact_ratio * (hl->nranges - hl->njoinable))
+        return;
+    _hostlist_compact(hl);
+    hl->ncompact++;
+}
+
+unsigned long hostlist_ncompactions(hostlist_t hl)
+{
+    unsigned long n;
+
+    RDLOCK_HOSTLIST(hl);
+    n = hl->ncompact;
+    RDUNLOCK_HOSTLIST(hl);
+    return n;
+}
+
+/* attempt to join ranges at loc and loc-1 in a hostlist  */
+/* delete duplicates, return the number of hosts deleted  */
+/* assumes that the hostlist hl has been locked by caller */
+/* returns -1 if no range join occurred */
+static int _attempt_range_join(hostlist_t hl, int loc)
+{
+    int ndup;
+    assert(hl != NULL);
+    assert(hl->magic == HOSTLIST_MAGIC);
+    assert(loc > 0);
+    assert(loc < hl->nranges);
+    ndup = hostrange_join(hl->hr[loc - 1], hl->hr[loc]);
+    if (ndup >= 0) {
+        _hostlist_touch(hl, loc - 1);
+        hostlist_delete_range(hl, loc);
+        hl->nhosts -= ndup;
+    }
+    return ndup;
+}
+
+/* join runs of sorted ranges hr[lo..hi) into hr[lo..n)
+ */
+struct _pjoin {
+    hostrange_t  *hr;
+    int           lo, hi, n;
+    unsigned long ndup;
+};
+
+static void *_pjoin_runs(void *arg)
+{
+    struct _pjoin *p = arg;
+    int i, n = p->lo;
+    int ndup;
+
+    for (i = p->lo + 1; i < p->hi; i++) {
+        if ((ndup = hostrange_join(p->hr[n], p->hr[i])) >= 0) {
+            p->ndup += ndup;
+            hostrange_destroy(p->hr[i]);
+        } else
+            p->hr[++n] = p->hr[i];
+    }
+    p->n = n + 1;
+    return NULL;
+}
+
+/* Join the sorted ranges of hl, removing duplicate hosts, with up to
+ * nthreads threads. Each thread joins the ranges of one piece of the
+ * list, then the ranges at the start of each piece are joined to the
+ * end of the one before, giving the same result as a single pass.
+ * Assumes the hostlist lock is held.
+ */
+static void _hostlist_join_ranges(hostlist_t hl, int nthreads)
+{
+    struct _pjoin p[HOSTLIST_MAX_THREADS];
+    unsigned long ndup = 0;
+    int i, t, n;
+
+    for (t = 0; t < nthreads; t++) {
+        p[t].hr = hl->hr;
+        p[t].lo = (long) hl->nranges * t / nthreads;
+        p[t].hi = (long) hl->nranges * (t + 1) / nthreads;
+        p[t].ndup = 0;
+    }
+    _hostlist_fork(nthreads, _pjoin_runs, p, sizeof(p[0]));
+
+    n = p[0].n;
+    ndup = p[0].ndup;
+    for (t = 1; t < nthreads; t++) {
+        int joining = 1;
+        ndup += p[t].ndup;
+        for (i = p[t].lo; i < p[t].n; i++) {
+            int m = joining ? hostrange_join(hl->hr[n - 1], hl->hr[i]) : -1;
+            if (m >= 0) {
+                ndup += m;
+                hostrange_destroy(hl->hr[i]);
+            } else {
+                joining = 0;
+                hl->hr[n++] = hl->hr[i];
+            }
+        }
+    }
+    for (i = n; i < hl->nranges; i++)
+        hl->hr[i] = NULL;
+    hl->nranges = n;
+    hl->nhosts -= ndup;
+    hl->njoinable = 0;
+}
+
+static void _hostlist_uniq(hostlist_t hl, int mt)
+{
+    int nthreads;
+
+    if (hl->frozen) {
+        errno = EPERM;
+        return;
+    }
+    LOCK_HOSTLIST(hl);
+    if (hl->nranges <= 1 || !_hostlist_own(hl)) {
+        UNLOCK_HOSTLIST(hl);
+        return;
+    }
+    nthreads = mt ? _hostlist_nthreads(hl->nranges) : 1;
+
+    _hostlist_sort_ranges(hl, nthreads);
+    _hostlist_join_ranges(hl, nthreads);
+
+    /* reset all iterators */
+    _hostlist_reorder(hl);
+
+    UNLOCK_HOSTLIST(hl);
+}
+
+void hostlist_uniq(hostlist_t hl)
+{
+    _hostlist_uniq(hl, 0);
+}
+
+void hostlist_uniq_mt(hostlist_t hl)
+{
+    _hostlist_uniq(hl, 1);
+}
+
+
+/* Consistent hashing of hosts onto shards. A host is hashed as its
+ * hostname (FNV-1a), but without formatting it: the hash of a range's
+ * prefix is computed once and continued with the digits of each host
+ * number, so a host hashes the same whichever range holds it. Shards
+ * are chosen with the jump consistent hash of Lamping and Veach, so
+ * going from n to n + 1 shards moves only 1/(n + 1) of the hosts, all
+ * onto the new shard.
+ */
+#define HASH_FNV_PRIME  UINT64_C(1099511628211)
+
+static uint64_t _hash_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= UINT64_C(0xbf58476d1ce4e5b9);
+    x ^= x >> 27;
+    x *= UINT64_C(0x94d049bb133111eb);
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t _hash_string(const char *s, unsigned long seed)
+{
+    uint64_t h = UINT64_C(14695981039346656037) ^ _hash_mix(seed);
+    while (*s)
+        h = (h ^ (unsigned char) *s++) * HASH_FNV_PRIME;
+    return h;
+}
+
+/* continue hash h of a prefix with host number num, zero padded to
+ * width digits */
+static uint64_t _hash_suffix(uint64_t h, unsigned long num, int width)
+{
+    char digits[32];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + num % 10;
+        num /= 10;
+    } while (num);
+    for (; width > n; width--)
+        h = (h ^ '0') * HASH_FNV_PRIME;
+    while (n--)
+        h = (h ^ (unsigned char) digits[n]) * HASH_FNV_PRIME;
+    return h;
+}
+
+static int _jump_hash(uint64_t key, int nbuckets)
+{
+    int64_t b = -1, j = 0;
+
+    while (j < nbuckets) {
+        b = j;
+        key = key * UINT64_C(2862933555777941757) + 1;
+        j = (int64_t) ((b + 1) * ((double) (INT64_C(1) << 31)
+                                  / (double) ((key >> 33) + 1)));
+    }
+    return (int) b;
+}
+
+int hostlist_hash_shard(const char *hostname, int nshards, unsigned long seed)
+{
+    if (hostname == NULL || nshards < 1)
+        seterrno_ret(EINVAL, -1);
+    return _jump_hash(_hash_mix(_hash_string(hostname, seed)), nshards);
+}
+
+/* parallel hash partition: each thread sorts the hosts at positions
+ * [pos, pos + n) of hl, starting at host off of range r, into its own
+ * set of shards. The shards of all threads are then joined in order.
+ */
+struct _phash {
+    hostlist_t hl;
+    int r;
+    unsigned long off;
+    int n;
+    int nshards;
+    unsigned long seed;
+    hostlist_t *out;
+    int err;
+};
+
+/* Return true if host num of range hr directly follows the last host
+ * of range tail, so that tail may be extended to hold it.
+ */
+static int _hostrange_continues(hostrange_t tail, hostrange_t hr,
+                                unsigned long num)
+{
+    return (!tail->singlehost && !hr->singlehost
+            && tail->width == hr->width
+            && hostrange_prefix_cmp(tail, hr) == 0
+            && tail->hi == num - 1);
+}
+
+/* Append host num of range hr of the list being partitioned to shard
+ * hl, extending the last range of the shard if it holds the host
+ * just before it.
+ */
+static int _hostlist_append_host(hostlist_t hl, hostrange_t hr,
+                                 unsigned long num)
+{
+    hostrange_t tail = hl->nranges ? hl->hr[hl->nranges - 1] : NULL;
+
+    if (tail && _hostrange_continues(tail, hr, num)) {
+        tail->hi = num;
+        hl->nhosts++;
+        return 0;
+    }
+    if (hl->nranges == hl->size && !hostlist_expand(hl))
+        return -1;
+    if (hr->singlehost)
+        tail = hostrange_copy(hr);
+    else
+        tail = hostrange_create(hr->prefix, num, num, hr->width);
+    if (tail == NULL)
+        return -1;
+    hl->hr[hl->nranges++] = tail;
+    hl->nhosts++;
+    return 0;
+}
+
+/* Move the ranges of shard src onto the end of shard dst, joining the
+ * first of them to the last range of dst the same way
+ * _hostlist_append_host() would, so that the result does not depend on
+ * where the hosts were split between threads.
+ */
+static int _hostlist_append_shard(hostlist_t dst, hostlist_t src)
+{
+    int i = 0;
+
+    if (src->nranges == 0)
+        return 0;
+    if (dst->nranges + src->nranges > dst->size
+        && !hostlist_resize(dst, dst->nranges + src->nranges))
+        return -1;
+    if (dst->nranges
+        && _hostrange_continues(dst->hr[dst->nranges - 1], src->hr[0],
+                                src->hr[0]->lo)) {
+        dst->hr[dst->nranges - 1]->hi = src->hr[0]->hi;
+        hostrange_destroy(src->hr[0]);
+        src->hr[0] = NULL;
+        i = 1;
+    }
+    for (; i < src->nranges; i++) {
+        dst->hr[dst->nranges++] = src->hr[i];
+        src->hr[i] = NULL;
+    }
+    dst->nhosts += src->nhosts;
+    src->nranges = 0;
+    src->nhosts = 0;
+    return 0;
+}
+
+static void *_phash_hosts(void *arg)
+{
+    struct _phash *p = arg;
+    hostlist_t hl = p->hl;
+    unsigned long off = p->off;
+    int i, s, n = p->n;
+
+    for (i = p->r; n > 0 && i < hl->nranges; i++, off = 0) {
+        hostrange_t hr = hl->hr[i];
+        uint64_t h;
+        unsigned long num;
+
+        if (hr->singlehost) {
+            s = _jump_hash(_hash_mix(_hash_string(hr->prefix, p->seed)),
+                           p->nshards);
+            if (_hostlist_append_host(p->out[s], hr, 0) < 0)
+                goto error;
+            n--;
+            continue;
+        }
+        h = _hash_string(hr->prefix, p->seed);
+        for (num = hr->lo + off; ; num++) {
+            s = _jump_hash(_hash_mix(_hash_suffix(h, num, hr->width)),
+                           p->nshards);
+            if (_hostlist_append_host(p->out[s], hr, num) < 0)
+                goto error;
+            if (--n == 0 || num == hr->hi)
+                break;
+        }
+    }
+    return NULL;
+
+  error:
+    p->err = 1;
+    return NULL;
+}
+
+hostlist_t *hostlist_hash_partition(hostlist_t hl, int nshards,
+                                    unsigned long seed)
+{
+    struct _phash p[HOSTLIST_MAX_THREADS];
+    hostlist_t *parts = NULL;
+    int i, s, t, nthreads, pos, err = 0;
+
+    if (hl == NULL || nshards < 1)
+        seterrno_ret(EINVAL, NULL);
+
+    RDLOCK_HOSTLIST(hl);
+    nthreads = _hostlist_nthreads(hl->nhosts);
+    memset(p, 0, sizeof(p));
+
+    /* each thread takes an equal share of the hosts */
+    for (t = 0, i = 0, pos = 0; t < nthreads; t++) {
+        int start = (long) hl->nhosts * t / nthreads;
+        while (i < hl->nranges
+               && pos + (int) hostrange_count(hl->hr[i]) <= start) {
+            pos += hostrange_count(hl->hr[i]);
+            i++;
+        }
+        p[t].hl = hl;
+        p[t].r = i;
+        p[t].off = start - pos;
+        p[t].n = (long) hl->nhosts * (t + 1) / nthreads - start;
+        p[t].nshards = nshards;
+        p[t].seed = seed;
+        if (!(p[t].out = calloc(nshards, sizeof(hostlist_t))))
+            goto done;
+        for (s = 0; s < nshards; s++)
+            if (!(p[t].out[s] = hostlist_new()))
+                goto done;
+    }
+    _hostlist_fork(nthreads, _phash_hosts, p, sizeof(p[0]));
+
+    for (t = 0; t < nthreads; t++)
+        err |= p[t].err;
+    for (s = 0; s < nshards && !err; s++) {
+        for (t = 1; t < nthreads; t++)
+            if (_hostlist_append_shard(p[0].out[s], p[t].out[s]) < 0)
+                err = 1;
+        _hostlist_index(p[0].out[s]);
+    }
+    if (!err) {
+        parts = p[0].out;
+        p[0].out = NULL;
+    }
+
+  done:
+    RDUNLOCK_HOSTLIST(hl);
+    for (t = 0; t < nthreads; t++) {
+        for (s = 0; p[t].out && s < nshards; s++)
+            hostlist_destroy(p[t].out[s]);
+        free(p[t].out);
+    }
+    if (parts == NULL)
+        errno = ENOMEM;
+    return parts;
+}
+
+
+/* ----[ hostlist set operations ]---- */
+
+static unsigned long _pow10(int n)
+{
+    unsigned long r = 1;
+    while (n-- > 0)
+        r *= 10;
+    return r;
+}
+
+static int _hostspans_push(struct hostspans *v, const char *key, size_t klen,
+                           int len, int idx, unsigned long lo,
+                           unsigned long hi)
+{
+    struct hostspan *sp;
+
+    if (v->n == v->size) {
+        size_t size = v->size ? 2 * v->size : 64;
+        if (!(sp = realloc(v->s, size * sizeof(*sp))))
+            return 0;
+        v->s = sp;
+        v->size = size;
+    }
+    sp = &v->s[v->n++];
+    sp->key = key;
+    sp->klen = klen;
+    sp->len = len;
+    sp->idx = idx;
+    sp->lo = lo;
+    sp->hi = hi;
+    return 1;
+}
+
+/* Append the spans of the hosts in hr to v. A range is split into
+ * one span for each suffix length it contains, e.g. n[8-12] gives
+ * n + [8-9] and n + [10-12]. Digits at the end of the prefix become
+ * part of the suffix. Single hosts with a suffix over MAX_HOST_SUFFIX
+ * are keyed by their whole name, as hostname_create() treats them.
+ * Returns 1, 0 if out of memory, or -1 if hr has hostnames with more
+ * than HOSTSPAN_MAX_DIGITS trailing digits or a suffix over
+ * MAX_HOST_SUFFIX.
+ */
+static int _hostrange_spans(hostrange_t hr, int idx, struct hostspans *v)
+{
+    size_t plen = strlen(hr->prefix);
+    size_t klen = host_prefix_end(hr->prefix) + 1;
+    int d = plen - klen;
+    unsigned long dval = 0, x, end;
+    size_t i;
+
+    if (hr->singlehost) {
+        if (d > 0 && d <= HOSTSPAN_MAX_DIGITS
+            && (x = strtoul(hr->prefix + klen, NULL, 10)) <= MAX_HOST_SUFFIX)
+            return _hostspans_push(v, hr->prefix, klen, d, idx, x, x);
+        return _hostspans_push(v, hr->prefix, plen, 0, idx, 0, 0);
+    }
+
+    if (d > HOSTSPAN_MAX_DIGITS)
+        return -1;
+    for (i = klen; i < plen; i++)
+        dval = dval * 10 + (hr->prefix[i] - '0');
+
+    for (x = hr->lo; x <= hr->hi; x = end + 1) {
+        int m = _ndigits(x) > hr->width ? _ndigits(x) : hr->width;
+        unsigned long base;
+
+        if (d + m > HOSTSPAN_MAX_DIGITS)
+            return -1;
+        base = dval * _pow10(m);
+        end = _pow10(m) - 1;
+        if (end > hr->hi)
+            end = hr->hi;
+        if (base + end > MAX_HOST_SUFFIX)
+            return -1;
+        if (!_hostspans_push(v, hr->prefix, klen, d + m, idx,
+                             base + x, base + end))
+            return 0;
+        if (end == hr->hi)
+            break;
+    }
+    return 1;
+}
+
+/* compare span key and suffix length */
+static int _hostspan_group_cmp(const struct hostspan *a,
+                               const struct hostspan *b)
+{
+    size_t len = a->klen < b->klen ? a->klen : b->klen;
+    int retval;
+
+    if ((retval = memcmp(a->key, b->key, len)) != 0)
+        return retval;
+    if (a->klen != b->klen)
+        return a->klen < b->klen ? -1 : 1;
+    return a->len - b->len;
+}
+
+static int _hostspan_cmp(const void *p1, const void *p2)
+{
+    const struct hostspan *a = p1;
+    const struct hostspan *b = p2;
+    int retval;
+
+    if ((retval = _hostspan_group_cmp(a, b)) != 0)
+        return retval;
+    if (a->lo != b->lo)
+        return a->lo < b->lo ? -1 : 1;
+    if (a->hi != b->hi)
+        return a->hi < b->hi ? -1 : 1;
+    return 0;
+}
+
+/* Append the spans of the hosts of hl to v, unsorted. Returns as
+ * _hostrange_spans(). Assumes the hostlist lock is held.
+ */
+static int _hostlist_add_spans(hostlist_t hl, struct hostspans *v)
+{
+    size_t i;
+    int rc;
+
+    for (i = 0; i < hl->nranges; i++) {
+        if ((rc = _hostrange_spans(hl->hr[i], i, v)) <= 0)
+            return rc;
+    }
+    return 1;
+}
+
+/* Sort the spans of v and join those which overlap or are adjacent.
+ */
+static void _hostspans_join(struct hostspans *v)
+{
+    size_t i, n;
+
+    if (v->n == 0)
+        return;
+
+    _hostlist_qsort(v->s, v->n, sizeof(*v->s), &_hostspan_cmp,
+                    _hostlist_nthreads(v->n));
+
+    for (i = 1, n = 0; i < v->n; i++) {
+        struct hostspan *prev = &v->s[n], *sp = &v->s[i];
+        if (_hostspan_group_cmp(prev, sp) == 0 && sp->lo <= prev->hi + 1) {
+            if (sp->hi > prev->hi)
+                prev->hi = sp->hi;
+        } else
+            v->s[++n] = *sp;
+    }
+    v->n = n + 1;
+}
+
+/* Fill v with the hosts of hl as sorted spans, without overlapping
+ * or adjacent spans. Returns as _hostrange_spans().
+ * Assumes the hostlist lock is held.
+ */
+static int _hostlist_spans(hostlist_t hl, struct hostspans *v)
+{
+    int rc;
+
+    if ((rc = _hostlist_add_spans(hl, v)) > 0)
+        _hostspans_join(v);
+    return rc;
+}
+
+/* Return the index of the first span in s[0..n) which is not wholly
+ * before host lo in the group of span g.
+ */
+static size_t _hostspans_search(struct hostspan *s, size_t n,
+                                struct hostspan *g, unsigned long lo)
+{
+    size_t l = 0, h = n;
+
+    while (l < h) {
+        size_t mid = l + (h - l) / 2;
+        int c = _hostspan_group_cmp(&s[mid], g);
+        if (c < 0 || (c == 0 && s[mid].hi < lo))
+            l = mid + 1;
+        else
+            h = mid;
+    }
+    return l;
+}
+
+/* Subtract the spans in b[0..nb) from the hosts lo..hi of span a,
+ * calling fn(arg, a, lo, hi) for each run of hosts left. Returns the
+ * index in b from which to continue with the next span after a.
+ */
+static size_t _hostspan_subtract(struct hostspan *a, unsigned long lo,
+                                 struct hostspan *b, size_t nb, size_t j,
+                                 int (*fn)(void *, struct hostspan *,
+                                           unsigned long, unsigned long),
+                                 void *arg, int *err)
+{
+    unsigned long cur = lo;
+
+    while (j < nb && _hostspan_group_cmp(&b[j], a) == 0 && b[j].lo <= a->hi) {
+        if (b[j].lo > cur && !fn(arg, a, cur, b[j].lo - 1))
+            *err = 1;
+        if (b[j].hi >= a->hi)
+            return j;
+        cur = b[j].hi + 1;
+        j++;
+    }
+    if (!fn(arg, a, cur, a->hi))
+        *err = 1;
+    return j;
+}
+
+/* set operations between hostlists run over pieces of the first list,
+ * each in its own thread */
+struct _setop {
+    hostlist_t       hl;    /* first list (for difference)            */
+    struct hostspan *a;     /* sorted spans of the first list ...     */
+    size_t           na;
+    struct hostspan *b;     /* ... and of the second                  */
+    size_t           nb;
+    size_t           lo, hi;/* piece of a, or of hl->hr, to work on   */
+    struct hostspans out;   /* resulting spans                         */
+    hostrange_t     *hr;    /* resulting ranges (for difference)       */
+    size_t           nhr;
+    size_t           size;
+    int              last;  /* range the last of hr was taken from     */
+    int              err;   /* 1 if out of memory, -1 if not spannable */
+};
+
+static int _setop_push_span(void *arg, struct hostspan *sp,
+                            unsigned long lo, unsigned long hi)
+{
+    struct _setop *op = arg;
+    return _hostspans_push(&op->out, sp->key, sp->klen, sp->len, sp->idx,
+                           lo, hi);
+}
+
+static void *_setop_intersect(void *arg)
+{
+    struct _setop *op = arg;
+    size_t i = op->lo, j;
+
+    if (i >= op->hi)
+        return NULL;
+    j = _hostspans_search(op->b, op->nb, &op->a[i], op->a[i].lo);
+
+    while (i < op->hi && j < op->nb) {
+        struct hostspan *a = &op->a[i], *b = &op->b[j];
+        int c = _hostspan_group_cmp(a, b);
+        if (c < 0)
+            i++;
+        else if (c > 0)
+            j++;
+        else {
+            unsigned long lo = a->lo > b->lo ? a->lo : b->lo;
+            unsigned long hi = a->hi < b->hi ? a->hi : b->hi;
+            if (lo <= hi && !_setop_push_span(op, a, lo, hi))
+                op->err = 1;
+            if (a->hi < b->hi)
+                i++;
+            else
+                j++;
+        }
+    }
+    return NULL;
+}
+
+static void *_setop_subtract(void *arg)
+{
+    struct _setop *op = arg;
+    size_t i, j;
+
+    if (op->lo >= op->hi)
+        return NULL;
+    j = _hostspans_search(op->b, op->nb, &op->a[op->lo], op->a[op->lo].lo);
+    for (i = op->lo; i < op->hi; i++) {
+        struct hostspan *a = &op->a[i];
+        while (j < op->nb && (_hostspan_group_cmp(&op->b[j], a) < 0
+               || (_hostspan_group_cmp(&op->b[j], a) == 0
+                   && op->b[j].hi < a->lo)))
+            j++;
+        j = _hostspan_subtract(a, a->lo, op->b, op->nb, j,
+                               _setop_push_span, op, &op->err);
+    }
+    return NULL;
+}
+
+/* Add hosts lo..hi of span sp, taken from range hl->hr[sp->idx], to the
+ * ranges resulting from a difference, in the format of that range.
+ */
+static int _setop_push_range(void *arg, struct hostspan *sp,
+                             unsigned long lo, unsigned long hi)
+{
+    struct _setop *op = arg;
+    hostrange_t src = op->hl->hr[sp->idx];
+    hostrange_t new;
+    unsigned long base = 0;
+
+    if (!src->singlehost) {
+        /* suffix digits from the prefix make up the top of lo and hi */
+        int m = sp->len - (strlen(src->prefix) - sp->klen);
+        base = sp->lo - sp->lo % _pow10(m);
+    }
+
+    /* pieces of a range split only by suffix length are rejoined */
+    if (op->nhr > 0 && op->last == sp->idx && !src->singlehost
+        && op->hr[op->nhr - 1]->hi == lo - base - 1) {
+        op->hr[op->nhr - 1]->hi = hi - base;
+        return 1;
+    }
+
+    if (op->nhr == op->size) {
+        size_t size = op->size ? 2 * op->size : 64;
+        hostrange_t *hr = realloc(op->hr, size * sizeof(*hr));
+        if (!hr)
+            return 0;
+        op->hr = hr;
+        op->size = size;
+    }
+    if (src->singlehost)
+        new = hostrange_create_single(src->prefix);
+    else
+        new = hostrange_create(src->prefix, lo - base, hi - base, src->width);
+    if (!new)
+        return 0;
+    op->hr[op->nhr++] = new;
+    op->last = sp->idx;
+    return 1;
+}
+
+static void *_setop_difference(void *arg)
+{
+    struct _setop *op = arg;
+    struct hostspans v = { NULL, 0, 0 };
+    size_t i, k;
+
+    for (i = op->lo; i < op->hi && !op->err; i++) {
+        int rc;
+        v.n = 0;
+        if ((rc = _hostrange_spans(op->hl->hr[i], i, &v)) <= 0) {
+            op->err = rc < 0 ? -1 : 1;
+            break;
+        }
+        for (k = 0; k < v.n; k++) {
+            struct hostspan *a = &v.s[k];
+            size_t j = _hostspans_search(op->b, op->nb, a, a->lo);
+            _hostspan_subtract(a, a->lo, op->b, op->nb, j,
+                               _setop_push_range, op, &op->err);
+        }
+    }
+    free(v.s);
+    return NULL;
+}
+
+/* Append range hr to hl without joining it to the last range.
+ * Assumes hl is not shared with any other thread.
+ */
+static int _hostlist_append_range(hostlist_t hl, hostrange_t hr)
+{
+    if (hl->nranges == hl->size && !hostlist_expand(hl))
+        return 0;
+    hl->hr[hl->nranges++] = hr;
+    hl->nhosts += hostrange_count(hr);
+    return 1;
+}
+
+/* Append the hosts of span sp to hl as a single range.
+ */
+static int _hostlist_append_span(hostlist_t hl, struct hostspan *sp)
+{
+    char buf[MAXHOSTNAMELEN + 32];
+    char *key = buf;
+    hostrange_t hr;
+    int rc = 0;
+
+    if (sp->klen + 1 > sizeof(buf) && !(key = malloc(sp->klen + 1)))
+        return 0;
+    memcpy(key, sp->key, sp->klen);
+    key[sp->klen] = '\0';
+
+    if (sp->len == 0)
+        hr = hostrange_create_single(key);
+    else
+        hr = hostrange_create(key, sp->lo, sp->hi, sp->len);
+    if (hr && _hostlist_append_range(hl, hr))
+        rc = 1;
+    else if (hr)
+        hostrange_destroy(hr);
+
+    if (key != buf)
+        free(key);
+    return rc;
+}
+
+/* Hosts of h1 not in h2, one host at a time. Used if the hostnames
+ * cannot be handled as spans.
+ */
+static hostlist_t _hostlist_difference_hosts(hostlist_t h1, hostlist_t h2)
+{
+    hostlist_t new = hostlist_copy(h1);
+    hostlist_iterator_t i;
+    char *host;
+
+    if (!new || !(i = hostlist_iterator_create(h2)))
+        return new;
+    while ((host = hostlist_next(i))) {
+        while (hostlist_delete_host(new, host))
+            ;
+        free(host);
+    }
+    hostlist_iterator_destroy(i);
+    return new;
+}
+
+/* Hosts of h1 which are (intersect != 0) or are not in h2, one host
+ * at a time. Used if the hostnames cannot be handled as spans.
+ */
+static int _hostlist_push_hosts(hostlist_t new, hostlist_t h1,
+                                hostlist_t h2, int intersect)
+{
+    hostlist_iterator_t i = hostlist_iterator_create(h1);
+    char *host;
+
+    if (!i)
+        return 0;
+    while ((host = hostlist_next(i))) {
+        if ((hostlist_find(h2, host) >= 0) == intersect)
+            hostlist_push_host(new, host);
+        free(host);
+    }
+    hostlist_iterator_destroy(i);
+    return 1;
+}
+
+enum { SETOP_INTERSECT, SETOP_XOR, SETOP_DIFFERENCE, SETOP_UNION };
+
+/* Perform set operation type on hostlists h1 and h2 a range at a time,
+ * with the work split between threads. Returns the result, or NULL
+ * and sets errno. *slow is set if the hostnames cannot be handled as
+ * spans, in which case NULL is also returned.
+ */
+static hostlist_t _hostlist_setop_spans(hostlist_t h1, hostlist_t h2,
+                                        int type, int *slow)
+{
+    struct _setop op[HOSTLIST_MAX_THREADS];
+    struct hostspans a = { NULL, 0, 0 }, b = { NULL, 0, 0 };
+    hostlist_t new = NULL;
+    int nthreads, i, pass, rc;
+    size_t k, n;
+
+    if (type == SETOP_UNION) {
+        /* the spans of both lists, joined as those of a single list */
+        if ((rc = _hostlist_add_spans(h1, &a)) <= 0
+            || (rc = _hostlist_add_spans(h2, &a)) <= 0)
+            goto done;
+        _hostspans_join(&a);
+    } else if ((rc = _hostlist_spans(h2, &b)) <= 0
+        || (type != SETOP_DIFFERENCE && (rc = _hostlist_spans(h1, &a)) <= 0))
+        goto done;
+    if (!(new = hostlist_new())) {
+        rc = 0;
+        goto done;
+    }
+
+    if (type == SETOP_UNION) {
+        for (k = 0; k < a.n && rc > 0; k++)
+            rc = _hostlist_append_span(new, &a.s[k]);
+        goto done;
+    }
+
+    for (pass = 0; pass < (type == SETOP_XOR ? 2 : 1); pass++) {
+        struct hostspans *x = pass ? &b : &a;
+        struct hostspans *y = pass ? &a : &b;
+        void *(*fn)(void *);
+
+        n = type == SETOP_DIFFERENCE ? h1->nranges : x->n;
+        nthreads = _hostlist_nthreads(n);
+        fn = type == SETOP_INTERSECT ? _setop_intersect
+           : type == SETOP_XOR ? _setop_subtract : _setop_difference;
+
+        for (i = 0; i < nthreads; i++) {
+            memset(&op[i], 0, sizeof(op[i]));
+            op[i].hl = h1;
+            op[i].a = x->s;
+            op[i].na = x->n;
+            op[i].b = y->s;
+            op[i].nb = y->n;
+            op[i].lo = n * i / nthreads;
+            op[i].hi = n * (i + 1) / nthreads;
+            op[i].last = -1;
+        }
+        _hostlist_fork(nthreads, fn, op, sizeof(op[0]));
+
+        /* results are appended in the order of the pieces of h1 */
+        for (i = 0, rc = 1; i < nthreads; i++) {
+            for (k = 0; k < op[i].out.n && rc > 0; k++)
+                rc = _hostlist_append_span(new, &op[i].out.s[k]);
+            for (k = 0; k < op[i].nhr; k++) {
+                if (rc > 0)
+                    rc = _hostlist_append_range(new, op[i].hr[k]);
+                else
+                    hostrange_destroy(op[i].hr[k]);
+            }
+            if (op[i].err && rc > 0)
+                rc = op[i].err < 0 ? -1 : 0;
+            free(op[i].out.s);
+            free(op[i].hr);
+        }
+        if (rc <= 0)
+            goto done;
+    }
+
+  done:
+    free(a.s);
+    free(b.s);
+    if (rc <= 0) {
+        hostlist_destroy(new);
+        *slow = (rc < 0);
+        errno = ENOMEM;
+        return NULL;
+    }
+    _hostlist_index(new);
+    return new;
+}
+
+static hostlist_t _hostlist_setop(hostlist_t h1, hostlist_t h2, int type)
+{
+    hostlist_t new;
+    int slow = 0;
+
+    if (h1 == NULL || h2 == NULL)
+        seterrno_ret(EINVAL, NULL);
+
+    RDLOCK_HOSTLIST(h1);
+    if (h2 != h1)
+        RDLOCK_HOSTLIST(h2);
+    new = _hostlist_setop_spans(h1, h2, type, &slow);
+    if (h2 != h1)
+        RDUNLOCK_HOSTLIST(h2);
+    RDUNLOCK_HOSTLIST(h1);
+
+    if (slow) {
+        /* suffixes too long for spans, do it one host at a time */
+        if (type == SETOP_DIFFERENCE)
+            return _hostlist_difference_hosts(h1, h2);
+        if (type == SETOP_UNION) {
+            if ((new = hostlist_copy(h1))) {
+                hostlist_push_list(new, h2);
+                hostlist_uniq(new);
+            }
+            return new;
+        }
+        if (!(new = hostlist_new()))
+            return NULL;
+        _hostlist_push_hosts(new, h1, h2, type == SETOP_INTERSECT);
+        if (type == SETOP_XOR)
+            _hostlist_push_hosts(new, h2, h1, 0);
+    }
+    if (new && type != SETOP_DIFFERENCE)
+        hostlist_uniq(new);
+    return new;
+}
+
+hostlist_t hostlist_intersect(hostlist_t h1, hostlist_t h2)
+{
+    return _hostlist_setop(h1, h2, SETOP_INTERSECT);
+}
+
+hostlist_t hostlist_xor(hostlist_t h1, hostlist_t h2)
+{
+    return _hostlist_setop(h1, h2, SETOP_XOR);
+}
+
+hostlist_t hostlist_difference(hostlist_t h1, hostlist_t h2)
+{
+    return _hostlist_setop(h1, h2, SETOP_DIFFERENCE);
+}
+
+hostlist_t hostlist_union(hostlist_t h1, hostlist_t h2)
+{
+    return _hostlist_setop(h1, h2, SETOP_UNION);
+}
+
+/* Replace the ranges of hl by those of src, keeping the range array of
+ * hl if it is large enough, and destroy src. src may still share its
+ * ranges with a copy. Iterators over hl are reset. Assumes the lock
+ * of hl is held and hl owns its ranges.
+ */
+static int _hostlist_take_ranges(hostlist_t hl, hostlist_t src)
+{
+    int i;
+
+    if (!_hostlist_own(src)) {
+        hostlist_destroy(src);
+        return 0;
+    }
+    if (src->nranges > hl->size && !hostlist_resize(hl, src->nranges)) {
+        hostlist_destroy(src);
+        seterrno_ret(ENOMEM, 0);
+    }
+    for (i = 0; i < hl->nranges; i++) {
+        hostrange_destroy(hl->hr[i]);
+        hl->hr[i] = NULL;
+    }
+    memcpy(hl->hr, src->hr, src->nranges * sizeof(hostrange_t));
+    hl->nranges = src->nranges;
+    hl->nhosts = src->nhosts;
+    src->nranges = 0;
+    hostlist_destroy(src);
+
+    _hostlist_touch(hl, 0);
+    _hostlist_reorder(hl);
+    return 1;
+}
+
+/* Set operation type on h1 and h2, with the result replacing the
+ * ranges of h1.
+ */
+static int _hostlist_update(hostlist_t h1, hostlist_t h2, int type)
+{
+    hostlist_t new = NULL;
+    int slow = 0, rc = 0;
+
+    if (h1 == NULL || h2 == NULL)
+        seterrno_ret(EINVAL, 0);
+    CHECK_MUTABLE(h1, 0);
+
+    LOCK_HOSTLIST(h1);
+    if (h2 != h1)
+        RDLOCK_HOSTLIST(h2);
+    if (_hostlist_own(h1)
+        && (new = _hostlist_setop_spans(h1, h2, type, &slow))
+        && (rc = _hostlist_take_ranges(h1, new))
+        && type != SETOP_DIFFERENCE && h1->nranges > 1) {
+        _hostlist_sort_ranges(h1, 1);
+        _hostlist_join_ranges(h1, 1);
+    }
+    if (h2 != h1)
+        RDUNLOCK_HOSTLIST(h2);
+    UNLOCK_HOSTLIST(h1);
+
+    if (slow) {
+        /* suffixes too long for spans: build the result separately */
+        if (!(new = _hostlist_setop(h1, h2, type)))
+            return 0;
+        /* the result may have been copied from h1, leaving h1 sharing
+         * its ranges with a base list */
+        LOCK_HOSTLIST(h1);
+        if (_hostlist_own(h1))
+            rc = _hostlist_take_ranges(h1, new);
+        else
+            hostlist_destroy(new);
+        UNLOCK_HOSTLIST(h1);
+    }
+    return rc;
+}
+
+int hostlist_intersect_update(hostlist_t h1, hostlist_t h2)
+{
+    return _hostlist_update(h1, h2, SETOP_INTERSECT);
+}
+
+int hostlist_xor_update(hostlist_t h1, hostlist_t h2)
+{
+    return _hostlist_update(h1, h2, SETOP_XOR);
+}
+
+int hostlist_difference_update(hostlist_t h1, hostlist_t h2)
+{
+    return _hostlist_update(h1, h2, SETOP_DIFFERENCE);
+}
+
+int hostlist_union_update(hostlist_t h1, hostlist_t h2)
+{
+    return _hostlist_update(h1, h2, SETOP_UNION);
+}
+
+
+ssize_t hostlist_deranged_string(hostlist_t hl, size_t n, char *buf)
+{
+    int i;
+    int len = 0;
+    int truncated = 0;
+
+    RDLOCK_HOSTLIST(hl);
+    for (i = 0; i < hl->nranges; i++) {
+        size_t m = (n - len) <= n ? n - len : 0;
+        int ret = hostrange_to_string(hl->hr[i], m, buf + len, ",");
+        if (ret < 0 || ret > m) {
+            len = n;
+            truncated = 1;
+            break;
+        }
+        len+=ret;
+        buf[len++] = ',';
+    }
+    RDUNLOCK_HOSTLIST(hl);
+
+    buf[len > 0 ? --len : 0] = '\0';
+    if (len == n)
+        truncated = 1;
+
+    return truncated ? -1 : len;
+}
+
+/* return true if a bracket is needed for the range at i in hostlist hl */
+static int _is_bracket_needed(hostlist_t hl, int i)
+{
+    hostrange_t h1 = hl->hr[i];
+    hostrange_t h2 = i < hl->nranges - 1 ? hl->hr[i + 1] : NULL;
+    return hostrange_count(h1) > 1 || hostrange_within_range(h1, h2);
+}
+
+/* write the next bracketed hostlist, i.e. prefix[n-m,k,...]
+ * into buf, writing at most n chars including the terminating '\0'
+ *
+ * leaves start pointing to one past last range object in bracketed list,
+ * and returns the number of bytes written into buf.
+ *
+ * Assumes hostlist is locked.
+ */
+static int
+_get_bracketed_list(hostlist_t hl, int *start, const size_t n, char *buf)
+{
+    hostrange_t *hr = hl->hr;
+    int i = *start;
+    int m, len = 0;
+    int bracket_needed = _is_bracket_needed(hl, i);
+
+    len = snprintf(buf, n, "%s", hr[i]->prefix);
+
+    if ((len < 0) || (len > n))
+        return n; /* truncated, buffer filled */
+
+    if (bracket_needed && len < n)
+        buf[len++] = '[';
+
+    do {
+        m = (n - len) <= n ? n - len : 0;
+        len += hostrange_numstr(hr[i], m, buf + len);
+        if (len >= n)
+            break;
+        if (bracket_needed) /* Only need commas inside brackets */
+            buf[len++] = ',';
+    } while (++i < hl->nranges && hostrange_within_range(hr[i], hr[i-1]));
+
+    if (bracket_needed && len < n && len > 0) {
+
+        /* Add trailing bracket (change trailing "," from above to "]" */
+        buf[len - 1] = ']';
+
+        /* NUL terminate for safety, but do not add terminator to len */
+        buf[len]   = '\0';
+
+    } else if (len >= n) {
+        if (n > 0)
+            buf[n-1] = '\0';
+
+    } else {
+        /* If len is > 0, NUL terminate (but do not add to len) */
+        buf[len > 0 ? len : 0] = '\0';
+    }
+
+    *start = i;
+    return len;
+}
+
+ssize_t hostlist_ranged_string(hostlist_t hl, size_t n, char *buf)
+{
+    int i = 0;
+    int len = 0;
+    int truncated = 0;
+
+    RDLOCK_HOSTLIST(hl);
+    while (i < hl->nranges && len < n) {
+        len += _get_bracketed_list(hl, &i, n - len, buf + len);
+        if ((len > 0) && (len < n) && (i < hl->nranges))
+            buf[len++] = ',';
+    }
+    RDUNLOCK_HOSTLIST(hl);
+
+    /* NUL terminate */
+    if (len >= n) {
+        truncated = 1;
+        if (n > 0)
+            buf[n-1] = '\0';
+    } else
+        buf[len > 0 ? len : 0] = '\0';
+
+    return truncated ? -1 : len;
+}
+
+/* ----[ hostlist builder functions ]---- */
+
+hostlist_builder_t hostlist_builder_create(void)
+{
+    hostlist_builder_t b;
+
+    if (!(b = malloc(sizeof(*b))))
+        out_of_memory("hostlist_builder_create");
+#if    WITH_PTHREADS
+    if ((errno = pthread_key_create(&b->key, NULL)) != 0) {
+        free(b);
+        return NULL;
+    }
+#endif
+    b->shards = NULL;
+    return b;
+}
+
+static void _shard_destroy(struct hostlist_shard *s)
+{
+    int i;
+    for (i = 0; i < s->nranges; i++)
+        hostrange_destroy(s->hr[i]);
+    free(s->hr);
+    free(s);
+}
+
+void hostlist_builder_destroy(hostlist_builder_t b)
+{
+    struct hostlist_shard *s;
+
+    if (b == NULL)
+        return;
+    while ((s = b->shards)) {
+        b->shards = s->next;
+        _shard_destroy(s);
+    }
+#if    WITH_PTHREADS
+    pthread_key_delete(b->key);
+#endif
+    free(b);
+}
+
+/* Return the shard of b for the calling thread, creating it if needed.
+ */
+static struct hostlist_shard *_builder_shard(hostlist_builder_t b)
+{
+    struct hostlist_shard *s;
+
+#if    WITH_PTHREADS
+    if ((s = pthread_getspecific(b->key)))
+        return s;
+    if (!(s = calloc(1, sizeof(*s))))
+        return NULL;
+    s->next = __atomic_load_n(&b->shards, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&b->shards, &s->next, s, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    /* if this fails, the thread just gets another shard next time */
+    pthread_setspecific(b->key, s);
+#else
+    if ((s = b->shards))
+        return s;
+    if (!(s = calloc(1, sizeof(*s))))
+        return NULL;
+    b->shards = s;
+#endif
+    return s;
+}
+
+/* Push the host prefix + n (or the single host prefix if width < 0)
+ * onto shard s, extending the last range if possible. prefix need not
+ * be NUL terminated.
+ */
+static int _shard_push(struct hostlist_shard *s, const char *prefix,
+                       size_t plen, unsigned long n, int width)
+{
+    hostrange_t hr = s->nranges > 0 ? s->hr[s->nranges - 1] : NULL;
+
+    if (hr && width >= 0 && !hr->singlehost && hr->hi == n - 1
+        && strncmp(hr->prefix, prefix, plen) == 0
+        && hr->prefix[plen] == '\0'
+        && _width_equiv(hr->lo, &hr->width, n, &width)) {
+        hr->hi = n;
+        s->nhosts++;
+        return 1;
+    }
+
+    if (s->nranges == s->size) {
+        int size = s->size ? 2 * s->size : HOSTLIST_CHUNK;
+        hostrange_t *new = realloc(s->hr, size * sizeof(hostrange_t));
+        if (!new) {
+            errno = ENOMEM;
+            return 0;
+        }
+        s->hr = new;
+        s->size = size;
+    }
+    if (!(hr = hostrange_new()))
+        return 0;
+    if (!(hr->prefix = malloc(plen + 1))) {
+        free(hr);
+        errno = ENOMEM;
+        return 0;
+    }
+    memcpy(hr->prefix, prefix, plen);
+    hr->prefix[plen] = '\0';
+    hr->singlehost = width < 0;
+    hr->lo = hr->hi = width < 0 ? 0 : n;
+    hr->width = width < 0 ? 0 : width;
+
+    s->hr[s->nranges++] = hr;
+    s->nhosts++;
+    return 1;
+}
+
+int hostlist_builder_push_host(hostlist_builder_t b, const char *host)
+{
+    struct hostlist_shard *s;
+    size_t len;
+    int idx;
+
+    if (host == NULL)
+        return 0;
+    if (!(s = _builder_shard(b))) {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    len = strlen(host);
+    idx = host_prefix_end(host);
+
+    /* as hostname_create(): numeric suffixes are at most MAX_HOST_SUFFIX */
+    if (idx < (int) len - 1) {
+        char *p;
+        unsigned long n = strtoul(host + idx + 1, &p, 10);
+        if (*p == '\0' && n <= MAX_HOST_SUFFIX)
+            return _shard_push(s, host, idx + 1, n, len - idx - 1);
+    }
+    return _shard_push(s, host, len, 0, -1);
+}
+
+int hostlist_builder_push_num(hostlist_builder_t b, const char *prefix,
+                              unsigned long n, int width)
+{
+    struct hostlist_shard *s;
+
+    if (prefix == NULL || n > MAX_HOST_SUFFIX) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (!(s = _builder_shard(b))) {
+        errno = ENOMEM;
+        return 0;
+    }
+    return _shard_push(s, prefix, strlen(prefix), n, width > 0 ? width : 0);
+}
+
+hostlist_t hostlist_builder_finish(hostlist_builder_t b)
+{
+    struct hostlist_shard *s;
+    hostlist_t hl;
+    int nranges = 0;
+
+    if (!(hl = hostlist_new()))
+        goto done;
+
+    for (s = b->shards; s; s = s->next)
+        nranges += s->nranges;
+    if (nranges > hl->size && !hostlist_resize(hl, nranges)) {
+        hostlist_destroy(hl);
+        hl = NULL;
+        goto done;
+    }
+
+    /* move ranges out of the shards */
+    for (s = b->shards; s; s = s->next) {
+        memcpy(hl->hr + hl->nranges, s->hr, s->nranges * sizeof(hostrange_t));
+        hl->nranges += s->nranges;
+        hl->nhosts += s->nhosts;
+        s->nranges = 0;
+    }
+
+    hostlist_uniq_mt(hl);
+
+  done:
+    hostlist_builder_destroy(b);
+    return hl;
+}
+
+
+/* ----[ hostlist writer functions ]---- */
+
+static int _writer_flush_fd(struct hostlist_writer *w, struct iovec *iov,
+                            int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = writev(w->fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        /* account for partial writes */
+        while (iovcnt > 0 && n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static int _writer_flush_fp(struct hostlist_writer *w, struct iovec *iov,
+                            int iovcnt)
+{
+    int i;
+    for (i = 0; i < iovcnt; i++) {
+        if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, w->fp) != iov[i].iov_len)
+            return -1;
+    }
+    return 0;
+}
+
+/* flush staged data in w, along with n bytes of extra data (if any)
+ */
+static int _writer_flush(struct hostlist_writer *w, const char *data, size_t n)
+{
+    struct iovec iov[2];
+    int iovcnt = 0;
+
+    if (w->len > 0) {
+        iov[iovcnt].iov_base = w->buf;
+        iov[iovcnt++].iov_len = w->len;
+    }
+    if (n > 0) {
+        iov[iovcnt].iov_base = (char *) data;
+        iov[iovcnt++].iov_len = n;
+    }
+    if (iovcnt > 0 && (*w->flush)(w, iov, iovcnt) < 0)
+        return -1;
+    w->total += w->len + n;
+    w->len = 0;
+    return 0;
+}
+
+/* append n bytes of data to the writer w
+ */
+static int _writer_put(struct hostlist_writer *w, const char *data, size_t n)
+{
+    if (w->len + n > sizeof(w->buf))
+        return _writer_flush(w, data, n);
+    memcpy(w->buf + w->len, data, n);
+    w->len += n;
+    return 0;
+}
+
+/* return a pointer to at least n bytes of free space in the staging
+ * buffer of w, flushing if necessary. Returns NULL on error.
+ */
+static char *_writer_reserve(struct hostlist_writer *w, size_t n)
+{
+    if (n > sizeof(w->buf))
+        seterrno_ret(ERANGE, NULL);
+    if (w->len + n > sizeof(w->buf) && _writer_flush(w, NULL, 0) < 0)
+        return NULL;
+    return w->buf + w->len;
+}
+
+/* write every hostname in hostrange hr to w, preceding each host
+ * with the delimiter unless it is the first host written (*first != 0)
+ */
+static int _writer_put_expanded(struct hostlist_writer *w, hostrange_t hr,
+                                const char *delim, size_t dlen, int *first)
+{
+    struct hostname_gen g;
+    unsigned long i;
+    int rc = 0;
+
+    if (hostname_gen_init(&g, hr, hr->lo) < 0)
+        return -1;
+
+    for (i = hr->lo; rc == 0; i++) {
+        size_t n = g.len + dlen;
+        if (w->len + n <= sizeof(w->buf)) {
+            /* fast path: copy directly into staging buffer */
+            if (!*first) {
+                memcpy(w->buf + w->len, delim, dlen);
+                w->len += dlen;
+            }
+            memcpy(w->buf + w->len, g.name, g.len);
+            w->len += g.len;
+        } else if ((!*first && _writer_put(w, delim, dlen) < 0)
+                   || _writer_put(w, g.name, g.len) < 0)
+            rc = -1;
+        *first = 0;
+        if (hr->singlehost || i == hr->hi)
+            break;
+        hostname_gen_incr(&g);
+    }
+    hostname_gen_fini(&g);
+    return rc;
+}
+
+/* write the numeric part of hostrange hr, i.e. lo or lo-hi, to w
+ */
+static int _writer_put_numstr(struct hostlist_writer *w, hostrange_t hr)
+{
+    int width = hr->width > 20 ? hr->width : 20;
+    char *p;
+
+    if (!(p = _writer_reserve(w, 2 * width + 1)))
+        return -1;
+    w->len += _numstr(p, hr->lo, hr->width);
+    if (hr->lo < hr->hi) {
+        w->buf[w->len++] = '-';
+        w->len += _numstr(w->buf + w->len, hr->hi, hr->width);
+    }
+    return 0;
+}
+
+/* write the bracketed list starting at range *start in hl to w,
+ * leaving start pointing one past the last range written.
+ * (See _get_bracketed_list())
+ */
+static int
+_writer_put_bracketed(struct hostlist_writer *w, hostlist_t hl, int *start)
+{
+    hostrange_t *hr = hl->hr;
+    int i = *start;
+    int bracket_needed = _is_bracket_needed(hl, i);
+
+    if (_writer_put(w, hr[i]->prefix, strlen(hr[i]->prefix)) < 0)
+        return -1;
+    if (bracket_needed && _writer_put(w, "[", 1) < 0)
+        return -1;
+    do {
+        if (i > *start && bracket_needed && _writer_put(w, ",", 1) < 0)
+            return -1;
+        if (!hr[i]->singlehost && _writer_put_numstr(w, hr[i]) < 0)
+            return -1;
+    } while (++i < hl->nranges && hostrange_within_range(hr[i], hr[i-1]));
+
+    if (bracket_needed && _writer_put(w, "]", 1) < 0)
+        return -1;
+
+    *start = i;
+    return 0;
+}
+
+/* write hostlist hl to writer w in mode, returning the total number of
+ * bytes written or -1 on error.
+ */
+static ssize_t _hostlist_write(hostlist_t hl, struct hostlist_writer *w,
+                               int mode, const char *delim)
+{
+    size_t dlen;
+    int first = 1;
+    int i = 0;
+    int rc = 0;
+
+    if (delim == NULL)
+        delim = ",";
+    dlen = strlen(delim);
+
+    w->len = 0;
+    w->total = 0;
+
+    RDLOCK_HOSTLIST(hl);
+    if (mode == HOSTLIST_WRITE_EXPANDED) {
+        for (i = 0; rc == 0 && i < hl->nranges; i++)
+            rc = _writer_put_expanded(w, hl->hr[i], delim, dlen, &first);
+    } else {
+        while (rc == 0 && i < hl->nranges) {
+            if (i > 0)
+                rc = _writer_put(w, delim, dlen);
+            if (rc == 0)
+                rc = _writer_put_bracketed(w, hl, &i);
+        }
+    }
+    RDUNLOCK_HOSTLIST(hl);
+
+    if (rc < 0 || _writer_flush(w, NULL, 0) < 0)
+        return -1;
+
+    return w->total;
+}
+
+ssize_t hostlist_write(hostlist_t hl, int fd, int mode, const char *delim)
+{
+    struct hostlist_writer *w;
+    ssize_t rc;
+
+    if (!(w = malloc(sizeof(*w))))
+        seterrno_ret(ENOMEM, -1);
+    w->flush = _writer_flush_fd;
+    w->fd = fd;
+    w->fp = NULL;
+    rc = _hostlist_write(hl, w, mode, delim);
+    free(w);
+    return rc;
+}
+
+ssize_t hostlist_fwrite(hostlist_t hl, FILE *fp, int mode, const char *delim)
+{
+    struct hostlist_writer *w;
+    ssize_t rc;
+
+    if (!(w = malloc(sizeof(*w))))
+        seterrno_ret(ENOMEM, -1);
+    w->flush = _writer_flush_fp;
+    w->fd = -1;
+    w->fp = fp;
+    rc = _hostlist_write(hl, w, mode, delim);
+    free(w);
+    return rc;
+}
+
+/* ----[ hostlist serialization ]---- */
+
+/* Binary hostlist format. All integers are unsigned LEB128 varints:
+ *
+ *   'H' 'L' version nprefix { len prefix }* nranges { range }*
+ *
+ * The distinct prefixes of the list are stored once, in sorted order.
+ * Each range starts with a tag: the index of its prefix shifted left
+ * by two, bit 0 set for a single host without a numeric suffix, and
+ * bit 1 set if lo lies before the end of the previous range with the
+ * same prefix. Numeric ranges then store width, the distance of lo
+ * from one past hi of the previous range with that prefix, and
+ * hi - lo, so that ranges of the same prefix are delta encoded.
+ */
+#define HOSTLIST_DUMP_VERSION  1
+#define HOSTLIST_VARINT_MAX    ((sizeof(unsigned long) * 8 + 6) / 7)
+
+struct _dump_key {
+    const char *prefix;
+    int range;
+};
+
+static int _dump_key_cmp(const void *a, const void *b)
+{
+    const struct _dump_key *k1 = a, *k2 = b;
+    int rc = strcmp(k1->prefix, k2->prefix);
+    return rc ? rc : k1->range - k2->range;
+}
+
+static unsigned char *_dump_varint(unsigned char *p, unsigned long v)
+{
+    while (v >= 0x80) {
+        *p++ = (unsigned char) (v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char) v;
+    return p;
+}
+
+/* Decode a varint at *p, advancing *p past it. Returns -1 if the
+ * varint is truncated or does not fit an unsigned long.
+ */
+static int
+_load_varint(const unsigned char **p, const unsigned char *end,
+             unsigned long *v)
+{
+    const int bits = sizeof(*v) * 8;
+    unsigned long x = 0;
+    int shift = 0;
+
+    while (*p < end) {
+        unsigned long c = *(*p)++;
+        if (shift >= bits || (shift > 0 && (c & 0x7f) >> (bits - shift)))
+            return -1;
+        x |= (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *v = x;
+            return 0;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+void *hostlist_dump(hostlist_t hl, size_t *lenp)
+{
+    struct _dump_key *keys = NULL;
+    int *ids = NULL;
+    unsigned long *next = NULL;
+    unsigned char *buf = NULL, *p, *q;
+    size_t size;
+    int i, n, nprefix = 0;
+
+    if (hl == NULL || lenp == NULL)
+        seterrno_ret(EINVAL, NULL);
+
+    RDLOCK_HOSTLIST(hl);
+    n = hl->nranges;
+
+    /* number the distinct prefixes in sorted order */
+    keys = malloc((n > 0 ? n : 1) * sizeof(*keys));
+    ids = malloc((n > 0 ? n : 1) * sizeof(*ids));
+    next = calloc(n > 0 ? n : 1, sizeof(*next));
+    if (!keys || !ids || !next)
+        goto out;
+    size = 3 + 2 * HOSTLIST_VARINT_MAX;
+    for (i = 0; i < n; i++) {
+        keys[i].prefix = hl->hr[i]->prefix;
+        keys[i].range = i;
+    }
+    qsort(keys, n, sizeof(*keys), _dump_key_cmp);
+    for (i = 0; i < n; i++) {
+        if (i == 0 || strcmp(keys[i].prefix, keys[i - 1].prefix) != 0) {
+            size += HOSTLIST_VARINT_MAX + strlen(keys[i].prefix);
+            keys[nprefix++].prefix = keys[i].prefix;
+        }
+        ids[keys[i].range] = nprefix - 1;
+    }
+    size += n * 4 * HOSTLIST_VARINT_MAX;
+
+    if (!(buf = malloc(size)))
+        goto out;
+    p = buf;
+    *p++ = 'H';
+    *p++ = 'L';
+    *p++ = HOSTLIST_DUMP_VERSION;
+    p = _dump_varint(p, nprefix);
+    for (i = 0; i < nprefix; i++) {
+        size_t len = strlen(keys[i].prefix);
+        p = _dump_varint(p, len);
+        memcpy(p, keys[i].prefix, len);
+        p += len;
+    }
+    p = _dump_varint(p, n);
+    for (i = 0; i < n; i++) {
+        hostrange_t hr = hl->hr[i];
+        unsigned long tag = (unsigned long) ids[i] << 2;
+        unsigned long *last = &next[ids[i]];
+
+        if (hr->singlehost) {
+            p = _dump_varint(p, tag | 1);
+            continue;
+        }
+        if (hr->lo < *last)
+            p = _dump_varint(p, tag | 2);
+        else
+            p = _dump_varint(p, tag);
+        p = _dump_varint(p, hr->width);
+        p = _dump_varint(p, hr->lo < *last ? *last - hr->lo : hr->lo - *last);
+        p = _dump_varint(p, hr->hi - hr->lo);
+        *last = hr->hi + 1;
+    }
+    *lenp = p - buf;
+
+    /* give back the space reserved for the longest varints */
+    if ((q = realloc(buf, *lenp > 0 ? *lenp : 1)))
+        buf = q;
+
+  out:
+    RDUNLOCK_HOSTLIST(hl);
+    free(keys);
+    free(ids);
+    free(next);
+    if (buf == NULL)
+        errno = ENOMEM;
+    return buf;
+}
+
+hostlist_t hostlist_load(const void *data, size_t len)
+{
+    const unsigned char *p = data, *end = p + len;
+    hostlist_t hl = NULL;
+    char **prefix = NULL;
+    unsigned long *next = NULL;
+    unsigned long nprefix = 0, nranges, nhosts = 0, i;
+    int err = EINVAL;
+
+    if (data == NULL || len < 3 || p[0] != 'H' || p[1] != 'L'
+        || p[2] != HOSTLIST_DUMP_VERSION)
+        seterrno_ret(EINVAL, NULL);
+    p += 3;
+
+    /* every prefix and range takes at least one byte */
+    if (_load_varint(&p, end, &nprefix) < 0 || nprefix > (unsigned long) (end - p))
+        seterrno_ret(EINVAL, NULL);
+    prefix = calloc(nprefix > 0 ? nprefix : 1, sizeof(*prefix));
+    next = calloc(nprefix > 0 ? nprefix : 1, sizeof(*next));
+    if (!prefix || !next)
+        goto nomem;
+
+    for (i = 0; i < nprefix; i++) {
+        unsigned long l;
+        if (_load_varint(&p, end, &l) < 0 || l > (unsigned long) (end - p)
+            || memchr(p, '\0', l) != NULL)
+            goto error;
+        if (!(prefix[i] = malloc(l + 1)))
+            goto nomem;
+        memcpy(prefix[i], p, l);
+        prefix[i][l] = '\0';
+        p += l;
+    }
+
+    if (_load_varint(&p, end, &nranges) < 0 || nranges > (unsigned long) (end - p)
+        || nranges > INT_MAX)
+        goto error;
+    if (!(hl = hostlist_new()))
+        goto nomem;
+    if ((int) nranges > hl->size && !hostlist_resize(hl, nranges))
+        goto nomem;
+
+    for (i = 0; i < nranges; i++) {
+        unsigned long tag, k, width, delta, count, lo, hi;
+        hostrange_t hr;
+
+        if (_load_varint(&p, end, &tag) < 0 || (k = tag >> 2) >= nprefix)
+            goto error;
+        if (tag & 1) {
+            if (tag & 2)
+                goto error;
+            if (!(hr = hostrange_create_single(prefix[k])))
+                goto nomem;
+            count = 1;
+        } else {
+            if (_load_varint(&p, end, &width) < 0
+                || width > MAX_SUFFIX_WIDTH
+                || _load_varint(&p, end, &delta) < 0
+                || _load_varint(&p, end, &count) < 0)
+                goto error;
+            if (tag & 2) {
+                if (delta > next[k])
+                    goto error;
+                lo = next[k] - delta;
+            } else if ((lo = next[k] + delta) < delta)
+                goto error;
+            /* the encoding keeps lo <= hi, but hi may be above the
+             * largest suffix hostname_create() accepts */
+            if ((hi = lo + count) < lo || count >= INT_MAX
+                || hi > MAX_HOST_SUFFIX)
+                goto error;
+            if (!(hr = hostrange_create(prefix[k], lo, hi, width)))
+                goto nomem;
+            next[k] = hi + 1;
+            count++;
+        }
+        hl->hr[hl->nranges++] = hr;
+        if ((nhosts += count) > INT_MAX)
+            goto error;
+    }
+    if (p != end)
+        goto error;
+
+    hl->nhosts = nhosts;
+    _hostlist_index(hl);
+    err = 0;
+    goto out;
+
+  nomem:
+    err = ENOMEM;
+  error:
+    hostlist_destroy(hl);
+    hl = NULL;
+  out:
+    for (i = 0; prefix && i < nprefix; i++)
+        free(prefix[i]);
+    free(prefix);
+    free(next);
+    if (err)
+        errno = err;
+    return hl;
+}
+
+/* ----[ hostlist database functions ]---- */
+
+#define HOSTLIST_DB_ALIGN(_n)  (((_n) + 7) & ~((size_t) 7))
+
+struct _db_name {
+    const char *name;
+    int idx;
+};
+
+static int _db_name_cmp(const void *a, const void *b)
+{
+    const struct _db_name *n1 = a, *n2 = b;
+    return strcmp(n1->name, n2->name);
+}
+
+static int _db_str_cmp(const void *a, const void *b)
+{
+    return strcmp(*(const char **) a, *(const char **) b);
+}
+
+void *hostlist_db_build(int n, const char **names, hostlist_t *lists,
+                        size_t *lenp)
+{
+    hostlist_t *fl = NULL;
+    struct _db_name *gn = NULL;
+    const char **str = NULL;
+    uint64_t *soff = NULL;
+    char *image = NULL;
+    struct hostlist_db_header *hdr;
+    struct hostlist_db_group *g;
+    size_t nranges = 0, nstr = 0, len, roff, coff, soff0;
+    int i, j, err = ENOMEM;
+
+    if (n < 0 || (n > 0 && (!names || !lists)) || !lenp)
+        seterrno_ret(EINVAL, NULL);
+
+    /* frozen copies of the lists are read without holding their locks */
+    if (!(fl = calloc(n > 0 ? n : 1, sizeof(*fl)))
+        || !(gn = malloc((n > 0 ? n : 1) * sizeof(*gn))))
+        goto out;
+    for (i = 0; i < n; i++) {
+        if (!names[i] || !lists[i]) {
+            err = EINVAL;
+            goto out;
+        }
+        if (!(fl[i] = hostlist_freeze(lists[i])))
+            goto out;
+        nranges += fl[i]->nranges;
+        gn[i].name = names[i];
+        gn[i].idx = i;
+    }
+    qsort(gn, n, sizeof(*gn), _db_name_cmp);
+    for (i = 1; i < n; i++) {
+        if (strcmp(gn[i].name, gn[i - 1].name) == 0) {
+            err = EINVAL;
+            goto out;
+        }
+    }
+
+    /* names and prefixes are stored once each, in sorted order */
+    if (!(str = malloc((n + nranges + 1) * sizeof(*str))))
+        goto out;
+    for (i = 0; i < n; i++) {
+        str[nstr++] = names[i];
+        for (j = 0; j < fl[i]->nranges; j++)
+            str[nstr++] = fl[i]->hr[j]->prefix;
+    }
+    qsort(str, nstr, sizeof(*str), _db_str_cmp);
+    for (i = 0, j = 0; i < (int) nstr; i++) {
+        if (j == 0 || strcmp(str[i], str[j - 1]) != 0)
+            str[j++] = str[i];
+    }
+    nstr = j;
+
+    roff = HOSTLIST_DB_ALIGN(sizeof(*hdr) + n * sizeof(*g));
+    coff = roff + nranges * sizeof(struct hostlist_db_range);
+    soff0 = HOSTLIST_DB_ALIGN(coff + (nranges + n) * sizeof(int32_t));
+    len = soff0;
+    if (!(soff = malloc((nstr > 0 ? nstr : 1) * sizeof(*soff))))
+        goto out;
+    for (i = 0; i < (int) nstr; i++) {
+        soff[i] = len;
+        len += strlen(str[i]) + 1;
+    }
+    len++;
+
+    if (!(image = calloc(1, len)))
+        goto out;
+    hdr = (struct hostlist_db_header *) image;
+    memcpy(hdr->magic, HOSTLIST_DB_MAGIC, sizeof(hdr->magic));
+    hdr->version = HOSTLIST_DB_VERSION;
+    hdr->byteorder = HOSTLIST_DB_BYTEORDER;
+    hdr->ngroups = n;
+    hdr->size = len;
+    hdr->groups = sizeof(*hdr);
+
+    for (i = 0; i < (int) nstr; i++)
+        strcpy(image + soff[i], str[i]);
+
+    g = (struct hostlist_db_group *) (image + hdr->groups);
+    for (i = 0; i < n; i++, g++) {
+        hostlist_t hl = fl[gn[i].idx];
+        struct hostlist_db_range *r = (void *) (image + roff);
+        int32_t *cum = (int32_t *) (image + coff);
+        const char **s;
+
+        s = bsearch(&gn[i].name, str, nstr, sizeof(*str), _db_str_cmp);
+        g->name = soff[s - str];
+        g->ranges = roff;
+        g->cum = coff;
+        g->nranges = hl->nranges;
+
+        cum[0] = 0;
+        for (j = 0; j < hl->nranges; j++) {
+            hostrange_t hr = hl->hr[j];
+            s = bsearch(&hr->prefix, str, nstr, sizeof(*str), _db_str_cmp);
+            r[j].prefix = soff[s - str];
+            r[j].lo = hr->lo;
+            r[j].hi = hr->hi;
+            r[j].width = hr->singlehost ? -1 : hr->width;
+            cum[j + 1] = cum[j] + hostrange_count(hr);
+        }
+        roff += hl->nranges * sizeof(*r);
+        coff += (hl->nranges + 1) * sizeof(*cum);
+    }
+    *lenp = len;
+    err = 0;
+
+  out:
+    for (i = 0; fl && i < n; i++)
+        hostlist_destroy(fl[i]);
+    free(fl);
+    free(gn);
+    free(str);
+    free(soff);
+    if (err) {
+        free(image);
+        image = NULL;
+        errno = err;
+    }
+    return image;
 }
 
-
-/* search through hostlist for ranges that can be collapsed
- * does =not= delete any hosts
+/* Flush the entry for path in its directory to disk, so that a rename
+ * onto path survives a crash. Filesystems which cannot sync a
+ * directory are not treated as an error.
  */
-static void hostlist_collapse(hostlist_t hl)
+static int _db_sync_dir(const char *path)
 {
-    int i;
-
-    LOCK_HOSTLIST(hl);
-    for (i = hl->nranges - 1; i > 0; i--) {
-        hostrange_t hprev = hl->hr[i - 1];
-        hostrange_t hnext = hl->hr[i];
+    const char *slash = strrchr(path, '/');
+    char *dir;
+    int fd, err = 0;
+
+    if (slash == NULL)
+        dir = strdup(".");
+    else if ((dir = malloc(slash - path + 2))) {
+        size_t len = slash > path ? slash - path : 1;
+        memcpy(dir, path, len);
+        dir[len] = '\0';
+    }
+    if (dir == NULL)
+        return ENOMEM;
 
-        if (hostrange_prefix_cmp(hprev, hnext) == 0 &&
-            hprev->hi == hnext->lo - 1 &&
-            hostrange_width_combine(hprev, hnext)) {
-            hprev->hi = hnext->hi;
-            hostlist_delete_range(hl, i);
-        }
+    if ((fd = open(dir, O_RDONLY)) < 0)
+        err = errno;
+    else {
+        if (fsync(fd) < 0 && errno != EINVAL)
+            err = errno;
+        close(fd);
     }
-    UNLOCK_HOSTLIST(hl);
+    free(dir);
+    return err;
 }
 
-/* search through hostlist (hl) for intersecting ranges
- * split up duplicates and coalesce ranges where possible
- */
-static void hostlist_coalesce(hostlist_t hl)
+int hostlist_db_write(const char *path, int n, const char **names,
+                      hostlist_t *lists)
 {
-    int i, j;
-    hostrange_t new;
+    char *image, *tmp;
+    size_t len, done = 0;
+    int fd, err = 0;
 
-    LOCK_HOSTLIST(hl);
+    if (path == NULL)
+        seterrno_ret(EINVAL, -1);
+    if (!(image = hostlist_db_build(n, names, lists, &len)))
+        return -1;
+    if (!(tmp = malloc(strlen(path) + 8))) {
+        free(image);
+        seterrno_ret(ENOMEM, -1);
+    }
+
+    /* The image goes to a new file in the same directory, which is
+     * renamed over path once it is on disk. Readers which have the old
+     * database mapped keep their copy. mkstemp() never opens an
+     * existing file, so nothing planted at the temporary name is
+     * written through. */
+    sprintf(tmp, "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp)) < 0 || fchmod(fd, 0644) < 0)
+        err = errno;
+    while (!err && done < len) {
+        ssize_t rc = write(fd, image + done, len - done);
+        if (rc < 0 && errno != EINTR)
+            err = errno;
+        else if (rc > 0)
+            done += rc;
+    }
+    if (!err && fsync(fd) < 0)
+        err = errno;
+    if (fd >= 0 && close(fd) < 0 && !err)
+        err = errno;
+    if (!err && rename(tmp, path) < 0)
+        err = errno;
+    if (err && fd >= 0)
+        unlink(tmp);
+    if (!err)
+        err = _db_sync_dir(path);
+
+    free(tmp);
+    free(image);
+    if (err)
+        seterrno_ret(err, -1);
+    return 0;
+}
 
-    for (i = hl->nranges - 1; i > 0; i--) {
+hostlist_db_t hostlist_db_open_image(const void *image, size_t len)
+{
+    const struct hostlist_db_header *hdr = image;
+    hostlist_db_t db;
+
+    if (image == NULL || len < sizeof(*hdr) || ((uintptr_t) image & 7)
+        || memcmp(hdr->magic, HOSTLIST_DB_MAGIC, sizeof(hdr->magic)) != 0
+        || hdr->version != HOSTLIST_DB_VERSION
+        || hdr->byteorder != HOSTLIST_DB_BYTEORDER
+        || hdr->size > len || hdr->size < sizeof(*hdr)
+        || ((const char *) image)[hdr->size - 1] != '\0'
+        || hdr->ngroups > INT_MAX || (hdr->groups & 7)
+        || hdr->groups > hdr->size
+        || hdr->ngroups > (hdr->size - hdr->groups)
+                          / sizeof(struct hostlist_db_group))
+        seterrno_ret(EINVAL, NULL);
+
+    if (!(db = malloc(sizeof(*db))))
+        seterrno_ret(ENOMEM, NULL);
+    db->image = image;
+    db->len = hdr->size;
+    db->mapped = 0;
+    db->refcnt = 1;
+    db->hdr = hdr;
+    db->groups = (const void *) (db->image + hdr->groups);
+    return db;
+}
 
-        new = hostrange_intersect(hl->hr[i - 1], hl->hr[i]);
+hostlist_db_t hostlist_db_open(const char *path)
+{
+    struct stat st;
+    hostlist_db_t db;
+    void *image;
+    int fd, err;
 
-        if (new) {
-            hostrange_t hprev = hl->hr[i - 1];
-            hostrange_t hnext = hl->hr[i];
-            j = i;
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0) {
+        err = errno;
+        close(fd);
+        seterrno_ret(err, NULL);
+    }
+    if (st.st_size < (off_t) sizeof(struct hostlist_db_header)) {
+        close(fd);
+        seterrno_ret(EINVAL, NULL);
+    }
 
-            if (new->hi < hprev->hi)
-                hnext->hi = hprev->hi;
+    /* a shared mapping lets every process use the same pages */
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    err = errno;
+    close(fd);
+    if (image == MAP_FAILED)
+        seterrno_ret(err, NULL);
+
+    if (!(db = hostlist_db_open_image(image, st.st_size))) {
+        err = errno;
+        munmap(image, st.st_size);
+        seterrno_ret(err, NULL);
+    }
+    db->len = st.st_size;
+    db->mapped = 1;
+    return db;
+}
 
-            hprev->hi = new->lo;
-            hnext->lo = new->hi;
+void hostlist_db_close(hostlist_db_t db)
+{
+    if (db == NULL || refcnt_decr(&db->refcnt) > 0)
+        return;
+    if (db->mapped)
+        munmap((void *) db->image, db->len);
+    free(db);
+}
 
-            if (hostrange_empty(hprev))
-                hostlist_delete_range(hl, i);
+int hostlist_db_ngroups(hostlist_db_t db)
+{
+    return db->hdr->ngroups;
+}
 
-            while (new->lo <= new->hi) {
-                hostrange_t hr = hostrange_create( new->prefix,
-                                                   new->lo, new->lo,
-                                                   new->width );
+const char *hostlist_db_name(hostlist_db_t db, int n)
+{
+    uint64_t off;
 
-                if (new->lo > hprev->hi)
-                    hostlist_insert_range(hl, hr, j++);
+    if (n < 0 || n >= (int) db->hdr->ngroups)
+        seterrno_ret(EINVAL, NULL);
+    if ((off = db->groups[n].name) >= db->hdr->size)
+        seterrno_ret(EINVAL, NULL);
+    return db->image + off;
+}
 
-                if (new->lo < hnext->lo)
-                    hostlist_insert_range(hl, hr, j++);
+/* Find group name of db by binary search. Returns NULL with errno set
+ * to ENOENT if there is no such group, or EINVAL if the group table
+ * of the image is invalid.
+ */
+static const struct hostlist_db_group *
+_db_group(hostlist_db_t db, const char *name)
+{
+    int lo = 0, hi = (int) db->hdr->ngroups - 1;
 
-                hostrange_destroy(hr);
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        const char *s = hostlist_db_name(db, mid);
+        int rc;
 
-                new->lo++;
-            }
-            i = hl->nranges;
-            hostrange_destroy(new);
-        }
+        if (s == NULL)
+            return NULL;
+        if ((rc = strcmp(name, s)) == 0)
+            return &db->groups[mid];
+        if (rc < 0)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
     }
-    UNLOCK_HOSTLIST(hl);
-
-    hostlist_collapse(hl);
+    seterrno_ret(ENOENT, NULL);
+}
 
+/* Return the count index of group g, or NULL with errno set if the
+ * ranges or counts of g lie outside the image.
+ */
+static const int32_t *
+_db_group_cum(hostlist_db_t db, const struct hostlist_db_group *g)
+{
+    uint64_t size = db->hdr->size;
+
+    if ((g->ranges & 7) || g->ranges > size
+        || g->nranges > (size - g->ranges) / sizeof(struct hostlist_db_range)
+        || (g->cum & 3) || g->cum > size
+        || g->nranges >= (size - g->cum) / sizeof(int32_t))
+        seterrno_ret(EINVAL, NULL);
+    return (const int32_t *) (db->image + g->cum);
 }
 
-/* attempt to join ranges at loc and loc-1 in a hostlist  */
-/* delete duplicates, return the number of hosts deleted  */
-/* assumes that the hostlist hl has been locked by caller */
-/* returns -1 if no range join occurred */
-static int _attempt_range_join(hostlist_t hl, int loc)
+int hostlist_db_count(hostlist_db_t db, const char *name)
 {
-    int ndup;
-    assert(hl != NULL);
-    assert(hl->magic == HOSTLIST_MAGIC);
-    assert(loc > 0);
-    assert(loc < hl->nranges);
-    ndup = hostrange_join(hl->hr[loc - 1], hl->hr[loc]);
-    if (ndup >= 0) {
-        hostlist_delete_range(hl, loc);
-        hl->nhosts -= ndup;
-    }
-    return ndup;
+    const struct hostlist_db_group *g;
+    const int32_t *cum;
+
+    if (!(g = _db_group(db, name)) || !(cum = _db_group_cum(db, g)))
+        return -1;
+    return cum[g->nranges];
 }
 
-void hostlist_uniq(hostlist_t hl)
+hostlist_t hostlist_db_get(hostlist_db_t db, const char *name)
 {
-    int i = 1;
-    hostlist_iterator_t hli;
-    LOCK_HOSTLIST(hl);
-    if (hl->nranges <= 1) {
-        UNLOCK_HOSTLIST(hl);
-        return;
-    }
-    qsort(hl->hr, hl->nranges, sizeof(hostrange_t), &_cmp);
+    const struct hostlist_db_group *g;
+    const struct hostlist_db_range *r;
+    const int32_t *cum;
+    hostrange_t hr;
+    hostlist_t new;
+    int i, n;
 
-    while (i < hl->nranges) {
-        if (_attempt_range_join(hl, i) < 0) /* No range join occurred */
-            i++;
+    if (!(g = _db_group(db, name)) || !(cum = _db_group_cum(db, g)))
+        return NULL;
+    if (g->nranges > INT_MAX || cum[0] != 0)
+        seterrno_ret(EINVAL, NULL);
+    n = g->nranges;
+    r = (const void *) (db->image + g->ranges);
+
+    if (!(new = hostlist_new()))
+        return NULL;
+    if ((n > new->size && !hostlist_resize(new, n))
+        || !(new->block = malloc((n > 0 ? n : 1) * sizeof(*hr)))) {
+        hostlist_destroy(new);
+        out_of_memory("hostlist_db_get");
     }
 
-    /* reset all iterators */
-    for (hli = hl->ilist; hli; hli = hli->next)
-        hostlist_iterator_reset(hli);
+    /* The ranges point at their prefixes in the image, and the count
+     * index is used in place. Only the range structures are built.
+     */
+    hr = new->block;
+    for (i = 0; i < n; i++) {
+        unsigned long count = 1;
+
+        if (r[i].prefix >= db->hdr->size || r[i].width < -1
+            || r[i].width > MAX_SUFFIX_WIDTH)
+            goto invalid;
+        hr[i].prefix = (char *) db->image + r[i].prefix;
+        hr[i].singlehost = r[i].width < 0;
+        hr[i].width = hr[i].singlehost ? 0 : r[i].width;
+        hr[i].lo = hr[i].singlehost ? 0 : r[i].lo;
+        hr[i].hi = hr[i].singlehost ? 0 : r[i].hi;
+        if (!hr[i].singlehost) {
+            if (r[i].lo > r[i].hi || r[i].hi - r[i].lo >= INT_MAX
+                || r[i].hi > ULONG_MAX)
+                goto invalid;
+            count = r[i].hi - r[i].lo + 1;
+        }
+        if (cum[i + 1] < cum[i]
+            || (unsigned long) (cum[i + 1] - cum[i]) != count)
+            goto invalid;
+        new->hr[i] = &hr[i];
+    }
+    new->nranges = n;
+    new->nhosts = cum[n];
+    new->cum = (int *) cum;
+    new->ncum = n;
+    new->csize = n + 1;
+    new->db = db;
+    refcnt_incr(&db->refcnt);
+
+    _hostlist_index_keys(new);
+    new->frozen = 1;
+    return new;
 
-    UNLOCK_HOSTLIST(hl);
+  invalid:
+    hostlist_destroy(new);
+    seterrno_ret(EINVAL, NULL);
 }
 
+/* ----[ hostlist fanout trees ]---- */
 
-ssize_t hostlist_deranged_string(hostlist_t hl, size_t n, char *buf)
+/* The tree is laid out breadth first over host positions: the root is
+ * position 0, and the children of position i are positions k*i + 1
+ * through k*i + k. The descendants of a position at each level below
+ * it, like the levels themselves, are therefore runs of consecutive
+ * positions.
+ */
+
+/* Return position k*i + 1, the first child of i, or n if it is
+ * beyond the last of the n hosts.
+ */
+static int _tree_child(int i, int k, int n)
 {
-    int i;
-    int len = 0;
-    int truncated = 0;
+    if (i > (n - 1) / k)
+        return n;
+    return k * i + 1;
+}
 
-    LOCK_HOSTLIST(hl);
-    for (i = 0; i < hl->nranges; i++) {
-        size_t m = (n - len) <= n ? n - len : 0;
-        int ret = hostrange_to_string(hl->hr[i], m, buf + len, ",");
-        if (ret < 0 || ret > m) {
-            len = n;
-            truncated = 1;
-            break;
-        }
-        len+=ret;
-        buf[len++] = ',';
+hostlist_tree_t hostlist_fanout_tree(hostlist_t hl, int k)
+{
+    hostlist_tree_t t;
+    int s, n;
+
+    if (hl == NULL || k < 1)
+        seterrno_ret(EINVAL, NULL);
+    if (!(t = malloc(sizeof(*t))))
+        seterrno_ret(ENOMEM, NULL);
+    if (!(t->hl = hostlist_freeze(hl))) {
+        free(t);
+        seterrno_ret(ENOMEM, NULL);
     }
-    UNLOCK_HOSTLIST(hl);
-
-    buf[len > 0 ? --len : 0] = '\0';
-    if (len == n)
-        truncated = 1;
+    t->k = k;
+    t->depth = 0;
 
-    return truncated ? -1 : len;
+    n = hostlist_count(t->hl);
+    for (s = 0; s < n; s = _tree_child(s, k, n))
+        t->depth++;
+    return t;
 }
 
-/* return true if a bracket is needed for the range at i in hostlist hl */
-static int _is_bracket_needed(hostlist_t hl, int i)
+void hostlist_tree_destroy(hostlist_tree_t t)
 {
-    hostrange_t h1 = hl->hr[i];
-    hostrange_t h2 = i < hl->nranges - 1 ? hl->hr[i + 1] : NULL;
-    return hostrange_count(h1) > 1 || hostrange_within_range(h1, h2);
+    if (t == NULL)
+        return;
+    hostlist_destroy(t->hl);
+    free(t);
 }
 
-/* write the next bracketed hostlist, i.e. prefix[n-m,k,...]
- * into buf, writing at most n chars including the terminating '\0'
- *
- * leaves start pointing to one past last range object in bracketed list,
- * and returns the number of bytes written into buf.
- *
- * Assumes hostlist is locked.
- */
-static int
-_get_bracketed_list(hostlist_t hl, int *start, const size_t n, char *buf)
+int hostlist_tree_depth(hostlist_tree_t t)
 {
-    hostrange_t *hr = hl->hr;
-    int i = *start;
-    int m, len = 0;
-    int bracket_needed = _is_bracket_needed(hl, i);
-
-    len = snprintf(buf, n, "%s", hr[i]->prefix);
-
-    if ((len < 0) || (len > n))
-        return n; /* truncated, buffer filled */
+    return t->depth;
+}
 
-    if (bracket_needed && len < n)
-        buf[len++] = '[';
+int hostlist_tree_count(hostlist_tree_t t)
+{
+    return hostlist_count(t->hl);
+}
 
-    do {
-        m = (n - len) <= n ? n - len : 0;
-        len += hostrange_numstr(hr[i], m, buf + len);
-        if (len >= n)
-            break;
-        if (bracket_needed) /* Only need commas inside brackets */
-            buf[len++] = ',';
-    } while (++i < hl->nranges && hostrange_within_range(hr[i], hr[i-1]));
+int hostlist_tree_find(hostlist_tree_t t, const char *hostname)
+{
+    return hostlist_find(t->hl, hostname);
+}
 
-    if (bracket_needed && len < n && len > 0) {
+char *hostlist_tree_host(hostlist_tree_t t, int pos)
+{
+    return hostlist_nth(t->hl, pos);
+}
 
-        /* Add trailing bracket (change trailing "," from above to "]" */
-        buf[len - 1] = ']';
+int hostlist_tree_parent(hostlist_tree_t t, int pos)
+{
+    if (pos < 0 || pos >= hostlist_count(t->hl))
+        seterrno_ret(EINVAL, -1);
+    return pos > 0 ? (pos - 1) / t->k : -1;
+}
 
-        /* NUL terminate for safety, but do not add terminator to len */
-        buf[len]   = '\0';
+hostlist_t hostlist_tree_level(hostlist_tree_t t, int level)
+{
+    int i, s = 0, n = hostlist_count(t->hl);
 
-    } else if (len >= n) {
-        if (n > 0)
-            buf[n-1] = '\0';
+    if (level < 0 || level >= t->depth)
+        seterrno_ret(EINVAL, NULL);
+    for (i = 0; i < level; i++)
+        s = _tree_child(s, t->k, n);
+    return hostlist_slice(t->hl, s, _tree_child(s, t->k, n));
+}
 
-    } else {
-        /* If len is > 0, NUL terminate (but do not add to len) */
-        buf[len > 0 ? len : 0] = '\0';
+hostlist_t *hostlist_tree_levels(hostlist_tree_t t)
+{
+    hostlist_t *levels;
+    int i, s = 0, n = hostlist_count(t->hl);
+
+    if (!(levels = calloc(t->depth > 0 ? t->depth : 1, sizeof(hostlist_t))))
+        seterrno_ret(ENOMEM, NULL);
+
+    /* each level starts where the one above it ends */
+    for (i = 0; i < t->depth; i++, s = _tree_child(s, t->k, n)) {
+        if (!(levels[i] = hostlist_slice(t->hl, s, _tree_child(s, t->k, n)))) {
+            while (i-- > 0)
+                hostlist_destroy(levels[i]);
+            free(levels);
+            seterrno_ret(ENOMEM, NULL);
+        }
     }
-
-    *start = i;
-    return len;
+    return levels;
 }
 
-ssize_t hostlist_ranged_string(hostlist_t hl, size_t n, char *buf)
+hostlist_t hostlist_tree_children(hostlist_tree_t t, int pos)
 {
-    int i = 0;
-    int len = 0;
-    int truncated = 0;
+    int n = hostlist_count(t->hl);
 
-    LOCK_HOSTLIST(hl);
-    while (i < hl->nranges && len < n) {
-        len += _get_bracketed_list(hl, &i, n - len, buf + len);
-        if ((len > 0) && (len < n) && (i < hl->nranges))
-            buf[len++] = ',';
-    }
-    UNLOCK_HOSTLIST(hl);
+    if (pos < 0 || pos >= n)
+        seterrno_ret(EINVAL, NULL);
+    return hostlist_slice(t->hl, _tree_child(pos, t->k, n),
+                          _tree_child(pos + 1, t->k, n));
+}
 
-    /* NUL terminate */
-    if (len >= n) {
-        truncated = 1;
-        if (n > 0)
-            buf[n-1] = '\0';
-    } else
-        buf[len > 0 ? len : 0] = '\0';
+hostlist_t hostlist_tree_subtree(hostlist_tree_t t, int pos)
+{
+    hostlist_t new, level;
+    int lo = pos, hi = pos + 1, n = hostlist_count(t->hl);
 
-    return truncated ? -1 : len;
+    if (pos < 0 || pos >= n)
+        seterrno_ret(EINVAL, NULL);
+    if (!(new = hostlist_new()))
+        return NULL;
+
+    /* one run of positions on each level below pos */
+    while (lo < n) {
+        if (!(level = hostlist_slice(t->hl, lo, hi))
+            || hostlist_push_list(new, level) < 0) {
+            hostlist_destroy(level);
+            hostlist_destroy(new);
+            seterrno_ret(ENOMEM, NULL);
+        }
+        hostlist_destroy(level);
+        lo = _tree_child(lo, t->k, n);
+        hi = _tree_child(hi, t->k, n);
+    }
+    return new;
 }
 
+
 /* ----[ hostlist iterator functions ]---- */
 
 static hostlist_iterator_t hostlist_iterator_new(void)
@@ -2217,7 +6241,10 @@ static hostlist_iterator_t hostlist_iterator_new(void)
     i->hr = NULL;
     i->idx = 0;
     i->depth = -1;
+    i->pos = -1;
+    i->epoch = 0;
     i->next = i;
+    i->prev = NULL;
     assert((i->magic = HOSTLIST_MAGIC));
     return i;
 }
@@ -2229,10 +6256,22 @@ hostlist_iterator_t hostlist_iterator_create(hostlist_t hl)
     if (!(i = hostlist_iterator_new()))
         out_of_memory("hostlist_iterator_create");
 
-    LOCK_HOSTLIST(hl);
     i->hl = hl;
+    if (hl->frozen) {
+        /* iterators hold a reference to frozen lists instead of
+         * being linked into them */
+        refcnt_incr(&hl->refcnt);
+        i->hr = hl->hr[0];
+        i->next = NULL;
+        return i;
+    }
+
+    LOCK_HOSTLIST(hl);
     i->hr = hl->hr[0];
+    i->epoch = hl->epoch;
     i->next = hl->ilist;
+    if (hl->ilist)
+        hl->ilist->prev = i;
     hl->ilist = i;
     UNLOCK_HOSTLIST(hl);
     return i;
@@ -2240,6 +6279,7 @@ hostlist_iterator_t hostlist_iterator_create(hostlist_t hl)
 
 hostlist_iterator_t hostset_iterator_create(hostset_t set)
 {
+    hostset_flush(set);
     return hostlist_iterator_create(set->hl);
 }
 
@@ -2247,32 +6287,132 @@ void hostlist_iterator_reset(hostlist_iterator_t i)
 {
     assert(i != NULL);
     assert(i->magic == HOSTLIST_MAGIC);
+    RDLOCK_HOSTLIST(i->hl);
     i->idx = 0;
     i->hr = i->hl->hr[0];
     i->depth = -1;
+    i->pos = -1;
+    i->epoch = i->hl->epoch;
+    RDUNLOCK_HOSTLIST(i->hl);
     return;
 }
 
+int hostlist_iterator_seek(hostlist_iterator_t i, int n)
+{
+    assert(i != NULL);
+    assert(i->magic == HOSTLIST_MAGIC);
+    RDLOCK_HOSTLIST(i->hl);
+    if (n < 0 || n > i->hl->nhosts) {
+        RDUNLOCK_HOSTLIST(i->hl);
+        seterrno_ret(EINVAL, -1);
+    }
+    _iterator_set_pos(i, n - 1);
+    i->epoch = i->hl->epoch;
+    RDUNLOCK_HOSTLIST(i->hl);
+    return 0;
+}
+
+int hostlist_iterator_seek_host(hostlist_iterator_t i, const char *hostname)
+{
+    hostname_t hn;
+    int n;
+
+    assert(i != NULL);
+    assert(i->magic == HOSTLIST_MAGIC);
+    if (!hostname || !(hn = hostname_create(hostname)))
+        return -1;
+
+    RDLOCK_HOSTLIST(i->hl);
+    if ((n = _hostlist_find(i->hl, hn)) >= 0) {
+        _iterator_set_pos(i, n - 1);
+        i->epoch = i->hl->epoch;
+    }
+    RDUNLOCK_HOSTLIST(i->hl);
+
+    hostname_destroy(hn);
+    return n;
+}
+
 void hostlist_iterator_destroy(hostlist_iterator_t i)
 {
-    hostlist_iterator_t *pi;
     if (i == NULL)
         return;
     assert(i != NULL);
     assert(i->magic == HOSTLIST_MAGIC);
-    LOCK_HOSTLIST(i->hl);
-    for (pi = &i->hl->ilist; *pi; pi = &(*pi)->next) {
-        assert((*pi)->magic == HOSTLIST_MAGIC);
-        if (*pi == i) {
-            *pi = (*pi)->next;
-            break;
-        }
+    if (i->hl->frozen)
+        hostlist_destroy(i->hl);
+    else {
+        LOCK_HOSTLIST(i->hl);
+        if (i->prev)
+            i->prev->next = i->next;
+        else
+            i->hl->ilist = i->next;
+        if (i->next)
+            i->next->prev = i->prev;
+        UNLOCK_HOSTLIST(i->hl);
     }
-    UNLOCK_HOSTLIST(i->hl);
     assert((i->magic = 0x1));
     free(i);
 }
 
+/* Move iterator i to the host at position pos in its hostlist,
+ * or to the start of the list if pos < 0. Positions past the end
+ * leave the iterator on the last host.
+ */
+static void _iterator_set_pos(hostlist_iterator_t i, int pos)
+{
+    hostlist_t hl = i->hl;
+
+    if (pos >= hl->nhosts)
+        pos = hl->nhosts - 1;
+
+    if (pos < 0) {
+        i->idx = 0;
+        i->depth = -1;
+        i->pos = -1;
+    } else {
+        i->idx = _hostlist_range_at(hl, pos);
+        i->depth = pos - _hostlist_offset(hl, i->idx);
+        i->pos = pos;
+    }
+    i->hr = hl->hr[i->idx];
+}
+
+/* Bring iterator i up to date with its hostlist if the list has been
+ * modified since i was last used. The position of i is adjusted for
+ * hosts inserted or deleted before it, or reset if the list has been
+ * reordered. An iterator which has fallen more than HOSTLIST_EDIT_LOG
+ * edits behind keeps its numeric position.
+ * Assumes the hostlist lock is held.
+ */
+static void _iterator_sync(hostlist_iterator_t i)
+{
+    hostlist_t hl = i->hl;
+    int pos = i->pos;
+    unsigned long n;
+
+    if (i->epoch == hl->epoch)
+        return;
+
+    if (i->epoch < hl->reset_epoch)
+        pos = -1;
+    else if (i->epoch >= hl->lost_epoch) {
+        n = hl->nedits > HOSTLIST_EDIT_LOG ? hl->nedits - HOSTLIST_EDIT_LOG : 0;
+        for (; n < hl->nedits; n++) {
+            struct hostlist_edit *e = &hl->edits[n % HOSTLIST_EDIT_LOG];
+            if (e->epoch <= i->epoch || pos < e->pos)
+                continue;
+            if (e->delta > 0 || pos >= e->pos - e->delta)
+                pos += e->delta;
+            else /* current host was deleted */
+                pos = e->pos - 1;
+        }
+    }
+
+    _iterator_set_pos(i, pos);
+    i->epoch = hl->epoch;
+}
+
 static void _iterator_advance(hostlist_iterator_t i)
 {
     assert(i != NULL);
@@ -2287,6 +6427,21 @@ static void _iterator_advance(hostlist_iterator_t i)
         }
         i->hr = i->hl->hr[i->idx];
     }
+    if (i->idx < i->hl->nranges)
+        i->pos++;
+}
+
+/* step iterator back to the previous host, crossing into the
+ * previous range if needed */
+static void _iterator_retreat(hostlist_iterator_t i)
+{
+    assert(i != NULL);
+    assert(i->magic == HOSTLIST_MAGIC);
+    if (--i->depth < 0 && i->idx > 0) {
+        i->hr = i->hl->hr[--i->idx];
+        i->depth = hostrange_count(i->hr) - 1;
+    }
+    i->pos--;
 }
 
 /* advance iterator to end of current range (meaning within "[" "]")
@@ -2309,40 +6464,193 @@ static void _iterator_advance_range(hostlist_iterator_t i)
         i->hr = i->hl->hr[i->idx];
         i->depth = 0;
     }
+    if (i->idx < nr)
+        i->pos = _hostlist_offset(i->hl, i->idx);
+    else
+        i->pos = i->hl->nhosts - 1;
 }
 
 char *hostlist_next(hostlist_iterator_t i)
 {
     char *buf = NULL;
-    char suffix[16];
-    int len = 0;
     assert(i != NULL);
     assert(i->magic == HOSTLIST_MAGIC);
-    LOCK_HOSTLIST(i->hl);
+    RDLOCK_HOSTLIST(i->hl);
+    _iterator_sync(i);
     _iterator_advance(i);
 
     if (i->idx > i->hl->nranges - 1) {
-        UNLOCK_HOSTLIST(i->hl);
+        RDUNLOCK_HOSTLIST(i->hl);
         return NULL;
     }
 
-    suffix[0] = '\0';
+    if (!(buf = hostrange_host(i->hr, i->hr->lo + i->depth))) {
+        RDUNLOCK_HOSTLIST(i->hl);
+        out_of_memory("hostlist_next");
+    }
 
-    if (!i->hr->singlehost)
-        snprintf (suffix, 15, "%0*lu", i->hr->width, i->hr->lo + i->depth);
+    RDUNLOCK_HOSTLIST(i->hl);
+    return (buf);
+}
 
-    len = strlen (i->hr->prefix) + strlen (suffix) + 1;
-    if (!(buf = malloc (len)))
-        out_of_memory("hostlist_next");
+char *hostlist_prev(hostlist_iterator_t i)
+{
+    char *buf = NULL;
+    assert(i != NULL);
+    assert(i->magic == HOSTLIST_MAGIC);
+    RDLOCK_HOSTLIST(i->hl);
+    _iterator_sync(i);
+
+    if (i->pos < 0) {
+        RDUNLOCK_HOSTLIST(i->hl);
+        return NULL;
+    }
 
-    buf[0] = '\0';
-    strcat (buf, i->hr->prefix);
-    strcat (buf, suffix);
+    /* step back from the end of the list onto the last host */
+    if (i->idx > i->hl->nranges - 1)
+        _iterator_set_pos(i, i->pos);
 
-    UNLOCK_HOSTLIST(i->hl);
+    if (!(buf = hostrange_host(i->hr, i->hr->lo + i->depth))) {
+        RDUNLOCK_HOSTLIST(i->hl);
+        out_of_memory("hostlist_prev");
+    }
+    _iterator_retreat(i);
+
+    RDUNLOCK_HOSTLIST(i->hl);
     return (buf);
 }
 
+int hostlist_next_r(hostlist_iterator_t i, char *buf, size_t len)
+{
+    hostrange_t hr;
+    unsigned long num;
+    size_t plen, n;
+    int idx, depth, pos;
+
+    assert(i != NULL);
+    assert(i->magic == HOSTLIST_MAGIC);
+    RDLOCK_HOSTLIST(i->hl);
+    _iterator_sync(i);
+
+    /* save position in case the iterator must be backed up */
+    idx = i->idx;
+    hr = i->hr;
+    depth = i->depth;
+    pos = i->pos;
+
+    _iterator_advance(i);
+
+    if (i->idx > i->hl->nranges - 1) {
+        RDUNLOCK_HOSTLIST(i->hl);
+        if (len > 0)
+            buf[0] = '\0';
+        return 0;
+    }
+
+    num = i->hr->lo + i->depth;
+    plen = strlen(i->hr->prefix);
+    n = plen;
+    if (!i->hr->singlehost)
+        n += i->hr->width > _ndigits(num) ? i->hr->width : _ndigits(num);
+
+    if (n + 1 > len) {
+        i->idx = idx;
+        i->hr = hr;
+        i->depth = depth;
+        i->pos = pos;
+        RDUNLOCK_HOSTLIST(i->hl);
+        seterrno_ret(ERANGE, -1);
+    }
+
+    memcpy(buf, i->hr->prefix, plen);
+    if (!i->hr->singlehost)
+        _numstr(buf + plen, num, i->hr->width);
+    buf[n] = '\0';
+
+    RDUNLOCK_HOSTLIST(i->hl);
+    return n;
+}
+
+int hostlist_next_batch(hostlist_iterator_t i, char *arena, size_t len,
+                        uint32_t *offsets, int max)
+{
+    struct hostname_gen g;
+    size_t used = 0;
+    int n = 0;
+    int full = 0;
+    int nomem = 0;
+
+    assert(i != NULL);
+    assert(i->magic == HOSTLIST_MAGIC);
+    RDLOCK_HOSTLIST(i->hl);
+    _iterator_sync(i);
+
+    while (n < max && !full) {
+        hostrange_t hr = i->hr;
+        int idx = i->idx;
+        int depth = i->depth;
+        int pos = i->pos;
+        int first = 1;
+
+        _iterator_advance(i);
+        if (i->idx > i->hl->nranges - 1)
+            break;
+
+        if (hostname_gen_init(&g, i->hr, i->hr->lo + i->depth) < 0) {
+            /* back up so that the failed host is read again next time */
+            i->idx = idx;
+            i->hr = hr;
+            i->depth = depth;
+            i->pos = pos;
+            nomem = 1;
+            break;
+        }
+
+        /* copy hosts from the current range while they fit */
+        for (;;) {
+            if (used + g.len + 1 > len) {
+                /* back up iterator over the host that did not fit */
+                if (first) {
+                    i->idx = idx;
+                    i->hr = hr;
+                    i->depth = depth;
+                    i->pos = pos;
+                } else {
+                    i->depth--;
+                    i->pos--;
+                }
+                full = 1;
+                break;
+            }
+            offsets[n++] = used;
+            memcpy(arena + used, g.name, g.len + 1);
+            used += g.len + 1;
+            first = 0;
+
+            if (n == max || i->hr->singlehost
+                || i->depth >= i->hr->hi - i->hr->lo)
+                break;
+            i->depth++;
+            i->pos++;
+            hostname_gen_incr(&g);
+        }
+        hostname_gen_fini(&g);
+    }
+
+    RDUNLOCK_HOSTLIST(i->hl);
+
+    /* hosts already copied are returned; the error is reported by the
+     * next call, which fails on the same host
+     */
+    if (n == 0 && nomem)
+        seterrno_ret(ENOMEM, -1);
+    if (n == 0 && full)
+        seterrno_ret(ERANGE, -1);
+
+    offsets[n] = used;
+    return n;
+}
+
 char *hostlist_next_range(hostlist_iterator_t i)
 {
     char buf[MAXHOSTRANGELEN + 1];
@@ -2350,19 +6658,20 @@ char *hostlist_next_range(hostlist_iterator_t i)
 
     assert(i != NULL);
     assert(i->magic == HOSTLIST_MAGIC);
-    LOCK_HOSTLIST(i->hl);
+    RDLOCK_HOSTLIST(i->hl);
+    _iterator_sync(i);
 
     _iterator_advance_range(i);
 
     if (i->idx > i->hl->nranges - 1) {
-        UNLOCK_HOSTLIST(i->hl);
+        RDUNLOCK_HOSTLIST(i->hl);
         return NULL;
     }
 
     j = i->idx;
     _get_bracketed_list(i->hl, &j, MAXHOSTRANGELEN, buf);
 
-    UNLOCK_HOSTLIST(i->hl);
+    RDUNLOCK_HOSTLIST(i->hl);
 
     return strdup(buf);
 }
@@ -2372,19 +6681,25 @@ int hostlist_remove(hostlist_iterator_t i)
     hostrange_t new;
     assert(i != NULL);
     assert(i->magic == HOSTLIST_MAGIC);
+    CHECK_MUTABLE(i->hl, 0);
     LOCK_HOSTLIST(i->hl);
+    if (!_hostlist_own(i->hl)) {
+        UNLOCK_HOSTLIST(i->hl);
+        return 0;
+    }
+    _iterator_sync(i);
+    _hostlist_touch(i->hl, i->idx);
     new = hostrange_delete_host(i->hr, i->hr->lo + i->depth);
     if (new) {
         hostlist_insert_range(i->hl, new, i->idx + 1);
         hostrange_destroy(new);
-        i->hr = i->hl->hr[++i->idx];
-        i->depth = -1;
-    } else if (hostrange_empty(i->hr)) {
+    } else if (hostrange_empty(i->hr))
         hostlist_delete_range(i->hl, i->idx);
-    } else
-        i->depth--;
 
+    /* i is repositioned on the host before the one removed
+     * the next time it is used */
     i->hl->nhosts--;
+    _hostlist_edit(i->hl, i->pos, -1);
     UNLOCK_HOSTLIST(i->hl);
 
     return 1;
@@ -2392,6 +6707,37 @@ int hostlist_remove(hostlist_iterator_t i)
 
 /* ----[ hostset functions ]---- */
 
+/* Return the width of hr as _hostlist_sort_ranges() first sees it:
+ * ranges with no zero padding, e.g. n[8-12], have width 1.
+ */
+static int _hostrange_sort_width(hostrange_t hr)
+{
+    if (hr->singlehost || _zero_padded(hr->lo, hr->width) == 0)
+        return 1;
+    return hr->width;
+}
+
+/* Return true if h1 and h2 have the same prefix but different widths
+ */
+static int _hostrange_mixed(hostrange_t h1, hostrange_t h2)
+{
+    return hostrange_prefix_cmp(h1, h2) == 0 && !h1->singlehost
+        && _hostrange_sort_width(h1) != _hostrange_sort_width(h2);
+}
+
+/* Set set->mixed if any prefix in the sorted ranges of set has more
+ * than one width. Assumes the set->hl lock is held or set is new.
+ */
+static void _hostset_check_widths(hostset_t set)
+{
+    hostlist_t hl = set->hl;
+    int i;
+
+    set->mixed = 0;
+    for (i = 1; i < hl->nranges && !set->mixed; i++)
+        set->mixed = _hostrange_mixed(hl->hr[i - 1], hl->hr[i]);
+}
+
 hostset_t hostset_create(const char *hostlist)
 {
     hostset_t new;
@@ -2401,10 +6747,18 @@ hostset_t hostset_create(const char *hostlist)
 
     if (!(new->hl = hostlist_create(hostlist)))
         goto error2;
+    if (!(new->log = hostlist_create(NULL)))
+        goto error3;
+    new->spans = NULL;
+    new->spansize = new->nspans = 0;
+    _hostset_log_reset(new);
 
     hostlist_uniq(new->hl);
+    _hostset_check_widths(new);
     return new;
 
+  error3:
+    hostlist_destroy(new->hl);
   error2:
     free(new);
   error1:
@@ -2417,10 +6771,19 @@ hostset_t hostset_copy(const hostset_t set)
     if (!(new = (hostset_t) malloc(sizeof(*new))))
         goto error1;
 
+    hostset_flush(set);
     if (!(new->hl = hostlist_copy(set->hl)))
         goto error2;
+    if (!(new->log = hostlist_create(NULL)))
+        goto error3;
+    new->mixed = set->mixed;
+    new->spans = NULL;
+    new->spansize = new->nspans = 0;
+    _hostset_log_reset(new);
 
     return new;
+  error3:
+    hostlist_destroy(new->hl);
   error2:
     free(new);
   error1:
@@ -2431,10 +6794,238 @@ void hostset_destroy(hostset_t set)
 {
     if (set == NULL)
         return;
+    _hostset_log_reset(set);
+    free(set->spans);
     hostlist_destroy(set->hl);
+    hostlist_destroy(set->log);
     free(set);
 }
 
+/* Move the hosts in set->log into set->hl, then sort hl and remove
+ * duplicates. Assumes the set->hl lock is held.
+ */
+static void _hostset_merge_log(hostset_t set)
+{
+    hostlist_t hl = set->hl;
+    hostlist_t log = set->log;
+    int n;
+
+    LOCK_HOSTLIST(log);
+    n = hl->nranges + log->nranges;
+    if (log->nranges == 0 || !_hostlist_own(hl)
+        || (n > hl->size && !hostlist_resize(hl, n))) {
+        UNLOCK_HOSTLIST(log);
+        return;
+    }
+
+    memcpy(hl->hr + hl->nranges, log->hr, log->nranges * sizeof(hostrange_t));
+    memset(log->hr, 0, log->nranges * sizeof(hostrange_t));
+    hl->nranges = n;
+    hl->nhosts += log->nhosts;
+    log->nranges = 0;
+    log->nhosts = 0;
+    _hostlist_reorder(log);
+    UNLOCK_HOSTLIST(log);
+
+    _hostlist_sort_ranges(hl, 1);
+    _hostlist_join_ranges(hl, 1);
+    _hostlist_reorder(hl);
+    _hostset_check_widths(set);
+    _hostset_log_reset(set);
+}
+
+/* Return the number of hosts numbered lo .. hi with the prefix and
+ * width of hr which are in set, or -1 if set has ranges of that prefix
+ * with another width. Assumes set->mixed is not set and the set->hl
+ * lock is held.
+ */
+static long _hostset_overlap(hostset_t set, hostrange_t hr,
+                             unsigned long lo, unsigned long hi)
+{
+    hostlist_t hl = set->hl;
+    int a = 0, b = hl->nranges;
+    long n = 0;
+
+    /* find the first range of the prefix of hr which ends at lo or
+     * later: the ranges of one prefix and width are sorted and apart */
+    while (a < b) {
+        int mid = a + (b - a) / 2;
+        int cmp = hostrange_prefix_cmp(hl->hr[mid], hr);
+        if (cmp < 0 || (cmp == 0 && !hr->singlehost && hl->hr[mid]->hi < lo))
+            a = mid + 1;
+        else
+            b = mid;
+    }
+    if ((a < hl->nranges && _hostrange_mixed(hl->hr[a], hr))
+        || (a > 0 && _hostrange_mixed(hl->hr[a - 1], hr)))
+        return -1;
+
+    if (hr->singlehost)
+        return a < hl->nranges && hostrange_prefix_cmp(hl->hr[a], hr) == 0;
+
+    for (; a < hl->nranges && hostrange_prefix_cmp(hl->hr[a], hr) == 0
+           && hl->hr[a]->lo <= hi; a++) {
+        unsigned long l = hl->hr[a]->lo > lo ? hl->hr[a]->lo : lo;
+        unsigned long h = hl->hr[a]->hi < hi ? hl->hr[a]->hi : hi;
+        n += h - l + 1;
+    }
+    return n;
+}
+
+/* Forget the hosts counted in the log of set. Assumes the set->hl lock
+ * is held or set is new.
+ */
+static void _hostset_log_reset(hostset_t set)
+{
+    int i;
+
+    for (i = 0; i < set->nspans; i++)
+        hostrange_destroy(set->spans[i]);
+    set->nspans = 0;
+    set->nlog = 0;
+    set->lmixed = 0;
+    set->lepoch = set->hl->epoch;
+}
+
+/* Count the hosts of range hr, about to be appended to the log of set,
+ * which are in neither the set nor the log, and add them to set->nlog.
+ * set->spans holds the hosts of the log as sorted ranges without gaps,
+ * so only the spans next to hr and the ranges of the set it overlaps
+ * are looked at. Returns -1 if the hosts of hr cannot be told apart
+ * from those of the set or log by number, because a prefix appears
+ * with more than one width, or if out of memory.
+ * Assumes the set->hl lock is held.
+ */
+static int _hostset_log_add(hostset_t set, hostrange_t hr)
+{
+    hostrange_t *sp = set->spans;
+    unsigned long lo = hr->lo, hi = hr->hi, cur = hr->lo;
+    int a = 0, b = set->nspans;
+    long n = 0, m;
+
+    if (set->mixed)
+        return -1;
+
+    /* find the first span of the prefix of hr reaching lo - 1 */
+    while (a < b) {
+        int mid = a + (b - a) / 2;
+        int cmp = hostrange_prefix_cmp(sp[mid], hr);
+        if (cmp < 0 || (cmp == 0 && !hr->singlehost && sp[mid]->hi + 1 < lo))
+            a = mid + 1;
+        else
+            b = mid;
+    }
+    if ((a < set->nspans && _hostrange_mixed(sp[a], hr))
+        || (a > 0 && _hostrange_mixed(sp[a - 1], hr)))
+        return -1;
+
+    if (hr->singlehost) {
+        if (a < set->nspans && hostrange_prefix_cmp(sp[a], hr) == 0)
+            return 0;
+        if ((m = _hostset_overlap(set, hr, 0, 0)) < 0)
+            return -1;
+        n = 1 - m;
+        b = a;
+    } else {
+        /* count the gaps in [lo, hi] between the spans it touches */
+        for (b = a; b < set->nspans && hostrange_prefix_cmp(sp[b], hr) == 0
+               && sp[b]->lo <= hi + 1; b++) {
+            if (sp[b]->lo > cur) {
+                unsigned long h = sp[b]->lo - 1 < hi ? sp[b]->lo - 1 : hi;
+                if ((m = _hostset_overlap(set, hr, cur, h)) < 0)
+                    return -1;
+                n += h - cur + 1 - m;
+            }
+            if (sp[b]->hi + 1 > cur)
+                cur = sp[b]->hi + 1;
+        }
+        if (cur <= hi) {
+            if ((m = _hostset_overlap(set, hr, cur, hi)) < 0)
+                return -1;
+            n += hi - cur + 1 - m;
+        }
+    }
+
+    if (b > a) {
+        /* join hr and the spans it touches into sp[a] */
+        int i;
+        if (lo < sp[a]->lo)
+            sp[a]->lo = lo;
+        if (sp[b - 1]->hi > hi)
+            hi = sp[b - 1]->hi;
+        sp[a]->hi = hi;
+        for (i = a + 1; i < b; i++)
+            hostrange_destroy(sp[i]);
+        memmove(sp + a + 1, sp + b, (set->nspans - b) * sizeof(*sp));
+        set->nspans -= b - a - 1;
+    } else {
+        hostrange_t new;
+        if (set->nspans == set->spansize) {
+            int size = set->spansize ? 2 * set->spansize : HOSTLIST_CHUNK;
+            if (!(sp = realloc(set->spans, size * sizeof(*sp))))
+                return -1;
+            set->spans = sp;
+            set->spansize = size;
+        }
+        if (hr->singlehost)
+            new = hostrange_copy(hr);
+        else
+            new = hostrange_create(hr->prefix, lo, hi,
+                                   _hostrange_sort_width(hr));
+        if (new == NULL)
+            return -1;
+        memmove(sp + a + 1, sp + a, (set->nspans - a) * sizeof(*sp));
+        sp[a] = new;
+        set->nspans++;
+    }
+
+    set->nlog += n;
+    return 0;
+}
+
+/* Merge any hosts appended to set, so that they are seen by the other
+ * hostset functions.
+ */
+static void hostset_flush(hostset_t set)
+{
+    if (hostlist_nranges(set->log) == 0)
+        return;
+    LOCK_HOSTLIST(set->hl);
+    _hostset_merge_log(set);
+    UNLOCK_HOSTLIST(set->hl);
+}
+
+int hostset_append(hostset_t set, const char *hosts)
+{
+    hostlist_t hl;
+    int i, n;
+
+    if (!(hl = hostlist_create(hosts)))
+        return 0;
+
+    LOCK_HOSTLIST(set->hl);
+    /* the hosts counted in the log are only right for the hosts of the
+     * set they were counted against */
+    if (set->hl->epoch != set->lepoch && hostlist_nranges(set->log) > 0)
+        set->lmixed = 1;
+    for (i = 0; i < hl->nranges && !set->lmixed; i++) {
+        if (_hostset_log_add(set, hl->hr[i]) < 0)
+            set->lmixed = 1;
+    }
+    set->lepoch = set->hl->epoch;
+    n = hostlist_push_list(set->log, hl);
+
+    /* merge once the log is as long as the set, so each host takes
+     * part in O(log n) merges */
+    if (set->log->nranges >= HOSTSET_LOG_MIN
+        && set->log->nranges >= set->hl->nranges)
+        _hostset_merge_log(set);
+
+    UNLOCK_HOSTLIST(set->hl);
+    hostlist_destroy(hl);
+    return n;
+}
+
 /* inserts a single range object into a hostset
  * Assumes that the set->hl lock is already held
  * Updates hl->nhosts
@@ -2456,6 +7047,11 @@ static int hostset_insert_range(hostset_t set, hostrange_t hr)
 
     for (i = 0; i < hl->nranges; i++) {
         if (hostrange_cmp(hr, hl->hr[i]) <= 0) {
+            int pos = _hostlist_offset(hl, i);
+
+            if (_hostrange_mixed(hr, hl->hr[i])
+                || (i > 0 && _hostrange_mixed(hr, hl->hr[i - 1])))
+                set->mixed = 1;
 
             if ((ndups = hostrange_join(hr, hl->hr[i])) >= 0)
                 hostlist_delete_range(hl, i);
@@ -2463,22 +7059,27 @@ static int hostset_insert_range(hostset_t set, hostrange_t hr)
                 ndups = 0;
 
             hostlist_insert_range(hl, hr, i);
+            hl->nhosts += nhosts - ndups;
 
-            /* now attempt to join hr[i] and hr[i-1] */
+            /* now attempt to join hr[i] and hr[i-1]. This takes any
+             * duplicates off hl->nhosts itself */
             if (i > 0) {
                 int m;
                 if ((m = _attempt_range_join(hl, i)) > 0)
                     ndups += m;
             }
-            hl->nhosts += nhosts - ndups;
+            _hostlist_edit(hl, pos, nhosts - ndups);
             inserted = 1;
             break;
         }
     }
 
     if (inserted == 0) {
+        if (hl->nranges > 0 && _hostrange_mixed(hr, hl->hr[hl->nranges - 1]))
+            set->mixed = 1;
         hl->hr[hl->nranges++] = hostrange_copy(hr);
         hl->nhosts += nhosts;
+        _hostlist_touch(hl, hl->nranges - 1);
         if (hl->nranges > 1) {
             if ((ndups = _attempt_range_join(hl, hl->nranges - 1)) <= 0)
                 ndups = 0;
@@ -2500,22 +7101,26 @@ int hostset_insert(hostset_t set, const char *hosts)
 
     hostlist_uniq(hl);
     LOCK_HOSTLIST(set->hl);
-    for (i = 0; i < hl->nranges; i++)
-        n += hostset_insert_range(set, hl->hr[i]);
+    _hostset_merge_log(set);
+    if (_hostlist_own(set->hl)) {
+        for (i = 0; i < hl->nranges; i++)
+            n += hostset_insert_range(set, hl->hr[i]);
+    }
     UNLOCK_HOSTLIST(set->hl);
     hostlist_destroy(hl);
     return n;
 }
 
 
-/* linear search through N ranges for hostname "host"
+/* linear search through N ranges, and the ranges appended to the set
+ * but not yet merged, for hostname "host"
  * */
 static int hostset_find_host(hostset_t set, const char *host)
 {
     int i;
     int retval = 0;
     hostname_t hn;
-    LOCK_HOSTLIST(set->hl);
+    RDLOCK_HOSTLIST(set->hl);
     hn = hostname_create(host);
     for (i = 0; i < set->hl->nranges; i++) {
         if (hostrange_hn_within(set->hl->hr[i], hn) >= 0) {
@@ -2523,8 +7128,12 @@ static int hostset_find_host(hostset_t set, const char *host)
             goto done;
         }
     }
+    RDLOCK_HOSTLIST(set->log);
+    for (i = 0; i < set->log->nranges && !retval; i++)
+        retval = hostrange_hn_within(set->log->hr[i], hn) >= 0;
+    RDUNLOCK_HOSTLIST(set->log);
   done:
-    UNLOCK_HOSTLIST(set->hl);
+    RDUNLOCK_HOSTLIST(set->hl);
     hostname_destroy(hn);
     return retval;
 }
@@ -2555,61 +7164,370 @@ int hostset_within(hostset_t set, const char *hosts)
 
 int hostset_delete(hostset_t set, const char *hosts)
 {
+    hostset_flush(set);
     return hostlist_delete(set->hl, hosts);
 }
 
 int hostset_delete_host(hostset_t set, const char *hostname)
 {
+    hostset_flush(set);
     return hostlist_delete_host(set->hl, hostname);
 }
 
 char *hostset_shift(hostset_t set)
 {
+    hostset_flush(set);
     return hostlist_shift(set->hl);
 }
 
 char *hostset_pop(hostset_t set)
 {
+    hostset_flush(set);
     return hostlist_pop(set->hl);
 }
 
 char *hostset_shift_range(hostset_t set)
 {
+    hostset_flush(set);
     return hostlist_shift_range(set->hl);
 }
 
 char *hostset_pop_range(hostset_t set)
 {
+    hostset_flush(set);
     return hostlist_pop_range(set->hl);
 }
 
 int hostset_count(hostset_t set)
 {
+    int n = -1;
+
+    /* appended hosts are counted as they arrive, unless they could not
+     * be told apart from those in the set by number */
+    RDLOCK_HOSTLIST(set->hl);
+    if (hostlist_nranges(set->log) == 0)
+        n = set->hl->nhosts;
+    else if (!set->lmixed && set->hl->epoch == set->lepoch)
+        n = set->hl->nhosts + set->nlog;
+    RDUNLOCK_HOSTLIST(set->hl);
+    if (n >= 0)
+        return n;
+
+    hostset_flush(set);
     return hostlist_count(set->hl);
 }
 
 ssize_t hostset_ranged_string(hostset_t set, size_t n, char *buf)
 {
+    hostset_flush(set);
     return hostlist_ranged_string(set->hl, n, buf);
 }
 
 ssize_t hostset_deranged_string(hostset_t set, size_t n, char *buf)
 {
+    hostset_flush(set);
     return hostlist_deranged_string(set->hl, n, buf);
 }
 
 #if TEST_MAIN
 
-int hostlist_nranges(hostlist_t hl)
+#if WITH_PTHREADS
+#include <sys/time.h>
+
+struct bench_reader_arg {
+    hostlist_t hl;
+    int nops;
+    unsigned int seed;
+};
+
+/* look up random hosts by position and by name */
+static void *bench_reader(void *arg)
+{
+    struct bench_reader_arg *b = arg;
+    int i, n = hostlist_count(b->hl);
+
+    for (i = 0; i < b->nops; i++) {
+        char *host = hostlist_nth(b->hl, rand_r(&b->seed) % n);
+        if (hostlist_find(b->hl, host) < 0)
+            abort();
+        free(host);
+    }
+    return NULL;
+}
+
+/* Report read throughput of 1 to maxthreads threads sharing a single
+ * hostlist. With a reader/writer lock, throughput should grow with the
+ * number of threads up to the number of available CPUs.
+ */
+void thread_scaling_test(int maxthreads, int nops)
+{
+    hostlist_t hl = hostlist_create(NULL);
+    struct bench_reader_arg *args;
+    pthread_t *tids;
+    char buf[64];
+    int i, n;
+
+    for (i = 0; i < 512; i++) {
+        snprintf(buf, sizeof(buf), "rack%d-n[1-32]", i);
+        hostlist_push(hl, buf);
+    }
+
+    tids = malloc(maxthreads * sizeof(*tids));
+    args = malloc(maxthreads * sizeof(*args));
+
+    for (n = 1; n <= maxthreads; n *= 2) {
+        struct timeval t0, t1;
+        double secs;
+
+        gettimeofday(&t0, NULL);
+        for (i = 0; i < n; i++) {
+            args[i].hl = hl;
+            args[i].nops = nops;
+            args[i].seed = i + 1;
+            pthread_create(&tids[i], NULL, bench_reader, &args[i]);
+        }
+        for (i = 0; i < n; i++)
+            pthread_join(tids[i], NULL);
+        gettimeofday(&t1, NULL);
+
+        secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+        printf("threads = %2d  reads/sec = %.0f\n", n, n * nops / secs);
+    }
+
+    free(tids);
+    free(args);
+    hostlist_destroy(hl);
+}
+
+/* push every nthreads-th host of a few prefixes onto builder b, plus
+ * a host every thread pushes
+ */
+struct builder_arg {
+    hostlist_builder_t b;
+    int t, nthreads, err;
+};
+
+static void *builder_pusher(void *arg)
+{
+    struct builder_arg *a = arg;
+    unsigned long n;
+
+    for (n = a->t; n < 30000; n += a->nthreads) {
+        if (!hostlist_builder_push_num(a->b, "n", n, 0)
+            || !hostlist_builder_push_num(a->b, "rack-", n % 997, 4))
+            a->err = 1;
+    }
+    if (!hostlist_builder_push_host(a->b, "login1"))
+        a->err = 1;
+    return NULL;
+}
+
+/* check that a hostlist built by nthreads threads with a builder holds
+ * the same hosts as one built serially and uniq'ed
+ */
+int builder_test(int nthreads)
+{
+    struct builder_arg args[HOSTLIST_MAX_THREADS];
+    pthread_t tids[HOSTLIST_MAX_THREADS];
+    hostlist_builder_t b = hostlist_builder_create();
+    hostlist_t hl1 = hostlist_new(), hln;
+    char name[64], buf1[102400], bufn[102400];
+    unsigned long n;
+    int t, ok = 1;
+
+    for (t = 0; t < nthreads; t++) {
+        args[t].b = b;
+        args[t].t = t;
+        args[t].nthreads = nthreads;
+        args[t].err = 0;
+        pthread_create(&tids[t], NULL, builder_pusher, &args[t]);
+    }
+    for (t = 0; t < nthreads; t++) {
+        pthread_join(tids[t], NULL);
+        if (args[t].err)
+            ok = 0;
+    }
+    hln = hostlist_builder_finish(b);
+
+    for (n = 0; n < 30000; n++) {
+        snprintf(name, sizeof(name), "n%lu", n);
+        hostlist_push_host(hl1, name);
+        snprintf(name, sizeof(name), "rack-%04lu", n % 997);
+        hostlist_push_host(hl1, name);
+    }
+    hostlist_push_host(hl1, "login1");
+    hostlist_uniq(hl1);
+
+    hostlist_ranged_string(hl1, sizeof(buf1), buf1);
+    hostlist_ranged_string(hln, sizeof(bufn), bufn);
+    if (strcmp(buf1, bufn) != 0 || hostlist_count(hl1) != hostlist_count(hln))
+        ok = 0;
+
+    hostlist_destroy(hl1);
+    hostlist_destroy(hln);
+
+    printf("builder: serial == %d threads: %s\n",
+           nthreads, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+/* check that hostlist_hash_partition() gives the same shards with one
+ * thread as with nthreads, on a list of short ranges kept apart by
+ * other hosts, so that hosts next to each other in a shard come from
+ * different ranges.
+ */
+int hash_partition_test(int nthreads)
 {
-    return hl->nranges;
+    hostlist_t hl = hostlist_new();
+    hostlist_t *p1, *pn;
+    char name[64], buf1[102400], bufn[102400];
+    int i, s, nshards, ok = 1;
+
+    for (i = 0; i < 60000; i += 3) {
+        snprintf(name, sizeof(name), "c-[%d-%d],x%d", i, i + 2, i);
+        hostlist_push(hl, name);
+    }
+
+    for (nshards = 2; nshards <= 8; nshards++) {
+        hostlist_set_threads(1);
+        p1 = hostlist_hash_partition(hl, nshards, 0);
+        hostlist_set_threads(nthreads);
+        pn = hostlist_hash_partition(hl, nshards, 0);
+
+        for (s = 0; s < nshards; s++) {
+            hostlist_ranged_string(p1[s], sizeof(buf1), buf1);
+            hostlist_ranged_string(pn[s], sizeof(bufn), bufn);
+            if (strcmp(buf1, bufn) != 0
+                || hostlist_nranges(p1[s]) != hostlist_nranges(pn[s]))
+                ok = 0;
+            hostlist_destroy(p1[s]);
+            hostlist_destroy(pn[s]);
+        }
+        free(p1);
+        free(pn);
+    }
+    hostlist_set_threads(0);
+    hostlist_destroy(hl);
+
+    printf("hash_partition: 1 thread == %d threads: %s\n",
+           nthreads, ok ? "ok" : "FAILED");
+    return ok;
 }
 
+#endif                /* WITH_PTHREADS */
+
 int hostset_nranges(hostset_t set)
 {
+    hostset_flush(set);
     return set->hl->nranges;
 }
 
+/* check that hosts appended to a hostset in random order give the same
+ * set as inserting them, and that the count of appended hosts is right
+ * both before and after they are merged into the set
+ */
+int hostset_append_test(void)
+{
+    hostset_t set1 = hostset_create(NULL);
+    hostset_t set2 = hostset_create(NULL);
+    char name[64], buf1[102400], buf2[102400];
+    unsigned int seed = 1;
+    int i, count, ok = 1;
+
+    for (i = 0; i < 2000; i++) {
+        int n = rand_r(&seed) % 1500;
+        snprintf(name, sizeof(name), "n[%d-%d],io%d", n, n + 4, n % 64);
+        hostset_append(set1, name);
+        hostset_insert(set2, name);
+        if (i % 100 == 0 && hostset_count(set1) != hostset_count(set2))
+            ok = 0;
+        if (i % 100 == 0 && !hostset_within(set1, name))
+            ok = 0;
+    }
+
+    count = hostset_count(set1);
+    hostset_ranged_string(set1, sizeof(buf1), buf1);
+    hostset_ranged_string(set2, sizeof(buf2), buf2);
+    if (strcmp(buf1, buf2) != 0 || count != hostset_count(set1)
+        || count != hostset_count(set2))
+        ok = 0;
+
+    hostset_destroy(set1);
+    hostset_destroy(set2);
+
+    printf("hostset_append: same as hostset_insert: %s\n", ok ? "ok" : "FAILED");
+    return ok;
+}
+
+/* check that deletions which leave joinable ranges trigger compaction
+ * at the configured ratio only, that compaction keeps the hosts and
+ * their order, and that iterators keep their place across it
+ */
+int compact_test(void)
+{
+    hostlist_t hl1 = hostlist_new();
+    hostlist_t hl2;
+    hostlist_iterator_t i1, i2;
+    char name[64], buf1[102400], buf2[102400];
+    char *host1, *host2;
+    int j, ok = 1;
+
+    /* "n0,x0,n1,x1,...", whose n ranges join once the x hosts go */
+    for (j = 0; j < 200; j++) {
+        snprintf(name, sizeof(name), "n%d", j);
+        hostlist_push_host(hl1, name);
+        snprintf(name, sizeof(name), "x%d", j);
+        hostlist_push_host(hl1, name);
+    }
+    hostlist_set_compact_ratio(hl1, 0);
+    hl2 = hostlist_copy(hl1);
+    hostlist_set_compact_ratio(hl2, 2.0);
+
+    /* delete the x hosts from both lists a few at a time, so that
+     * their iterators follow each batch, and check that the iterator
+     * of hl2 keeps step with that of hl1 across compaction */
+    i1 = hostlist_iterator_create(hl1);
+    i2 = hostlist_iterator_create(hl2);
+    for (j = 0; j < 2 * 150; j++) {
+        free(hostlist_next(i1));
+        free(hostlist_next(i2));
+    }
+    for (j = 0; j < 200; j += 8) {
+        snprintf(name, sizeof(name), "x[%d-%d]", j, j + 7);
+        hostlist_delete(hl1, name);
+        hostlist_delete(hl2, name);
+        host1 = hostlist_next(i1);
+        host2 = hostlist_next(i2);
+        if (!host1 || !host2 || strcmp(host1, host2) != 0)
+            ok = 0;
+        free(host1);
+        free(host2);
+    }
+    hostlist_iterator_destroy(i1);
+    hostlist_iterator_destroy(i2);
+
+    if (hostlist_ncompactions(hl1) != 0 || hostlist_nranges(hl1) != 200)
+        ok = 0;
+    if (hostlist_ncompactions(hl2) == 0 || hostlist_nranges(hl2) >= 200)
+        ok = 0;
+
+    hostlist_deranged_string(hl1, sizeof(buf1), buf1);
+    hostlist_deranged_string(hl2, sizeof(buf2), buf2);
+    if (strcmp(buf1, buf2) != 0 || hostlist_count(hl2) != 200)
+        ok = 0;
+
+    /* raising the ratio from 0 compacts the list right away */
+    hostlist_set_compact_ratio(hl1, 2.0);
+    if (hostlist_ncompactions(hl1) != 1 || hostlist_nranges(hl1) != 1)
+        ok = 0;
+
+    hostlist_destroy(hl1);
+    hostlist_destroy(hl2);
+
+    printf("compaction: %s\n", ok ? "ok" : "FAILED");
+    return ok;
+}
+
 /* test iterator functionality on the list of hosts represented
  * by list
  */
@@ -2665,11 +7583,23 @@ int main(int ac, char **av)
     hostset_t set, set1;
     hostlist_iterator_t iter, iter2;
 
+#if WITH_PTHREADS
+    if (ac > 1 && strcmp(av[1], "--threads") == 0) {
+        thread_scaling_test(ac > 2 ? atoi(av[2]) : 8, 20000);
+        return 0;
+    }
+    builder_test(4);
+    hash_partition_test(4);
+#endif
+
     if (!(hl1 = hostlist_create(ac > 1 ? av[1] : NULL)))
         perror("hostlist_create");
     if (!(set = hostset_create(ac > 1 ? av[1] : NULL)))
         perror("hostlist_create");
 
+    hostset_append_test();
+    compact_test();
+
     hl3 = hostlist_create("f[0-5]");
     hostlist_delete(hl3, "f[1-3]");
     hostlist_ranged_string(hl3, 102400, buf);
@@ -27,6 +27,8 @@
 #ifndef _HOSTLIST_H
 #define _HOSTLIST_H
 
+#include <stdio.h>
+#include <stdint.h>
 #include <unistd.h>
 
 /* Notes:
@@ -46,6 +48,9 @@
  * This macro may be redefined to invoke another routine instead.
  *
  * If WITH_PTHREADS is defined, these routines will be thread-safe.
+ * Routines which only read a hostlist may run concurrently with each
+ * other, and hostlist_count() does not block at all. A single iterator
+ * must still not be used by more than one thread at a time.
  *
  */
 
@@ -71,6 +76,21 @@ typedef struct hostset * hostset_t;
  */
 typedef struct hostlist_iterator * hostlist_iterator_t;
 
+/* The hostlist builder type, used to collect hosts from many threads
+ * into a single hostlist.
+ */
+typedef struct hostlist_builder * hostlist_builder_t;
+
+/* A hostlist database: named hostlists in a read-only image which is
+ * used in place, typically mapped from a file.
+ */
+typedef struct hostlist_db * hostlist_db_t;
+
+/* A k-ary fanout tree over the hosts of a hostlist, for distributing
+ * work hierarchically.
+ */
+typedef struct hostlist_tree * hostlist_tree_t;
+
 /* ----[ hostlist_t functions: ]---- */
 
 /* ----[ hostlist creation and destruction ]---- */
@@ -116,6 +136,24 @@ hostlist_t hostlist_copy(const hostlist_t hl);
  */
 void hostlist_destroy(hostlist_t hl);
 
+/* hostlist_freeze():
+ *
+ * Return an immutable snapshot of hostlist hl. The snapshot is stored
+ * compactly, with adjacent ranges joined where possible, and indexes
+ * for hostlist_nth() and hostlist_find() are built up front.
+ *
+ * A frozen hostlist is read without locking, so any number of threads
+ * may use it concurrently. Functions which would modify it fail with
+ * errno set to EPERM. Use hostlist_copy() to get a modifiable copy.
+ *
+ * Frozen hostlists are reference counted: freezing a frozen hostlist
+ * returns the same list with another reference, and hostlist_destroy()
+ * drops a reference. Iterators also hold a reference to the list.
+ *
+ * Returns NULL if memory could not be allocated.
+ */
+hostlist_t hostlist_freeze(hostlist_t hl);
+
 
 /* ----[ hostlist list operations ]---- */
 
@@ -239,6 +277,78 @@ int hostlist_delete_host(hostlist_t hl, const char *hostname);
 int hostlist_delete_nth(hostlist_t hl, int n);
 
 
+/* hostlist_slice():
+ *
+ * Return a new hostlist holding the hosts at positions start up to,
+ * but not including, end of hostlist hl. Positions outside of hl are
+ * ignored, so the result may be empty. Only the ranges at either end
+ * of the slice are cut, and no hostnames are formatted.
+ *
+ * Returns NULL if memory could not be allocated.
+ */
+hostlist_t hostlist_slice(hostlist_t hl, int start, int end);
+
+
+/* hostlist_truncate():
+ *
+ * As hostlist_slice(), but keep the hosts at positions start up to
+ * end of hl in place, deleting all others.
+ *
+ * Returns the number of hosts deleted.
+ */
+int hostlist_truncate(hostlist_t hl, int start, int end);
+
+
+/* hostlist_partition():
+ *
+ * Split hostlist hl into k new hostlists of consecutive hosts, whose
+ * sizes differ by at most one (the first parts being the larger).
+ * Ranges are cut by counting alone, taking time proportional to the
+ * number of ranges of hl plus k.
+ *
+ * Returns a malloc'd array of k hostlists, or NULL with errno set.
+ * The caller destroys each hostlist and frees the array.
+ */
+hostlist_t *hostlist_partition(hostlist_t hl, int k);
+
+
+/* hostlist_chunks():
+ *
+ * As hostlist_partition(), but split hl into parts of `size' hosts,
+ * the last part holding any hosts left over. The number of parts is
+ * stored in *np.
+ */
+hostlist_t *hostlist_chunks(hostlist_t hl, int size, int *np);
+
+
+/* hostlist_hash_partition():
+ *
+ * Split hostlist hl into nshards new hostlists by a consistent hash
+ * of each host, so that a host is always placed on the same shard for
+ * a given nshards and seed, and adding a shard moves only about
+ * 1/nshards of the hosts (all of them onto the new shard). Hosts keep
+ * their hostlist order within each shard.
+ *
+ * Hosts are hashed from their prefix and number without formatting
+ * any hostnames, and large lists are hashed by several threads (see
+ * hostlist_set_threads()).
+ *
+ * Returns a malloc'd array of nshards hostlists, or NULL with errno
+ * set. The caller destroys each hostlist and frees the array.
+ */
+hostlist_t *hostlist_hash_partition(hostlist_t hl, int nshards,
+                                    unsigned long seed);
+
+
+/* hostlist_hash_shard():
+ *
+ * Return the shard (0 <= shard < nshards) that hostlist_hash_partition()
+ * places hostname on, or -1 with errno set on error.
+ */
+int hostlist_hash_shard(const char *hostname, int nshards,
+                        unsigned long seed);
+
+
 /* hostlist_count():
  *
  * Return the number of hosts in hostlist hl.
@@ -264,6 +374,153 @@ void hostlist_sort(hostlist_t hl);
  */
 void hostlist_uniq(hostlist_t hl);
 
+/* hostlist_sort_mt():
+ * hostlist_uniq_mt():
+ *
+ * As hostlist_sort() and hostlist_uniq(), but split the work between
+ * threads if hl is large and WITH_PTHREADS is defined (see
+ * hostlist_set_threads()). The result is the same as that of the
+ * single threaded versions.
+ */
+void hostlist_sort_mt(hostlist_t hl);
+void hostlist_uniq_mt(hostlist_t hl);
+
+/* hostlist_set_compact_ratio():
+ *
+ * Deleting or inserting hosts can leave neighbouring ranges which
+ * could be joined, e.g. "foo[1-2],bar3,foo[3-4]" after bar3 is
+ * deleted. hl is compacted, joining such ranges without changing
+ * the order of hosts, once its number of ranges is at least ratio
+ * times the number it would have after compaction (and at least 64
+ * ranges could be joined). The default ratio is 2, and copies made
+ * with hostlist_copy() inherit the ratio of hl. A ratio of 0
+ * disables automatic compaction.
+ */
+void hostlist_set_compact_ratio(hostlist_t hl, double ratio);
+
+/* hostlist_ncompactions():
+ *
+ * Return the number of times hl was compacted automatically.
+ */
+unsigned long hostlist_ncompactions(hostlist_t hl);
+
+
+/* ----[ hostlist set operations ]---- */
+
+/* hostlist_intersect():
+ *
+ * Return a new hostlist of the hosts which are in both h1 and h2,
+ * sorted and without duplicates.
+ *
+ * These set operations work on whole ranges of hosts at a time, with
+ * ranges grouped by hostname prefix, so their cost depends on the
+ * number of ranges rather than the number of hosts. Large lists are
+ * split between threads if WITH_PTHREADS is defined (see
+ * hostlist_set_threads()).
+ *
+ * Returns NULL with errno set on failure.
+ */
+hostlist_t hostlist_intersect(hostlist_t h1, hostlist_t h2);
+
+/* hostlist_xor():
+ *
+ * Return a new hostlist of the hosts which are in exactly one of h1
+ * and h2, sorted and without duplicates.
+ */
+hostlist_t hostlist_xor(hostlist_t h1, hostlist_t h2);
+
+/* hostlist_difference():
+ *
+ * Return a new hostlist of the hosts in h1 which are not in h2. Unlike
+ * the other set operations, the order of h1 and any duplicate hosts in
+ * it are kept.
+ */
+hostlist_t hostlist_difference(hostlist_t h1, hostlist_t h2);
+
+/* hostlist_union():
+ *
+ * Return a new hostlist of the hosts which are in h1 or h2, sorted
+ * and without duplicates.
+ */
+hostlist_t hostlist_union(hostlist_t h1, hostlist_t h2);
+
+/* hostlist_intersect_update():
+ * hostlist_xor_update():
+ * hostlist_difference_update():
+ * hostlist_union_update():
+ *
+ * As hostlist_intersect(), hostlist_xor(), hostlist_difference() and
+ * hostlist_union(), but replace the hosts of h1 with the result
+ * instead of creating a new hostlist. The result is still built as a
+ * new set of ranges, which replaces those of h1: only the range array
+ * of h1 is reused, where it is large enough. Iterators over h1 are
+ * reset.
+ *
+ * Returns 1 on success, or 0 with errno set on failure (EPERM if h1
+ * is frozen).
+ */
+int hostlist_intersect_update(hostlist_t h1, hostlist_t h2);
+int hostlist_xor_update(hostlist_t h1, hostlist_t h2);
+int hostlist_difference_update(hostlist_t h1, hostlist_t h2);
+int hostlist_union_update(hostlist_t h1, hostlist_t h2);
+
+/* hostlist_set_threads():
+ *
+ * Set the maximum number of threads used by a single hostlist
+ * operation which can run in parallel. 0, the default, uses the number
+ * of online processors, and 1 disables threading. Has no effect
+ * unless WITH_PTHREADS is defined.
+ */
+void hostlist_set_threads(int n);
+
+
+/* ----[ hostlist builder functions ]---- */
+
+/* hostlist_builder_create():
+ *
+ * Create a builder for collecting hosts pushed by any number of
+ * threads. Each thread pushes onto a buffer of its own, so pushes do
+ * not lock or wait for each other.
+ *
+ * Returns NULL with errno set on failure.
+ */
+hostlist_builder_t hostlist_builder_create(void);
+
+/* hostlist_builder_push_host():
+ *
+ * Push the single hostname host onto builder b.
+ *
+ * Returns 1 if successful, 0 if out of memory.
+ */
+int hostlist_builder_push_host(hostlist_builder_t b, const char *host);
+
+/* hostlist_builder_push_num():
+ *
+ * Push the host named prefix followed by n, zero padded to width
+ * digits, onto builder b.
+ *
+ * Returns 1 if successful, or 0 with errno set to EINVAL if n is too
+ * large for a hostname suffix, or ENOMEM.
+ */
+int hostlist_builder_push_num(hostlist_builder_t b, const char *prefix,
+                              unsigned long n, int width);
+
+/* hostlist_builder_finish():
+ *
+ * Return a hostlist of the hosts pushed onto b, sorted and without
+ * duplicates (see hostlist_uniq_mt()), and destroy b. No thread may
+ * push onto b once this is called.
+ *
+ * Returns NULL if out of memory.
+ */
+hostlist_t hostlist_builder_finish(hostlist_builder_t b);
+
+/* hostlist_builder_destroy():
+ *
+ * Destroy builder b and the hosts pushed onto it.
+ */
+void hostlist_builder_destroy(hostlist_builder_t b);
+
 
 /* ----[ hostlist print functions ]---- */
 
@@ -293,6 +550,225 @@ ssize_t hostset_ranged_string(hostset_t hs, size_t n, char *buf);
 ssize_t hostlist_deranged_string(hostlist_t hl, size_t n, char *buf);
 ssize_t hostset_deranged_string(hostset_t hs, size_t n, char *buf);
 
+/* hostlist_write():
+ *
+ * Write the string representation of the hostlist hl to the file
+ * descriptor fd. Output is formatted into a fixed size staging buffer
+ * which is flushed as it fills, so memory use does not depend on the
+ * size of the hostlist.
+ *
+ * If mode is HOSTLIST_WRITE_RANGED, a bracketed hostlist representation
+ * is written (as in hostlist_ranged_string()), and the delimiter is used
+ * between bracketed lists. If mode is HOSTLIST_WRITE_EXPANDED, every
+ * hostname is written explicitly, separated by the delimiter (as in
+ * hostlist_deranged_string()). A NULL delimiter is equivalent to ",".
+ *
+ * No trailing newline or NUL terminator is written.
+ *
+ * Returns the number of bytes written, or -1 on error with errno set.
+ */
+#define HOSTLIST_WRITE_RANGED    0
+#define HOSTLIST_WRITE_EXPANDED  1
+
+ssize_t hostlist_write(hostlist_t hl, int fd, int mode, const char *delim);
+
+/* hostlist_fwrite():
+ *
+ * Same as hostlist_write(), but write to the stdio stream fp.
+ */
+ssize_t hostlist_fwrite(hostlist_t hl, FILE *fp, int mode, const char *delim);
+
+
+/* ----[ hostlist serialization ]---- */
+
+/* hostlist_dump():
+ *
+ * Encode hostlist hl in a compact, versioned binary format: each
+ * distinct hostname prefix is stored once, followed by the ranges of
+ * hl as delta encoded varints. The ranges and their order are kept
+ * exactly, so hostlist_load() returns an identical list.
+ *
+ * Returns a buffer which must be freed by the caller, and stores its
+ * length in *lenp. Returns NULL with errno set on failure.
+ */
+void * hostlist_dump(hostlist_t hl, size_t *lenp);
+
+/* hostlist_load():
+ *
+ * Create a hostlist from len bytes of data written by hostlist_dump().
+ * No hostnames are parsed, and the cost is proportional to the
+ * number of ranges.
+ *
+ * Returns NULL with errno set to EINVAL if data is not a valid dump,
+ * including one holding numeric suffixes larger than hostlist_create()
+ * accepts, or ENOMEM if memory could not be allocated.
+ */
+hostlist_t hostlist_load(const void *data, size_t len);
+
+
+/* ----[ hostlist database functions ]---- */
+
+/* hostlist_db_build():
+ *
+ * Build a hostlist database image holding the n hostlists lists[],
+ * named by the distinct strings names[]. The image holds a table of
+ * prefixes, and for each list its ranges and the running count of
+ * hosts, in a form that is used in place once opened. Integers are
+ * stored in host byte order.
+ *
+ * Returns the image, which must be freed by the caller, and stores
+ * its length in *lenp. Returns NULL with errno set on failure.
+ */
+void * hostlist_db_build(int n, const char **names, hostlist_t *lists,
+                         size_t *lenp);
+
+/* hostlist_db_write():
+ *
+ * Build a database image as hostlist_db_build() and write it to path.
+ * The image is written to a new temporary file next to path, flushed
+ * to disk and renamed over path, so processes which have the old
+ * database open are not disturbed and a crash leaves either the old
+ * or the new database. The file is created with mode 0644.
+ *
+ * Returns 0 on success, or -1 with errno set.
+ */
+int hostlist_db_write(const char *path, int n, const char **names,
+                      hostlist_t *lists);
+
+/* hostlist_db_open():
+ *
+ * Open the database written to path by hostlist_db_write(). The file
+ * is mapped shared and read-only, so every process using it shares
+ * the same pages, and nothing is read or parsed beyond its header:
+ * the cost does not depend on the size of the database.
+ *
+ * Returns NULL with errno set on failure.
+ */
+hostlist_db_t hostlist_db_open(const char *path);
+
+/* hostlist_db_open_image():
+ *
+ * Open a database image already in memory, e.g. copied into a shared
+ * memory segment. image must be 8 byte aligned, and must stay valid
+ * and unchanged until the database and all lists taken from it are
+ * destroyed.
+ *
+ * Returns NULL with errno set to EINVAL if image is not valid.
+ */
+hostlist_db_t hostlist_db_open_image(const void *image, size_t len);
+
+/* hostlist_db_close():
+ *
+ * Close database db. Hostlists taken from db hold a reference to it,
+ * and the image is unmapped once the last of them is destroyed.
+ */
+void hostlist_db_close(hostlist_db_t db);
+
+/* hostlist_db_get():
+ *
+ * Return the hostlist called name in db as a frozen hostlist (see
+ * hostlist_freeze()). Its prefixes and host counts are used in place
+ * in the image, and only its ranges are built, without parsing any
+ * hostnames. The result must be destroyed with hostlist_destroy().
+ *
+ * Returns NULL with errno set to ENOENT if there is no such list, or
+ * EINVAL if the image is damaged.
+ */
+hostlist_t hostlist_db_get(hostlist_db_t db, const char *name);
+
+/* hostlist_db_count():
+ *
+ * Return the number of hosts in the list called name in db without
+ * creating it, or -1 with errno set as for hostlist_db_get().
+ */
+int hostlist_db_count(hostlist_db_t db, const char *name);
+
+/* hostlist_db_ngroups():
+ * hostlist_db_name():
+ *
+ * Return the number of lists in db, and the name of the nth list
+ * (0 <= n < hostlist_db_ngroups()). Lists are ordered by name.
+ * hostlist_db_name() returns NULL with errno set to EINVAL if n is
+ * out of range.
+ */
+int hostlist_db_ngroups(hostlist_db_t db);
+const char * hostlist_db_name(hostlist_db_t db, int n);
+
+
+/* ----[ hostlist fanout trees ]---- */
+
+/* hostlist_fanout_tree():
+ *
+ * Create a k-ary spanning tree over the hosts of hl, in which each
+ * host forwards to up to k children. Hosts are placed breadth first in
+ * hostlist order: the host at position 0 is the root, and the children
+ * of position i are positions k*i + 1 through k*i + k. The tree holds
+ * a frozen snapshot of hl, so later changes to hl do not affect it,
+ * and it may be queried from many threads at once.
+ *
+ * Queries below work out positions arithmetically, and cost
+ * O(depth) hostlist slices at most, however large the tree.
+ *
+ * Returns NULL with errno set to EINVAL if k < 1, or ENOMEM.
+ */
+hostlist_tree_t hostlist_fanout_tree(hostlist_t hl, int k);
+
+/* hostlist_tree_destroy(): Free a tree and its snapshot of the hosts. */
+void hostlist_tree_destroy(hostlist_tree_t t);
+
+/* hostlist_tree_count():
+ * hostlist_tree_depth():
+ *
+ * Return the number of hosts, and the number of levels, in tree t.
+ */
+int hostlist_tree_count(hostlist_tree_t t);
+int hostlist_tree_depth(hostlist_tree_t t);
+
+/* hostlist_tree_find():
+ * hostlist_tree_host():
+ *
+ * Convert between hostnames and their positions in tree t, as
+ * hostlist_find() and hostlist_nth().
+ */
+int hostlist_tree_find(hostlist_tree_t t, const char *hostname);
+char * hostlist_tree_host(hostlist_tree_t t, int pos);
+
+/* hostlist_tree_parent():
+ *
+ * Return the position of the parent of the host at position pos, or
+ * -1 for the root (errno is then unchanged) or if pos is out of range
+ * (errno set to EINVAL).
+ */
+int hostlist_tree_parent(hostlist_tree_t t, int pos);
+
+/* hostlist_tree_children():
+ * hostlist_tree_subtree():
+ *
+ * Return a new hostlist of the children of the host at position pos,
+ * or of all hosts in the subtree rooted at pos (including that host),
+ * in position order. Returns NULL with errno set on error.
+ */
+hostlist_t hostlist_tree_children(hostlist_tree_t t, int pos);
+hostlist_t hostlist_tree_subtree(hostlist_tree_t t, int pos);
+
+/* hostlist_tree_level():
+ *
+ * Return a new hostlist of the hosts at depth level of tree t, the
+ * root being at level 0. Returns NULL with errno set to EINVAL if
+ * level is not below hostlist_tree_depth().
+ */
+hostlist_t hostlist_tree_level(hostlist_tree_t t, int level);
+
+/* hostlist_tree_levels():
+ *
+ * Return a malloc'd array of hostlist_tree_depth() new hostlists, the
+ * hosts at each level of tree t from the root down, as
+ * hostlist_tree_level() gives them, in a single pass over the levels.
+ * The caller destroys each hostlist and frees the array. Returns NULL
+ * with errno set on error.
+ */
+hostlist_t *hostlist_tree_levels(hostlist_tree_t t);
+
 
 /* ----[ hostlist utility functions ]---- */
 
@@ -303,6 +779,34 @@ ssize_t hostset_deranged_string(hostset_t hs, size_t n, char *buf);
  */
 int hostlist_nranges(hostlist_t hl);
 
+/* hostlist_memsize():
+ *
+ * Return the approximate number of bytes of memory held by hostlist
+ * hl. Ranges which hl shares with a copy (see hostlist_copy()) or
+ * with a database image (see hostlist_db_get()) are not included.
+ * Prefix lengths are estimated from a sample of at most 16 ranges,
+ * so the cost does not depend on the size of hl.
+ */
+size_t hostlist_memsize(hostlist_t hl);
+
+/* hostlist_get_range():
+ *
+ * Fetch the components of the nth range (0 <= n < hostlist_nranges())
+ * of hostlist hl without formatting any hostnames. The range covers
+ * hosts prefix<lo> through prefix<hi>, with the numeric suffix zero
+ * padded to width digits. For a range holding a single host without a
+ * numeric suffix, prefix is the full hostname, lo and hi are 0, and
+ * width is set to -1. Any of the output pointers may be NULL.
+ *
+ * The returned prefix points into the hostlist itself and is only
+ * valid until hl is next modified or destroyed.
+ *
+ * Returns 0 on success, or -1 with errno set to EINVAL if n is out
+ * of range.
+ */
+int hostlist_get_range(hostlist_t hl, int n, const char **prefix,
+                       unsigned long *lo, unsigned long *hi, int *width);
+
 
 /* ----[ hostlist iterator functions ]---- */
 
@@ -310,6 +814,11 @@ int hostlist_nranges(hostlist_t hl);
  *
  * Creates and returns a hostlist iterator used for non destructive
  * access to a hostlist or hostset. Returns NULL on failure.
+ *
+ * The hostlist may be modified while iterators exist. An iterator
+ * keeps its place across hosts inserted or deleted before it, and
+ * is reset to the beginning of the list by hostlist_sort() and
+ * hostlist_uniq().
  */
 hostlist_iterator_t hostlist_iterator_create(hostlist_t hl);
 
@@ -332,6 +841,33 @@ void hostlist_iterator_destroy(hostlist_iterator_t i);
  */
 void hostlist_iterator_reset(hostlist_iterator_t i);
 
+/* hostlist_iterator_seek():
+ *
+ * Position iterator i so that the next call to hostlist_next() returns
+ * the host at position n (0 <= n <= hostlist_count()), and the next
+ * call to hostlist_prev() returns the host at position n - 1. The range
+ * holding host n is found with a binary search, so seeking does not
+ * depend on the distance moved.
+ *
+ * Returns 0 on success, or -1 with errno set to EINVAL if n is out of
+ * range.
+ */
+int hostlist_iterator_seek(hostlist_iterator_t i, int n);
+
+/* hostlist_iterator_seek_host():
+ *
+ * Position iterator i so that the next call to hostlist_next() returns
+ * the first occurrence of hostname in its hostlist. The host is looked
+ * up as in hostlist_find(): with a binary search in the find index of a
+ * frozen hostlist (see hostlist_freeze()), and by scanning the ranges
+ * of any other hostlist, so seeking by name in a modifiable list is
+ * linear in its number of ranges.
+ *
+ * Returns the position of hostname, or -1 if it was not found, in
+ * which case the iterator is not moved.
+ */
+int hostlist_iterator_seek_host(hostlist_iterator_t i, const char *hostname);
+
 /* hostlist_next():
  *
  * Returns a pointer to the  next hostname on the hostlist
@@ -341,6 +877,46 @@ void hostlist_iterator_reset(hostlist_iterator_t i);
  */
 char * hostlist_next(hostlist_iterator_t i);
 
+/* hostlist_next_r():
+ *
+ * Reentrant, non-allocating version of hostlist_next(). Copies the next
+ * hostname into the caller supplied buffer buf of size len, including
+ * the terminating NUL.
+ *
+ * Returns the length of the hostname (excluding NUL), or 0 at the end
+ * of the list. If buf is too small to hold the next hostname, -1 is
+ * returned with errno set to ERANGE and the iterator is not advanced.
+ */
+int hostlist_next_r(hostlist_iterator_t i, char *buf, size_t len);
+
+/* hostlist_prev():
+ *
+ * Step iterator i backwards and return the host before its current
+ * position, or NULL if i is at the beginning of the list. Calling
+ * hostlist_next() then hostlist_prev() returns the same host twice.
+ *
+ * The caller is responsible for freeing the returned memory.
+ */
+char * hostlist_prev(hostlist_iterator_t i);
+
+/* hostlist_next_batch():
+ *
+ * Copy up to max of the next hostnames from iterator i into the buffer
+ * arena of size len. Each hostname is NUL terminated, and its offset in
+ * arena is stored in offsets[], which must have room for max + 1
+ * entries. On return, offsets[n] is the total number of bytes used in
+ * arena, so the length of hostname k is offsets[k+1] - offsets[k] - 1.
+ *
+ * Returns the number of hostnames n copied into arena (as many as fit),
+ * or 0 at the end of the list. If arena is too small to hold even the
+ * next hostname, -1 is returned with errno set to ERANGE and the
+ * iterator is not advanced. If memory runs out, the hosts copied so far
+ * are returned and the iterator is left on the next host, so that the
+ * following call returns -1 with errno set to ENOMEM.
+ */
+int hostlist_next_batch(hostlist_iterator_t i, char *arena, size_t len,
+                        uint32_t *offsets, int max);
+
 
 /* hostlist_next_range():
  *
@@ -354,7 +930,7 @@ char * hostlist_next_range(hostlist_iterator_t i);
 
 
 /* hostlist_remove():
- * Removes the last host returned by hostlist iterator i
+ * Removes the last host returned by hostlist_next() on iterator i
  *
  * Returns 1 for success, 0 for failure.
  */
@@ -388,6 +964,22 @@ void hostset_destroy(hostset_t set);
  */
 int hostset_insert(hostset_t set, const char *hosts);
 
+/* hostset_append():
+ * Add a host or list of hosts to hostset "set" without placing them
+ * in order right away. Appended hosts are kept in a log, which is
+ * sorted and merged into the set once it grows as long as the set.
+ * hostset_count() and hostset_within() look through the log without
+ * merging it (unless a prefix appears with more than one zero padding
+ * width, when hostset_count() merges it first); the other hostset
+ * functions merge it before they run, so appended hosts are seen by
+ * all of them. This is much faster than hostset_insert() for hosts
+ * which arrive in random order. As with hostlist_uniq(), a merge
+ * resets iterators on the set.
+ *
+ * Returns the number of hosts appended, including duplicates.
+ */
+int hostset_append(hostset_t set, const char *hosts);
+
 /* hostset_delete():
  * Delete a host or list of hosts from hostset "set."
  * Returns number of hosts deleted from set.
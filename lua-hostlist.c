@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 
 #include <lua.h>
 #include <lualib.h>
@@ -45,16 +46,60 @@
 static hostlist_t lua_tohostlist (lua_State *L, int index)
 {
     hostlist_t *hptr = luaL_checkudata (L, index, "Hostlist");
+    if (*hptr == NULL)
+        luaL_error (L, "attempt to use a freed hostlist");
     return (*hptr);
 }
 
+/*
+ *  Return true if the hostlist userdata at index was released with
+ *   hl:free(), e.g. by a Lua function called on its hosts.
+ */
+static int lua_hostlist_freed (lua_State *L, int index)
+{
+    hostlist_t *hptr = luaL_checkudata (L, index, "Hostlist");
+    return (*hptr == NULL);
+}
+
+/*
+ *  The Lua collector does not see the memory held by C hostlists, so
+ *   advance it as if n bytes had been allocated from Lua. This paces
+ *   collection of hostlists by their real size. Bytes are collected
+ *   in a per-state count until they make up whole kilobytes, the unit
+ *   of a collector step, so small lists are not charged a kilobyte
+ *   each.
+ */
+static void lua_hostlist_gc_step (lua_State *L, size_t n)
+{
+    size_t *debt;
+
+    lua_getfield (L, LUA_REGISTRYINDEX, "Hostlist.gcdebt");
+    debt = lua_touserdata (L, -1);
+    lua_pop (L, 1);
+    if (debt == NULL) {
+        debt = lua_newuserdata (L, sizeof (*debt));
+        *debt = 0;
+        lua_setfield (L, LUA_REGISTRYINDEX, "Hostlist.gcdebt");
+    }
+
+    *debt += n;
+    if (*debt >= 1024) {
+        n = *debt / 1024;
+        *debt %= 1024;
+        lua_gc (L, LUA_GCSTEP, (int) n);
+    }
+}
+
 /*
  *  Push hostlist hl as userdata onto the Lua stack with its metatable set.
  */
 static int push_hostlist_userdata (lua_State *L, hostlist_t hl)
 {
-    hostlist_t *hlp = lua_newuserdata (L, sizeof (*hlp));
+    hostlist_t *hlp;
 
+    lua_hostlist_gc_step (L, hostlist_memsize (hl));
+
+    hlp = lua_newuserdata (L, sizeof (*hlp));
     *hlp = hl;
     luaL_getmetatable (L, "Hostlist");
     lua_setmetatable (L, -2);
@@ -84,10 +129,213 @@ static hostlist_t lua_hostlist_create (lua_State *L, const char *s)
     return (lua_tohostlist (L, -1));
 }
 
+/*
+ *  Cache of hostlists parsed from Lua strings, so that a string passed
+ *   again and again as a hostlist argument is parsed only once. The
+ *   cache lives in the registry and holds frozen hostlists. Callers get
+ *   a copy, which shares the ranges of the cached list until it is
+ *   modified. Once `max' entries are cached the least recently used
+ *   entry is dropped.
+ */
+#define HOSTLIST_CACHE_SIZE 128
+
+struct cache_entry {
+    struct cache_entry *prev, *next;    /* LRU list, most recent first */
+    struct cache_entry *chain;          /* hash bucket chain           */
+    unsigned long hash;
+    size_t len;
+    char *s;
+    hostlist_t hl;
+};
+
+struct hostlist_cache {
+    struct cache_entry **buckets;
+    unsigned long nbuckets;             /* power of two                */
+    struct cache_entry *head, *tail;
+    int n;
+    int max;
+    unsigned long hits, misses;
+};
+
+static unsigned long cache_hash (const char *s, size_t len)
+{
+    unsigned long h = 2166136261UL;
+    while (len--)
+        h = (h ^ (unsigned char) *s++) * 16777619UL;
+    return (h);
+}
+
+static void cache_unlink (struct hostlist_cache *c, struct cache_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        c->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        c->tail = e->prev;
+}
+
+static void cache_link (struct hostlist_cache *c, struct cache_entry *e)
+{
+    e->prev = NULL;
+    e->next = c->head;
+    if (c->head)
+        c->head->prev = e;
+    else
+        c->tail = e;
+    c->head = e;
+}
+
+static void cache_drop (struct hostlist_cache *c, struct cache_entry *e)
+{
+    struct cache_entry **pp = &c->buckets[e->hash & (c->nbuckets - 1)];
+
+    while (*pp != e)
+        pp = &(*pp)->chain;
+    *pp = e->chain;
+    cache_unlink (c, e);
+    c->n--;
+
+    hostlist_destroy (e->hl);
+    free (e->s);
+    free (e);
+}
+
+/*
+ *  Set the number of entries kept in cache c, dropping the least
+ *   recently used entries if there are too many. Returns -1 if memory
+ *   for the hash table could not be allocated.
+ */
+static int cache_resize (struct hostlist_cache *c, int max)
+{
+    struct cache_entry **b, *e;
+    unsigned long n = 16;
+
+    while (c->n > max)
+        cache_drop (c, c->tail);
+    while (n < (unsigned long) max)
+        n <<= 1;
+    if (n == c->nbuckets)
+        goto out;
+
+    if (!(b = calloc (n, sizeof (*b))))
+        return (-1);
+    for (e = c->head; e; e = e->next) {
+        e->chain = b[e->hash & (n - 1)];
+        b[e->hash & (n - 1)] = e;
+    }
+    free (c->buckets);
+    c->buckets = b;
+    c->nbuckets = n;
+out:
+    c->max = max;
+    return (0);
+}
+
+static int l_hostlist_cache_destroy (lua_State *L)
+{
+    struct hostlist_cache *c = lua_touserdata (L, 1);
+    while (c->head)
+        cache_drop (c, c->head);
+    free (c->buckets);
+    c->buckets = NULL;
+    return (0);
+}
+
+/*
+ *  Return the hostlist cache of this Lua state, creating it on first use
+ */
+static struct hostlist_cache *lua_hostlist_cache (lua_State *L)
+{
+    struct hostlist_cache *c;
+
+    lua_getfield (L, LUA_REGISTRYINDEX, "HostlistCache.state");
+    c = lua_touserdata (L, -1);
+    lua_pop (L, 1);
+    if (c != NULL)
+        return (c);
+
+    c = lua_newuserdata (L, sizeof (*c));
+    memset (c, 0, sizeof (*c));
+    luaL_getmetatable (L, "HostlistCache");
+    lua_setmetatable (L, -2);
+    lua_setfield (L, LUA_REGISTRYINDEX, "HostlistCache.state");
+
+    if (cache_resize (c, HOSTLIST_CACHE_SIZE) < 0)
+        luaL_error (L, "Unable to create hostlist cache");
+    return (c);
+}
+
+/*
+ *  Push a hostlist for string s onto the Lua stack, taking it from
+ *   the cache if s was parsed before, and return it.
+ */
+static hostlist_t lua_hostlist_create_cached (lua_State *L, const char *s,
+                                              size_t len)
+{
+    struct hostlist_cache *c = lua_hostlist_cache (L);
+    struct cache_entry *e;
+    unsigned long hash;
+    hostlist_t hl, frozen;
+
+    if (c->max == 0)
+        return lua_hostlist_create (L, s);
+
+    hash = cache_hash (s, len);
+    for (e = c->buckets[hash & (c->nbuckets - 1)]; e; e = e->chain) {
+        if (e->hash == hash && e->len == len && memcmp (e->s, s, len) == 0)
+            break;
+    }
+
+    if (e != NULL) {
+        c->hits++;
+        cache_unlink (c, e);
+        cache_link (c, e);
+    }
+    else {
+        c->misses++;
+        if (!(hl = hostlist_create (s)))
+            luaL_error (L, "Unable to create hostlist");
+        frozen = hostlist_freeze (hl);
+        hostlist_destroy (hl);
+        if (frozen == NULL)
+            luaL_error (L, "Unable to create hostlist");
+
+        if (!(e = malloc (sizeof (*e))) || !(e->s = malloc (len + 1))) {
+            /*
+             *  Not cached, just return a copy of this list
+             */
+            free (e);
+            hl = hostlist_copy (frozen);
+            hostlist_destroy (frozen);
+            if (hl == NULL)
+                luaL_error (L, "Unable to create hostlist");
+            push_hostlist_userdata (L, hl);
+            return (hl);
+        }
+        memcpy (e->s, s, len + 1);
+        e->len = len;
+        e->hash = hash;
+        e->hl = frozen;
+        e->chain = c->buckets[hash & (c->nbuckets - 1)];
+        c->buckets[hash & (c->nbuckets - 1)] = e;
+        cache_link (c, e);
+        if (++c->n > c->max)
+            cache_drop (c, c->tail);
+    }
+
+    if (!(hl = hostlist_copy (e->hl)))
+        luaL_error (L, "Unable to create hostlist");
+    push_hostlist_userdata (L, hl);
+    return (hl);
+}
+
 /*
  *  Replace a string at index in the Lua stack with a hostlist
  *   If index is already a hostlist, just return a reference to
- *   that object.
+ *   that object. Strings are looked up in the hostlist cache first.
  *
  *  Note that the caller does not need to free the returned hostlist.
  *   The Lua garbage collector will handle this.
@@ -95,6 +343,7 @@ static hostlist_t lua_hostlist_create (lua_State *L, const char *s)
 static hostlist_t lua_string_to_hostlist (lua_State *L, int index)
 {
     const char *s;
+    size_t len;
     hostlist_t hl;
 
     if (lua_isuserdata (L, index))
@@ -103,8 +352,8 @@ static hostlist_t lua_string_to_hostlist (lua_State *L, int index)
     /*
      *  Create a new hostlist on top of stack
      */
-    s = luaL_checkstring (L, index);
-    hl = lua_hostlist_create (L, s);
+    s = luaL_checklstring (L, index, &len);
+    hl = lua_hostlist_create_cached (L, s, len);
 
     /*
      *  Replace the string at index with this hostlist
@@ -113,6 +362,101 @@ static hostlist_t lua_string_to_hostlist (lua_State *L, int index)
     return (hl);
 }
 
+/*
+ *  Return the stdio stream for the Lua file handle at index in the
+ *   Lua stack, or raise an error.
+ */
+static FILE *lua_tofile (lua_State *L, int index)
+{
+#if !defined LUA_VERSION_NUM || LUA_VERSION_NUM==501
+    FILE **fp = luaL_checkudata (L, index, LUA_FILEHANDLE);
+    if (*fp == NULL)
+        luaL_error (L, "attempt to use a closed file");
+    return (*fp);
+#else
+    luaL_Stream *p = luaL_checkudata (L, index, LUA_FILEHANDLE);
+    if (p->closef == NULL)
+        luaL_error (L, "attempt to use a closed file");
+    return (p->f);
+#endif
+}
+
+/*
+ *  Push the next host from iterator i onto the top of the Lua stack.
+ *   Returns 0 and pushes nothing at the end of the list.
+ */
+static int lua_push_next_host (lua_State *L, hostlist_iterator_t i)
+{
+    char buf [1024];
+    int n = hostlist_next_r (i, buf, sizeof (buf));
+
+    if (n < 0) {
+        /*
+         *  Hostname too large for local buffer, fall back to hostlist_next
+         */
+        char *host = hostlist_next (i);
+        if (host == NULL)
+            return luaL_error (L, "hostlist_next: %s", strerror (errno));
+        lua_pushstring (L, host);
+        free (host);
+        return (1);
+    }
+    if (n == 0)
+        return (0);
+
+    lua_pushlstring (L, buf, n);
+    return (1);
+}
+
+/*
+ *  Hosts read in bulk from a hostlist iterator with hostlist_next_batch()
+ */
+#define HOST_BATCH_MAX 256
+
+struct host_batch {
+    hostlist_iterator_t i;
+    int count;                              /* hosts in current batch    */
+    int next;                               /* index of next host        */
+    uint32_t offsets [HOST_BATCH_MAX + 1];
+    char arena [8192];
+};
+
+static void host_batch_init (struct host_batch *b, hostlist_iterator_t i)
+{
+    b->i = i;
+    b->count = 0;
+    b->next = 0;
+}
+
+/*
+ *  Push the next host from batch b onto the top of the Lua stack,
+ *   refilling the batch from its iterator when it is exhausted.
+ *   Returns 0 and pushes nothing at the end of the list.
+ */
+static int lua_push_batch_host (lua_State *L, struct host_batch *b)
+{
+    uint32_t *o;
+
+    if (b->next == b->count) {
+        b->next = 0;
+        b->count = hostlist_next_batch (b->i, b->arena, sizeof (b->arena),
+                                        b->offsets, HOST_BATCH_MAX);
+        if (b->count < 0) {
+            /*
+             *  Hostname too large for the batch, push it individually
+             */
+            b->count = 0;
+            return (lua_push_next_host (L, b->i));
+        }
+        if (b->count == 0)
+            return (0);
+    }
+
+    o = &b->offsets [b->next++];
+    lua_pushlstring (L, b->arena + o[0], o[1] - o[0] - 1);
+    return (1);
+}
+
 /*
  *  Wrapper for hostlist_delete() to remove up to [limit] occurrences
  *   (limit <= 0 implies unlimited) of hosts in hostlist [del] from
@@ -156,13 +500,15 @@ static int l_hostlist_new (lua_State *L)
 }
 
 /*
- *  This is the hostlist userdata garbage collector method:
+ *  This is the hostlist userdata garbage collector method. It is also
+ *   hl:free() and the __close method, which release the memory of hl
+ *   without waiting for the collector. hl may not be used afterwards.
  */
 static int l_hostlist_destroy (lua_State *L)
 {
-    hostlist_t hl = lua_tohostlist (L, 1);
-    lua_pop (L, 1);
-    hostlist_destroy (hl);
+    hostlist_t *hptr = luaL_checkudata (L, 1, "Hostlist");
+    hostlist_destroy (*hptr);
+    *hptr = NULL;
     return (0);
 }
 
@@ -228,17 +574,17 @@ static int l_hostlist_pop (lua_State *L)
     if (lua_isnumber (L, 2))
         n = lua_tonumber (L, 2);
 
-    /*
-     *  Create table on top of stack for results of pop
-     */
-    lua_newtable (L);
-    t = lua_gettop (L);
-
     if (n < 0) {
         shift = 1;
         n = abs(n);
     }
 
+    /*
+     *  Create table on top of stack for results of pop
+     */
+    lua_createtable (L, n < hostlist_count (hl) ? n : hostlist_count (hl), 0);
+    t = lua_gettop (L);
+
     for (i = 0; i < n; i++) {
         char *host;
         if (shift)
@@ -254,6 +600,137 @@ static int l_hostlist_pop (lua_State *L)
     return (1);
 }
 
+/*
+ *  Convert Lua positions i, j (1-based and inclusive, negative
+ *   positions counting from the end, as for string.sub) at stack
+ *   indexes i and i+1 into a range [*start, *end) of hostlist
+ *   positions. j defaults to -1, the last host.
+ */
+static void lua_hostlist_span (lua_State *L, int i, int count,
+                               int *start, int *end)
+{
+    lua_Number lo = luaL_checknumber (L, i);
+    lua_Number hi = luaL_optnumber (L, i+1, -1);
+
+    if (lo < 0)
+        lo += count + 1;
+    if (hi < 0)
+        hi += count + 1;
+    *start = lo < 1 ? 0 : lo > count ? count : (int) lo - 1;
+    *end = hi < 0 ? 0 : hi > count ? count : (int) hi;
+}
+
+/*
+ *  hl:slice (i, [j]): return a new hostlist of the hosts at positions
+ *   i through j of hl.
+ */
+static int l_hostlist_slice (lua_State *L)
+{
+    hostlist_t hl = lua_string_to_hostlist (L, 1);
+    hostlist_t r;
+    int start, end;
+
+    lua_hostlist_span (L, 2, hostlist_count (hl), &start, &end);
+    if (!(r = hostlist_slice (hl, start, end)))
+        return luaL_error (L, "Unable to create hostlist");
+    push_hostlist_userdata (L, r);
+    return (1);
+}
+
+/*
+ *  hl:truncate (i, [j]): delete all hosts of hl except those at
+ *   positions i through j. Returns hl.
+ */
+static int l_hostlist_truncate (lua_State *L)
+{
+    hostlist_t hl = lua_tohostlist (L, 1);
+    int start, end;
+
+    lua_hostlist_span (L, 2, hostlist_count (hl), &start, &end);
+    hostlist_truncate (hl, start, end);
+    lua_settop (L, 1);
+    return (1);
+}
+
+/*
+ *  Push a table of the n hostlists in array parts (as returned by
+ *   hostlist_partition()), which is freed.
+ */
+static int push_hostlist_array (lua_State *L, hostlist_t *parts, int n)
+{
+    int i;
+
+    if (parts == NULL)
+        return luaL_error (L, "Unable to split hostlist: %s",
+                           strerror (errno));
+
+    lua_createtable (L, n, 0);
+    for (i = 0; i < n; i++) {
+        push_hostlist_userdata (L, parts[i]);
+        lua_rawseti (L, -2, i+1);
+    }
+    free (parts);
+    return (1);
+}
+
+/*
+ *  hl:split (k): return a table of k hostlists of consecutive hosts
+ *   of hl, whose sizes differ by at most one.
+ */
+static int l_hostlist_split (lua_State *L)
+{
+    hostlist_t hl = lua_string_to_hostlist (L, 1);
+    int k = (int) luaL_checknumber (L, 2);
+
+    luaL_argcheck (L, k > 0, 2, "number of parts must be positive");
+    return push_hostlist_array (L, hostlist_partition (hl, k), k);
+}
+
+/*
+ *  hl:chunks (size): return a table of hostlists of `size' consecutive
+ *   hosts of hl, the last holding any hosts left over.
+ */
+static int l_hostlist_chunks (lua_State *L)
+{
+    hostlist_t hl = lua_string_to_hostlist (L, 1);
+    int size = (int) luaL_checknumber (L, 2);
+    hostlist_t *parts;
+    int n = 0;
+
+    luaL_argcheck (L, size > 0, 2, "chunk size must be positive");
+    parts = hostlist_chunks (hl, size, &n);
+    return push_hostlist_array (L, parts, n);
+}
+
+/*
+ *  hl:hash_split (n, [seed]): return a table of n hostlists, placing
+ *   each host of hl by a consistent hash of its name.
+ */
+static int l_hostlist_hash_split (lua_State *L)
+{
+    hostlist_t hl = lua_string_to_hostlist (L, 1);
+    int n = (int) luaL_checknumber (L, 2);
+    unsigned long seed = (unsigned long) luaL_optnumber (L, 3, 0);
+
+    luaL_argcheck (L, n > 0, 2, "number of shards must be positive");
+    return push_hostlist_array (L, hostlist_hash_partition (hl, n, seed), n);
+}
+
+/*
+ *  hostlist.hash_shard (host, n, [seed]): return the shard (1 to n)
+ *   which hl:hash_split (n, seed) places host on.
+ */
+static int l_hostlist_hash_shard (lua_State *L)
+{
+    const char *host = luaL_checkstring (L, 1);
+    int n = (int) luaL_checknumber (L, 2);
+    unsigned long seed = (unsigned long) luaL_optnumber (L, 3, 0);
+
+    luaL_argcheck (L, n > 0, 2, "number of shards must be positive");
+    lua_pushnumber (L, hostlist_hash_shard (host, n, seed) + 1);
+    return (1);
+}
+
 
 static int l_hostlist_remove_n (lua_State *L)
 {
@@ -334,6 +811,8 @@ static int l_hostlist_concat (lua_State *L)
     hostlist_t hl = lua_string_to_hostlist (L, 1);
     int i;
     int argc = lua_gettop (L);
+    size_t size = hostlist_memsize (hl);
+    size_t newsize;
 
     for (i = 2; i < argc+1; i++) {
         if (lua_isuserdata (L, i))
@@ -343,31 +822,15 @@ static int l_hostlist_concat (lua_State *L)
     }
 
     /*
-     *  Clean up stack and return original hostlist
+     *  Account for growth of hl, clean up stack and return original
+     *   hostlist
      */
+    if ((newsize = hostlist_memsize (hl)) > size)
+        lua_hostlist_gc_step (L, newsize - size);
     lua_settop (L, 1);
-    lua_gc (L, LUA_GCCOLLECT, 0);
     return (1);
 }
 
-/*
- *  Core function for Intersect and XOR
- */
-static void
-hostlist_push_set_result (hostlist_t r, hostlist_t h1,  hostlist_t h2, int xor)
-{
-    char *host;
-    hostlist_iterator_t i = hostlist_iterator_create (h1);
-
-    while ((host = hostlist_next (i))) {
-        int found = (hostlist_find (h2, host) >= 0);
-        if ((xor && !found) || (!xor && found))
-            hostlist_push_host (r, host);
-        free (host);
-    }
-    hostlist_iterator_destroy (i);
-}
-
 /*
  *  Perform hostlist intersection or xor (symmetric difference)
  *   against the top two hostlist objects on the stack (promoting
@@ -380,25 +843,23 @@ static int l_hostlist_set_op (lua_State *L, int xor)
     int nargs = lua_gettop (L);
 
     /*
-     *  Create hostlist to hold result and push first arg
+     *  Result starts as a copy of the first arg (shares its ranges
+     *   until modified, so this is cheap)
      */
-    r = hostlist_create (NULL);
-    hostlist_push_list (r, lua_string_to_hostlist (L, 1));
+    r = hostlist_copy (lua_string_to_hostlist (L, 1));
 
     /*
      *  Now incrementally build results in r for each arg (2..n)
      */
     for (i = 2; i <= nargs ; i++) {
         hostlist_t hl = lua_string_to_hostlist (L, i);
-        hostlist_t tmp = hostlist_create (NULL);
-
-        hostlist_push_set_result (tmp, r, hl, xor);
+        hostlist_t tmp = xor ? hostlist_xor (r, hl)
+                             : hostlist_intersect (r, hl);
 
-        /*
-         *  For xor we need to also do reverse order
-         */
-        if (xor)
-            hostlist_push_set_result (tmp, hl, r, xor);
+        if (tmp == NULL) {
+            hostlist_destroy (r);
+            return luaL_error (L, "Unable to create hostlist");
+        }
 
         /*
          *   tmp is the new r
@@ -407,12 +868,6 @@ static int l_hostlist_set_op (lua_State *L, int xor)
         r = tmp;
     }
 
-    /*
-     *  Pop everything and collect garbage
-     */
-    lua_pop (L, 0);
-    lua_gc (L, LUA_GCCOLLECT, 0);
-
     /*
      *  Always sort and uniq return hostlist
      */
@@ -445,19 +900,20 @@ static int l_hostlist_del (lua_State *L)
     /*
      *   del = (((hl1 - hl2) - hl3) - ... )
      *
-     *   Start with first list and remove all others
+     *   Start with a copy of the first list and remove all others
      */
-    r = hostlist_create (NULL);
-    hostlist_push_list (r, lua_string_to_hostlist (L, 1));
+    r = hostlist_copy (lua_string_to_hostlist (L, 1));
 
-    for (i = 2; i <= nargs; i++)
-        hostlist_remove_list (r, lua_string_to_hostlist (L, i), 0);
+    for (i = 2; i <= nargs; i++) {
+        hostlist_t tmp = hostlist_difference (r, lua_string_to_hostlist (L, i));
 
-    /*
-     *  Pop everything and return r
-     */
-    lua_pop (L, 0);
-    lua_gc (L, LUA_GCCOLLECT, 0);
+        if (tmp == NULL) {
+            hostlist_destroy (r);
+            return luaL_error (L, "Unable to create hostlist");
+        }
+        hostlist_destroy (r);
+        r = tmp;
+    }
 
     push_hostlist_userdata (L, r);
     return (1);
@@ -469,20 +925,70 @@ static int l_hostlist_union (lua_State *L)
     int i;
     int nargs = lua_gettop (L);
 
+    /*
+     *  union = (((empty + hl1) + hl2) + ... )
+     */
     r = hostlist_create (NULL);
 
-    for (i = 1; i <= nargs; i++)
-        hostlist_push_list (r, lua_string_to_hostlist (L, i));
+    for (i = 1; i <= nargs; i++) {
+        hostlist_t tmp = hostlist_union (r, lua_string_to_hostlist (L, i));
 
-    lua_pop (L, 0);
-    lua_gc (L, LUA_GCCOLLECT, 0);
+        if (tmp == NULL) {
+            hostlist_destroy (r);
+            return luaL_error (L, "Unable to create hostlist");
+        }
+        hostlist_destroy (r);
+        r = tmp;
+    }
 
-    hostlist_uniq (r);
     push_hostlist_userdata (L, r);
 
     return (1);
 }
 
+/*
+ *  hl:union_update (...), hl:intersect_update (...), etc.: as the
+ *   corresponding set operations, but the result replaces the hosts
+ *   of hl (reusing its storage) instead of creating a new hostlist.
+ *   Returns hl.
+ */
+static int l_hostlist_update (lua_State *L,
+                              int (*update) (hostlist_t, hostlist_t))
+{
+    hostlist_t hl = lua_tohostlist (L, 1);
+    size_t size = hostlist_memsize (hl);
+    size_t newsize;
+    int nargs = lua_gettop (L);
+    int i;
+
+    for (i = 2; i <= nargs; i++) {
+        if (!update (hl, lua_string_to_hostlist (L, i)))
+            return luaL_error (L, "hostlist update: %s", strerror (errno));
+    }
+
+    if ((newsize = hostlist_memsize (hl)) > size)
+        lua_hostlist_gc_step (L, newsize - size);
+    lua_settop (L, 1);
+    return (1);
+}
+
+static int l_hostlist_union_update (lua_State *L)
+{
+    return l_hostlist_update (L, hostlist_union_update);
+}
+static int l_hostlist_intersect_update (lua_State *L)
+{
+    return l_hostlist_update (L, hostlist_intersect_update);
+}
+static int l_hostlist_xor_update (lua_State *L)
+{
+    return l_hostlist_update (L, hostlist_xor_update);
+}
+static int l_hostlist_subtract_update (lua_State *L)
+{
+    return l_hostlist_update (L, hostlist_difference_update);
+}
+
 static int l_hostlist_tostring (lua_State *L)
 {
     char buf [4096];
@@ -494,9 +1000,437 @@ static int l_hostlist_tostring (lua_State *L)
     return (1);
 }
 
-static int l_hostlist_strconcat (lua_State *L)
+/*
+ *  hl:write (file, [opts]): write hostlist to a Lua file handle
+ *   without first converting it to a Lua string. opts is an optional
+ *   table which may contain:
+ *
+ *    expand = true   Write every host instead of a bracketed hostlist
+ *    delim  = S      Delimiter to use between hosts (default ",")
+ *
+ *  Returns the number of bytes written, or nil and an error message.
+ */
+static int l_hostlist_write (lua_State *L)
 {
-    const char *s;
+    hostlist_t hl = lua_string_to_hostlist (L, 1);
+    FILE *fp = lua_tofile (L, 2);
+    int mode = HOSTLIST_WRITE_RANGED;
+    const char *delim = NULL;
+    ssize_t n;
+
+    if (lua_istable (L, 3)) {
+        lua_getfield (L, 3, "expand");
+        if (lua_toboolean (L, -1))
+            mode = HOSTLIST_WRITE_EXPANDED;
+        /*
+         *  Leave delim string on the stack so it is not collected
+         */
+        lua_getfield (L, 3, "delim");
+        if (!lua_isnil (L, -1))
+            delim = luaL_checkstring (L, -1);
+    }
+    else if (!lua_isnoneornil (L, 3))
+        return luaL_argerror (L, 3, "expected table of options");
+
+    if ((n = hostlist_fwrite (hl, fp, mode, delim)) < 0) {
+        lua_pushnil (L);
+        lua_pushstring (L, strerror (errno));
+        return (2);
+    }
+    lua_pushnumber (L, n);
+    return (1);
+}
+
+/*
+ *  hl:dump (): return hostlist in the binary format of hostlist_dump()
+ */
+static int l_hostlist_dump (lua_State *L)
+{
+    hostlist_t hl = lua_string_to_hostlist (L, 1);
+    size_t len;
+    void *buf;
+
+    if (!(buf = hostlist_dump (hl, &len)))
+        return luaL_error (L, "hostlist dump: %s", strerror (errno));
+    lua_pushlstring (L, buf, len);
+    free (buf);
+    return (1);
+}
+
+/*
+ *  hostlist.load (s): create a hostlist from the result of hl:dump ().
+ *   Returns nil and an error message if s is not a valid dump.
+ */
+static int l_hostlist_load (lua_State *L)
+{
+    size_t len;
+    const char *s = luaL_checklstring (L, 1, &len);
+    hostlist_t hl;
+
+    if (!(hl = hostlist_load (s, len))) {
+        lua_pushnil (L);
+        lua_pushstring (L, strerror (errno));
+        return (2);
+    }
+    push_hostlist_userdata (L, hl);
+    return (1);
+}
+
+/*
+ *  hostlist.db_write (path, t): write a hostlist database to path
+ *   holding the hostlists (or hostlist strings) in table t, named by
+ *   their keys. Returns true, or nil and an error message.
+ */
+static int l_hostlist_db_write (lua_State *L)
+{
+    const char *path = luaL_checkstring (L, 1);
+    const char **names;
+    hostlist_t *lists;
+    int keep, i, n = 0;
+
+    luaL_checktype (L, 2, LUA_TTABLE);
+
+    lua_pushnil (L);
+    while (lua_next (L, 2)) {
+        if (lua_type (L, -2) != LUA_TSTRING)
+            return luaL_error (L, "hostlist db: list names must be strings");
+        lua_pop (L, 1);
+        n++;
+    }
+
+    /*
+     *  Hostlists created from strings are kept in a table so they
+     *   are not collected before the database is written.
+     */
+    names = lua_newuserdata (L, (n > 0 ? n : 1) * sizeof (*names));
+    lists = lua_newuserdata (L, (n > 0 ? n : 1) * sizeof (*lists));
+    lua_newtable (L);
+    keep = lua_gettop (L);
+
+    i = 0;
+    lua_pushnil (L);
+    while (lua_next (L, 2)) {
+        lists[i] = lua_string_to_hostlist (L, lua_gettop (L));
+        names[i] = lua_tostring (L, -2);
+        lua_rawseti (L, keep, ++i);
+    }
+
+    if (hostlist_db_write (path, n, names, lists) < 0) {
+        lua_pushnil (L);
+        lua_pushstring (L, strerror (errno));
+        return (2);
+    }
+    lua_pushboolean (L, 1);
+    return (1);
+}
+
+static hostlist_db_t *lua_tohostlist_db (lua_State *L, int index)
+{
+    return luaL_checkudata (L, index, "HostlistDB");
+}
+
+static hostlist_db_t lua_check_hostlist_db (lua_State *L, int index)
+{
+    hostlist_db_t *dbp = lua_tohostlist_db (L, index);
+    if (*dbp == NULL)
+        luaL_error (L, "attempt to use a closed hostlist db");
+    return (*dbp);
+}
+
+/*
+ *  hostlist.db_open (path): open a hostlist database written by
+ *   hostlist.db_write(). Returns the db, or nil and an error message.
+ */
+static int l_hostlist_db_open (lua_State *L)
+{
+    const char *path = luaL_checkstring (L, 1);
+    hostlist_db_t *dbp = lua_newuserdata (L, sizeof (*dbp));
+
+    if (!(*dbp = hostlist_db_open (path))) {
+        lua_pushnil (L);
+        lua_pushstring (L, strerror (errno));
+        return (2);
+    }
+    luaL_getmetatable (L, "HostlistDB");
+    lua_setmetatable (L, -2);
+    return (1);
+}
+
+static int l_hostlist_db_close (lua_State *L)
+{
+    hostlist_db_t *dbp = lua_tohostlist_db (L, 1);
+    hostlist_db_close (*dbp);
+    *dbp = NULL;
+    return (0);
+}
+
+/*
+ *  db:get (name): return the named hostlist from db, or nil and an
+ *   error message. The list shares the database image until it is
+ *   first modified.
+ */
+static int l_hostlist_db_get (lua_State *L)
+{
+    hostlist_db_t db = lua_check_hostlist_db (L, 1);
+    hostlist_t frozen, hl;
+
+    if (!(frozen = hostlist_db_get (db, luaL_checkstring (L, 2)))) {
+        lua_pushnil (L);
+        lua_pushstring (L, strerror (errno));
+        return (2);
+    }
+    hl = hostlist_copy (frozen);
+    hostlist_destroy (frozen);
+    if (hl == NULL)
+        return luaL_error (L, "Unable to create hostlist");
+    return push_hostlist_userdata (L, hl);
+}
+
+/*
+ *  db:count (name): number of hosts in the named list, or nil and an
+ *   error message.
+ */
+static int l_hostlist_db_count (lua_State *L)
+{
+    hostlist_db_t db = lua_check_hostlist_db (L, 1);
+    int n = hostlist_db_count (db, luaL_checkstring (L, 2));
+
+    if (n < 0) {
+        lua_pushnil (L);
+        lua_pushstring (L, strerror (errno));
+        return (2);
+    }
+    lua_pushnumber (L, n);
+    return (1);
+}
+
+/*
+ *  db:names (): return a table of the names of all lists in db
+ */
+static int l_hostlist_db_names (lua_State *L)
+{
+    hostlist_db_t db = lua_check_hostlist_db (L, 1);
+    int i, n = hostlist_db_ngroups (db);
+
+    lua_newtable (L);
+    for (i = 0; i < n; i++) {
+        const char *name = hostlist_db_name (db, i);
+        if (name == NULL)
+            return luaL_error (L, "hostlist db: %s", strerror (errno));
+        lua_pushstring (L, name);
+        lua_rawseti (L, -2, i + 1);
+    }
+    return (1);
+}
+
+static int l_hostlist_db_len (lua_State *L)
+{
+    lua_pushnumber (L, hostlist_db_ngroups (lua_check_hostlist_db (L, 1)));
+    return (1);
+}
+
+/*
+ *  Fanout trees: hl:fanout_tree (k) returns a k-ary tree over the
+ *   hosts of hl, which answers parent and children queries for any
+ *   host without expanding the list. hl:fanout (k) returns just the
+ *   hosts at each level of the tree.
+ */
+static hostlist_tree_t lua_check_hostlist_tree (lua_State *L, int index)
+{
+    hostlist_tree_t *tp = luaL_checkudata (L, index, "HostlistTree");
+    if (*tp == NULL)
+        luaL_error (L, "attempt to use a freed hostlist tree");
+    return (*tp);
+}
+
+static hostlist_tree_t lua_hostlist_fanout_tree (lua_State *L)
+{
+    hostlist_t hl = lua_string_to_hostlist (L, 1);
+    int k = (int) luaL_checknumber (L, 2);
+    hostlist_tree_t t;
+
+    luaL_argcheck (L, k > 0, 2, "fanout must be positive");
+    if (!(t = hostlist_fanout_tree (hl, k)))
+        luaL_error (L, "Unable to create hostlist tree: %s", strerror (errno));
+    return (t);
+}
+
+static int l_hostlist_fanout_tree (lua_State *L)
+{
+    hostlist_tree_t *tp = lua_newuserdata (L, sizeof (*tp));
+
+    *tp = NULL;
+    luaL_getmetatable (L, "HostlistTree");
+    lua_setmetatable (L, -2);
+    *tp = lua_hostlist_fanout_tree (L);
+    return (1);
+}
+
+static int l_hostlist_tree_destroy (lua_State *L)
+{
+    hostlist_tree_t *tp = luaL_checkudata (L, 1, "HostlistTree");
+    hostlist_tree_destroy (*tp);
+    *tp = NULL;
+    return (0);
+}
+
+/*
+ *  Return the tree position of the host at index in the stack, given
+ *   as a position (1-based, as for hl[n]) or a hostname.
+ */
+static int lua_hostlist_tree_pos (lua_State *L, hostlist_tree_t t, int index)
+{
+    int pos;
+
+    if (lua_type (L, index) == LUA_TNUMBER)
+        pos = (int) lua_tonumber (L, index) - 1;
+    else
+        pos = hostlist_tree_find (t, luaL_checkstring (L, index));
+    if (pos < 0 || pos >= hostlist_tree_count (t))
+        luaL_argerror (L, index, "host not in tree");
+    return (pos);
+}
+
+/*
+ *  Push a hostlist returned by a tree query, or raise an error
+ */
+static int push_hostlist_tree_result (lua_State *L, hostlist_t hl)
+{
+    if (hl == NULL)
+        return luaL_error (L, "hostlist tree: %s", strerror (errno));
+    return push_hostlist_userdata (L, hl);
+}
+
+/*
+ *  t:parent (host): return the parent host of host and its position,
+ *   or nil for the root of the tree.
+ */
+static int l_hostlist_tree_parent (lua_State *L)
+{
+    hostlist_tree_t t = lua_check_hostlist_tree (L, 1);
+    int parent = hostlist_tree_parent (t, lua_hostlist_tree_pos (L, t, 2));
+    char *host;
+
+    if (parent < 0)
+        return (0);
+    if (!(host = hostlist_tree_host (t, parent)))
+        return luaL_error (L, "hostlist tree: %s", strerror (errno));
+    lua_pushstring (L, host);
+    lua_pushnumber (L, parent + 1);
+    free (host);
+    return (2);
+}
+
+static int l_hostlist_tree_children (lua_State *L)
+{
+    hostlist_tree_t t = lua_check_hostlist_tree (L, 1);
+    int pos = lua_hostlist_tree_pos (L, t, 2);
+    return push_hostlist_tree_result (L, hostlist_tree_children (t, pos));
+}
+
+static int l_hostlist_tree_subtree (lua_State *L)
+{
+    hostlist_tree_t t = lua_check_hostlist_tree (L, 1);
+    int pos = lua_hostlist_tree_pos (L, t, 2);
+    return push_hostlist_tree_result (L, hostlist_tree_subtree (t, pos));
+}
+
+/*
+ *  Push a table of the hostlists at each level of tree t
+ */
+static int push_hostlist_tree_levels (lua_State *L, hostlist_tree_t t)
+{
+    int i, depth = hostlist_tree_depth (t);
+    hostlist_t *levels;
+
+    lua_createtable (L, depth, 0);
+    if (!(levels = hostlist_tree_levels (t)))
+        return luaL_error (L, "hostlist tree: %s", strerror (errno));
+    for (i = 0; i < depth; i++) {
+        push_hostlist_userdata (L, levels[i]);
+        lua_rawseti (L, -2, i + 1);
+    }
+    free (levels);
+    return (1);
+}
+
+static int l_hostlist_tree_levels (lua_State *L)
+{
+    return push_hostlist_tree_levels (L, lua_check_hostlist_tree (L, 1));
+}
+
+static int l_hostlist_tree_depth (lua_State *L)
+{
+    lua_pushnumber (L, hostlist_tree_depth (lua_check_hostlist_tree (L, 1)));
+    return (1);
+}
+
+static int l_hostlist_tree_count (lua_State *L)
+{
+    lua_pushnumber (L, hostlist_tree_count (lua_check_hostlist_tree (L, 1)));
+    return (1);
+}
+
+/*
+ *  hl:fanout (k): return a table of the hostlists at each level of a
+ *   k-ary fanout tree over hl, starting with the root.
+ */
+static int l_hostlist_fanout (lua_State *L)
+{
+    /*  The tree is kept on the stack, so that it is still collected
+     *   if an error is raised */
+    hostlist_tree_t *tp;
+
+    l_hostlist_fanout_tree (L);
+    tp = lua_touserdata (L, -1);
+    push_hostlist_tree_levels (L, *tp);
+    hostlist_tree_destroy (*tp);
+    *tp = NULL;
+    return (1);
+}
+
+/*
+ *  hostlist.cache_size ([n]): set the number of parsed hostlist
+ *   strings to cache (0 disables the cache). Returns the cache size.
+ */
+static int l_hostlist_cache_size (lua_State *L)
+{
+    struct hostlist_cache *c = lua_hostlist_cache (L);
+
+    if (!lua_isnoneornil (L, 1)) {
+        int n = (int) luaL_checknumber (L, 1);
+        if (n < 0)
+            return luaL_argerror (L, 1, "cache size must not be negative");
+        if (cache_resize (c, n) < 0)
+            return luaL_error (L, "hostlist cache: %s", strerror (ENOMEM));
+    }
+    lua_pushnumber (L, c->max);
+    return (1);
+}
+
+/*
+ *  hostlist.cache_stats (): return a table with the number of cache
+ *   hits and misses, and the current and maximum number of entries.
+ */
+static int l_hostlist_cache_stats (lua_State *L)
+{
+    struct hostlist_cache *c = lua_hostlist_cache (L);
+
+    lua_newtable (L);
+    lua_pushnumber (L, c->hits);
+    lua_setfield (L, -2, "hits");
+    lua_pushnumber (L, c->misses);
+    lua_setfield (L, -2, "misses");
+    lua_pushnumber (L, c->n);
+    lua_setfield (L, -2, "size");
+    lua_pushnumber (L, c->max);
+    lua_setfield (L, -2, "max");
+    return (1);
+}
+
+static int l_hostlist_strconcat (lua_State *L)
+{
+    const char *s;
 
     if (lua_isuserdata (L, 1)) {
         /*  Remove string (2nd arg) from stack, leaving hostlist on top:
@@ -582,9 +1516,10 @@ static int l_hostlist_index (lua_State *L)
  */
 static int l_hostlist_map (lua_State *L)
 {
-    char *host;
     hostlist_t hl, r;
     hostlist_iterator_t i;
+    struct host_batch b;
+    int rc;
 
     hl = lua_string_to_hostlist (L, 1);
     if (!lua_isfunction (L, 2))
@@ -595,21 +1530,28 @@ static int l_hostlist_map (lua_State *L)
     r = lua_hostlist_create (L, NULL);
 
     i = hostlist_iterator_create (hl);
-    while ((host = hostlist_next (i))) {
+    host_batch_init (&b, i);
+    for (;;) {
         /*  Copy function to run to top of stack to be consumed by lua_pcall
          */
         lua_pushvalue (L, 2);
 
         /*  Push hostname for arg to fn:
          */
-        lua_pushstring (L, host);
+        if (!lua_push_batch_host (L, &b)) {
+            lua_pop (L, 1);
+            break;
+        }
 
         /*
-         *  Call function and leave 1 result on the stack
+         *  Call function and leave 1 result on the stack. The
+         *   iterator is gone if the function freed the hostlist.
          */
-        if (lua_pcall (L, 1, 1, 0) != 0) {
+        rc = lua_pcall (L, 1, 1, 0);
+        if (lua_hostlist_freed (L, 1))
+            return luaL_error (L, "map: hostlist freed during map");
+        if (rc != 0) {
                 hostlist_iterator_destroy (i);
-                free (host);
                 return luaL_error (L, "map: %s", lua_tostring (L, -1));
         }
 
@@ -619,7 +1561,6 @@ static int l_hostlist_map (lua_State *L)
         if (!lua_isnil (L, -1))
             hostlist_push_host (r, lua_tostring (L, -1));
         lua_pop (L, 1);
-        free (host);
     }
 
     hostlist_iterator_destroy(i);
@@ -638,24 +1579,26 @@ static int l_hostlist_map (lua_State *L)
  */
 static int l_hostlist_expand (lua_State *L)
 {
-    char *host;
     hostlist_t hl;
     hostlist_iterator_t i;
+    struct host_batch b;
     int has_function;
-    int n, t;
+    int n, t, rc;
 
     hl = lua_string_to_hostlist (L, 1);
 
     has_function = lua_isfunction (L, 2);
 
-    /*  Create new table at top of stack to hold results:
+    /*  Create new table at top of stack to hold results. Without a
+     *   function every host is kept, so size the table up front:
      */
-    lua_newtable (L);
+    lua_createtable (L, has_function ? 0 : hostlist_count (hl), 0);
     t = lua_gettop (L);
 
     n = 1;
     i = hostlist_iterator_create (hl);
-    while ((host = hostlist_next (i))) {
+    host_batch_init (&b, i);
+    for (;;) {
         /*  If we have a function to run, copy onto the top of the stack
          *   to be consumed by lua_pcall
          */
@@ -664,14 +1607,20 @@ static int l_hostlist_expand (lua_State *L)
 
         /*  Push hostname, either as value for the table, or arg to fn:
          */
-        lua_pushstring (L, host);
+        if (!lua_push_batch_host (L, &b)) {
+            if (has_function)
+                lua_pop (L, 1);
+            break;
+        }
 
         /*
          *  Call function if needed and leave 1 result on the stack
          */
-        if (has_function && lua_pcall (L, 1, 1, 0) != 0) {
+        rc = has_function ? lua_pcall (L, 1, 1, 0) : 0;
+        if (lua_hostlist_freed (L, 1))
+            return luaL_error (L, "map: hostlist freed during map");
+        if (rc != 0) {
                 hostlist_iterator_destroy (i);
-                free (host);
                 return luaL_error (L, "map: %s", lua_tostring (L, -1));
         }
 
@@ -682,7 +1631,6 @@ static int l_hostlist_expand (lua_State *L)
             lua_pop (L, 1);
         else
             lua_rawseti (L, t, n++);
-        free (host);
     }
 
     hostlist_iterator_destroy(i);
@@ -697,19 +1645,145 @@ static int l_hostlist_expand (lua_State *L)
 
 
 /*
- *  Return a hostlist_iterator_t *  full userdata as hostlist_iterator_t
+ *  Hostlist views: a read-only, table-like proxy for the hosts of a
+ *   hostlist, returned by hl:view(). Hosts are formatted only when
+ *   indexed, so a view of a million hosts costs no more than the
+ *   hostlist itself. The view holds a frozen snapshot of the list,
+ *   indexed for hostlist_nth(), and is not affected by later changes
+ *   to the hostlist it was made from.
+ */
+static hostlist_t lua_tohostlist_view (lua_State *L, int index)
+{
+    hostlist_t *hptr = luaL_checkudata (L, index, "HostlistView");
+    return (*hptr);
+}
+
+static int l_hostlist_view (lua_State *L)
+{
+    hostlist_t hl = lua_string_to_hostlist (L, 1);
+    hostlist_t *hlp;
+
+    hlp = lua_newuserdata (L, sizeof (*hlp));
+    *hlp = NULL;
+    luaL_getmetatable (L, "HostlistView");
+    lua_setmetatable (L, -2);
+
+    if ((*hlp = hostlist_freeze (hl)) == NULL)
+        return luaL_error (L, "Unable to create hostlist view");
+    lua_hostlist_gc_step (L, hostlist_memsize (*hlp));
+
+    return (1);
+}
+
+static int l_hostlist_view_destroy (lua_State *L)
+{
+    hostlist_t *hptr = luaL_checkudata (L, 1, "HostlistView");
+    if (*hptr)
+        hostlist_destroy (*hptr);
+    *hptr = NULL;
+    return (0);
+}
+
+/*
+ *  Push host n (1-based, negative indexes from the end) of hostlist hl,
+ *   or nil if n is out of range.
+ */
+static void lua_push_nth_host (lua_State *L, hostlist_t hl, lua_Number n)
+{
+    int count = hostlist_count (hl);
+    char *host;
+
+    if (n < 0)
+        n += count + 1;
+    if (n < 1 || n > count || n != (int) n) {
+        lua_pushnil (L);
+        return;
+    }
+    if ((host = hostlist_nth (hl, (int) n - 1)) == NULL)
+        luaL_error (L, "hostlist view: %s", strerror (errno));
+    lua_pushstring (L, host);
+    free (host);
+}
+
+static int l_hostlist_view_index (lua_State *L)
+{
+    hostlist_t hl = lua_tohostlist_view (L, 1);
+
+    if (lua_type (L, 2) != LUA_TNUMBER) {
+        lua_pushnil (L);
+        return (1);
+    }
+    lua_push_nth_host (L, hl, lua_tonumber (L, 2));
+    return (1);
+}
+
+static int l_hostlist_view_len (lua_State *L)
+{
+    lua_pushnumber (L, hostlist_count (lua_tohostlist_view (L, 1)));
+    return (1);
+}
+
+static int l_hostlist_view_tostring (lua_State *L)
+{
+    char buf [4096];
+    hostlist_ranged_string (lua_tohostlist_view (L, 1), sizeof (buf), buf);
+    lua_pushstring (L, buf);
+    return (1);
+}
+
+/*
+ *  Stateless iterator for pairs (v) and ipairs (v): returns i+1 and
+ *   host i+1 of the view.
+ */
+static int l_hostlist_view_next (lua_State *L)
+{
+    hostlist_t hl = lua_tohostlist_view (L, 1);
+    lua_Number i = lua_isnil (L, 2) ? 1 : luaL_checknumber (L, 2) + 1;
+
+    if (i > hostlist_count (hl))
+        return (0);
+    lua_pushnumber (L, i);
+    lua_push_nth_host (L, hl, i);
+    return (2);
+}
+
+static int l_hostlist_view_pairs (lua_State *L)
+{
+    lua_tohostlist_view (L, 1);
+    lua_pushcfunction (L, l_hostlist_view_next);
+    lua_pushvalue (L, 1);
+    lua_pushnumber (L, 0);
+    return (3);
+}
+
+/*
+ *  Hostlist iterator userdata. hlp points at the hostlist userdata
+ *   the iterator walks, which is kept alive by the iterator closure,
+ *   so that an iterator over a list released by hl:free() (which also
+ *   destroys its iterators) is not used or destroyed again.
+ */
+struct lua_iterator {
+    hostlist_iterator_t i;
+    hostlist_t *hlp;
+};
+
+/*
+ *  Return a hostlist iterator full userdata as hostlist_iterator_t
  */
 static hostlist_iterator_t lua_tohostlist_iterator (lua_State *L, int index)
 {
-    hostlist_iterator_t *ip = luaL_checkudata (L, index, "HostlistIterator");
-    return (*ip);
+    struct lua_iterator *ip = luaL_checkudata (L, index, "HostlistIterator");
+    if (*ip->hlp == NULL)
+        luaL_error (L, "attempt to use a freed hostlist");
+    return (ip->i);
 }
 
 
 static int l_hostlist_iterator_destroy (lua_State *L)
 {
-    hostlist_iterator_t i = lua_tohostlist_iterator (L, 1);
-    hostlist_iterator_destroy (i);
+    struct lua_iterator *ip = luaL_checkudata (L, 1, "HostlistIterator");
+    if (*ip->hlp != NULL)
+        hostlist_iterator_destroy (ip->i);
     return (0);
 }
 
@@ -718,7 +1792,6 @@ static int l_hostlist_iterator_destroy (lua_State *L)
  */
 static int l_hostlist_iterator (lua_State *L)
 {
-    char *host;
     /*
      *  Get hostlist iterator instance, which is the sole upvalue
      *   for this closure
@@ -729,44 +1802,151 @@ static int l_hostlist_iterator (lua_State *L)
     if (i == NULL)
         return luaL_error (L, "Invalid hostlist iterator");
 
-    host = hostlist_next (i);
-    if (host != NULL) {
-        lua_pushstring (L, host);
-        free (host);
-        return (1);
+    return (lua_push_next_host (L, i));
+}
+
+/*
+ *  Reverse hostlist iterator function (assumed to be a C closure)
+ */
+static int l_hostlist_prev_iterator (lua_State *L)
+{
+    hostlist_iterator_t i = lua_tohostlist_iterator (L, lua_upvalueindex (1));
+    char *host;
+
+    if (i == NULL)
+        return luaL_error (L, "Invalid hostlist iterator");
+
+    if ((host = hostlist_prev (i)) == NULL)
+        return (0);
+    lua_pushstring (L, host);
+    free (host);
+    return (1);
+}
+
+/*
+ *  Seek iterator i over hostlist hl to the starting host given at
+ *   index in the Lua stack, either as a 1-based (or negative, from
+ *   the end) position, or as a hostname. If `prev' is nonzero, seek
+ *   so the next call to hostlist_prev() returns the starting host.
+ */
+static void lua_iterator_seek (lua_State *L, hostlist_iterator_t i,
+                               hostlist_t hl, int index, int prev)
+{
+    int n;
+
+    if (lua_type (L, index) == LUA_TNUMBER) {
+        int count = hostlist_count (hl);
+        n = lua_tointeger (L, index);
+        if (n < 0)
+            n += count + 1;
+        if (n < 1 || n > count)
+            luaL_argerror (L, index, "index out of range");
+        n--;
     }
-    return (0);
+    else if ((n = hostlist_find (hl, luaL_checkstring (L, index))) < 0)
+        luaL_argerror (L, index, "host not found");
+
+    hostlist_iterator_seek (i, prev ? n + 1 : n);
 }
 
 /*
- *  Create a new iterator (as a C closure)
+ *  Create a new iterator (as a C closure), starting at the host
+ *   given by the optional second argument. If `reverse' is nonzero,
+ *   the iterator walks backwards from that host (by default, from
+ *   the end of the list).
  */
-static int l_hostlist_next (lua_State *L)
+static int l_hostlist_iterator_closure (lua_State *L, int reverse)
 {
     hostlist_t hl = lua_tohostlist (L, 1);
-    hostlist_iterator_t *ip;
+    struct lua_iterator *ip;
 
-    lua_pop (L, 1);
+    lua_settop (L, 2);
 
     /*
      *  Push hostlist iterator onto stack top with metatable set
      */
     ip = lua_newuserdata (L, sizeof (*ip));
-    *ip = hostlist_iterator_create (hl);
+    ip->hlp = lua_touserdata (L, 1);
+    if (!(ip->i = hostlist_iterator_create (hl)))
+        return luaL_error (L, "Unable to create hostlist iterator");
     luaL_getmetatable (L, "HostlistIterator");
     lua_setmetatable (L, -2);
 
+    if (!lua_isnil (L, 2))
+        lua_iterator_seek (L, ip->i, hl, 2, reverse);
+    else if (reverse)
+        hostlist_iterator_seek (ip->i, hostlist_count (hl));
 
     /*
      *  Used in for loop, iterator creation function should return:
      *   iterator, state, starting val (nil)
      *    state is nil becuase we are using a closure.
+     *  The hostlist is kept as a second upvalue so it is not collected
+     *   while the iterator is in use.
      */
-    lua_pushcclosure (L, l_hostlist_iterator, 1);
+    lua_pushvalue (L, 1);
+    lua_pushcclosure (L, reverse ? l_hostlist_prev_iterator
+                                 : l_hostlist_iterator, 2);
 
     return (1);
 }
 
+static int l_hostlist_next (lua_State *L)
+{
+    return l_hostlist_iterator_closure (L, 0);
+}
+
+static int l_hostlist_prev (lua_State *L)
+{
+    return l_hostlist_iterator_closure (L, 1);
+}
+
+/*
+ *  Hostlist range iterator function (a C closure with the hostlist
+ *   and the index of the next range as upvalues). Returns prefix,
+ *   lo, hi, width for each range, with lo, hi and width nil for a
+ *   single host without a numeric suffix.
+ */
+static int l_hostlist_range_iterator (lua_State *L)
+{
+    hostlist_t hl = lua_tohostlist (L, lua_upvalueindex (1));
+    int n = lua_tointeger (L, lua_upvalueindex (2));
+    const char *prefix;
+    unsigned long lo, hi;
+    int width;
+
+    if (hostlist_get_range (hl, n, &prefix, &lo, &hi, &width) < 0)
+        return (0);
+
+    lua_pushinteger (L, n + 1);
+    lua_replace (L, lua_upvalueindex (2));
+
+    lua_pushstring (L, prefix);
+    if (width < 0) {
+        lua_pushnil (L);
+        lua_pushnil (L);
+        lua_pushnil (L);
+    }
+    else {
+        lua_pushinteger (L, lo);
+        lua_pushinteger (L, hi);
+        lua_pushinteger (L, width);
+    }
+    return (4);
+}
+
+/*
+ *  Create a new range iterator (as a C closure)
+ */
+static int l_hostlist_ranges (lua_State *L)
+{
+    lua_string_to_hostlist (L, 1);
+    lua_settop (L, 1);
+    lua_pushinteger (L, 0);
+    lua_pushcclosure (L, l_hostlist_range_iterator, 2);
+    return (1);
+}
+
 /*############################################################################
  *
  *  Hostlist interface definitions and initialization:
@@ -785,8 +1965,24 @@ static const struct luaL_Reg hostlist_functions [] = {
     { "nth",        l_hostlist_nth       },
     { "pop",        l_hostlist_pop       },
     { "concat",     l_hostlist_concat    },
+    { "slice",      l_hostlist_slice     },
+    { "split",      l_hostlist_split     },
+    { "chunks",     l_hostlist_chunks    },
+    { "hash_split", l_hostlist_hash_split },
+    { "hash_shard", l_hostlist_hash_shard },
     { "find",       l_hostlist_find      },
     { "count",      l_hostlist_count     },
+    { "write",      l_hostlist_write     },
+    { "ranges",     l_hostlist_ranges    },
+    { "view",       l_hostlist_view      },
+    { "fanout",     l_hostlist_fanout    },
+    { "fanout_tree", l_hostlist_fanout_tree },
+    { "dump",       l_hostlist_dump      },
+    { "load",       l_hostlist_load      },
+    { "db_write",   l_hostlist_db_write  },
+    { "db_open",    l_hostlist_db_open   },
+    { "cache_size", l_hostlist_cache_size },
+    { "cache_stats", l_hostlist_cache_stats },
     { NULL,         NULL                 }
 };
 
@@ -800,17 +1996,35 @@ static const struct luaL_Reg hostlist_methods [] = {
     { "__pow",      l_hostlist_xor       },
     { "__sub",      l_hostlist_del       },
     { "__gc",       l_hostlist_destroy   },
+    { "__close",    l_hostlist_destroy   },
+    { "free",       l_hostlist_destroy   },
     { "count",      l_hostlist_count     },
     { "delete",     l_hostlist_remove    },
     { "delete_n",   l_hostlist_remove_n  },
     { "concat",     l_hostlist_concat    },
+    { "union_update",     l_hostlist_union_update     },
+    { "intersect_update", l_hostlist_intersect_update },
+    { "xor_update",       l_hostlist_xor_update       },
+    { "subtract_update",  l_hostlist_subtract_update  },
     { "uniq",       l_hostlist_uniq      },
     { "sort",       l_hostlist_sort      },
     { "next",       l_hostlist_next      },
+    { "prev",       l_hostlist_prev      },
     { "map",        l_hostlist_map       },
     { "expand",     l_hostlist_expand    },
     { "pop",        l_hostlist_pop       },
+    { "slice",      l_hostlist_slice     },
+    { "truncate",   l_hostlist_truncate  },
+    { "split",      l_hostlist_split     },
+    { "chunks",     l_hostlist_chunks    },
+    { "hash_split", l_hostlist_hash_split },
     { "find",       l_hostlist_find      },
+    { "write",      l_hostlist_write     },
+    { "ranges",     l_hostlist_ranges    },
+    { "view",       l_hostlist_view      },
+    { "fanout",     l_hostlist_fanout    },
+    { "fanout_tree", l_hostlist_fanout_tree },
+    { "dump",       l_hostlist_dump      },
     { NULL,         NULL                 }
 };
 
@@ -824,6 +2038,38 @@ static const struct luaL_Reg hostlist_iterator_methods [] = {
     { NULL,         NULL                          }
 };
 
+static const struct luaL_Reg hostlist_view_methods [] = {
+    { "__gc",       l_hostlist_view_destroy  },
+    { "__index",    l_hostlist_view_index    },
+    { "__len",      l_hostlist_view_len      },
+    { "__tostring", l_hostlist_view_tostring },
+    { "__pairs",    l_hostlist_view_pairs    },
+    { "__ipairs",   l_hostlist_view_pairs    },
+    { NULL,         NULL                     }
+};
+
+static const struct luaL_Reg hostlist_tree_methods [] = {
+    { "__gc",       l_hostlist_tree_destroy  },
+    { "__len",      l_hostlist_tree_count    },
+    { "free",       l_hostlist_tree_destroy  },
+    { "depth",      l_hostlist_tree_depth    },
+    { "levels",     l_hostlist_tree_levels   },
+    { "parent",     l_hostlist_tree_parent   },
+    { "children",   l_hostlist_tree_children },
+    { "subtree",    l_hostlist_tree_subtree  },
+    { NULL,         NULL                     }
+};
+
+static const struct luaL_Reg hostlist_db_methods [] = {
+    { "__gc",       l_hostlist_db_close  },
+    { "__len",      l_hostlist_db_len    },
+    { "close",      l_hostlist_db_close  },
+    { "get",        l_hostlist_db_get    },
+    { "count",      l_hostlist_db_count  },
+    { "names",      l_hostlist_db_names  },
+    { NULL,         NULL                 }
+};
+
 
 #if !defined LUA_VERSION_NUM || LUA_VERSION_NUM==501
 /*
@@ -852,6 +2098,23 @@ int luaopen_hostlist (lua_State *L)
     luaL_newmetatable (L, "HostlistIterator");
     luaL_setfuncs (L, hostlist_iterator_methods, 0);
 
+    luaL_newmetatable (L, "HostlistCache");
+    lua_pushcfunction (L, l_hostlist_cache_destroy);
+    lua_setfield (L, -2, "__gc");
+
+    luaL_newmetatable (L, "HostlistView");
+    luaL_setfuncs (L, hostlist_view_methods, 0);
+
+    luaL_newmetatable (L, "HostlistTree");
+    luaL_setfuncs (L, hostlist_tree_methods, 0);
+    lua_pushvalue (L, -1);
+    lua_setfield (L, -2, "__index");
+
+    luaL_newmetatable (L, "HostlistDB");
+    luaL_setfuncs (L, hostlist_db_methods, 0);
+    lua_pushvalue (L, -1);
+    lua_setfield (L, -2, "__index");
+
     /*  Register hostlist public table functions: */
     lua_newtable (L);
     luaL_setfuncs (L, hostlist_functions, 0);
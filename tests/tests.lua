@@ -48,6 +48,8 @@ TestHostlist = {
 		["foo[0-4]-eth2"] =  "foo0-eth2,foo1-eth2,foo2-eth2,foo3-eth2,foo4-eth2",
 		["foo1,foo1,foo1"] = "foo1,foo1,foo1",
 		["[00-02]"] = "00,01,02",
+		["foo[8-11]"] =      "foo8,foo9,foo10,foo11",
+		["foo[098-101]"] =   "foo098,foo099,foo100,foo101",
 	},
 
 	counts = {
@@ -84,12 +86,22 @@ TestHostlist = {
 	subtract = {
 		{ hl ="foo[1-10]",  del = "foo[7,10]",  result = "foo[1-6,8-9]" },
 		{ hl="foo[1,2,1]",  del = "foo1",       result = "foo2"         },
+		{ hl="b[1-3],a[1-10000],b1", del = "a[2-9999],b[1-2]",
+		                               result = "b3,a[1,10000]" },
 	},
 
 	uniq = {
 		["foo[1,2,1,2,1,1]"] = "foo[1-2]",
 	},
 
+	sort = {
+		["foo[5-9],bar,foo[1-4]"] =    "bar,foo[1-9]",
+		["n[3-7],n[1-5]"] =            "n[1-3,3-4,4-5,5-7]",
+		["n[1-3],n2"] =                "n[1-2,2-3]",
+		["a[4-14],a[9-41],a[05-30]"] =
+		  "a[4-9,9-10,10-11,11-12,12-13,13-14,14-41,05-30]",
+	},
+
 	map = {
 		{ hl="foo1,bar",   fn = 's:match("[^%d]$") and s', result = "bar" },
 		-- Return only hosts divisible by 10
@@ -99,19 +111,27 @@ TestHostlist = {
 
 	xor = {
 		{ hl = "foo[1-100]", arg = "foo[2-101]", result = "foo[1,101]" },
+		{ hl = "a[1-10000],b[01-10]", arg = "b[05-20],a[2-10000]",
+		                               result = "a1,b[01-04,11-20]" },
 	},
 
 	intersect = {
 		{ hl = "foo[1-100]", arg = "foo[2-101]", result = "foo[2-100]" },
 		{ hl = "[0-5]",      arg = "4",          result = "4" },
+		{ hl = "n[8-12],m[1-5]", arg = "n[1-9],n10,m[005-009]",
+		                               result = "n[8-10]" },
+		{ hl = "n[1-10000]", arg = "n[9999-20000]",
+		                               result = "n[9999-10000]" },
 	},
 
 	union = {
 		{ hl= { "16", "25" },	result="[16,25]" },
+		{ hl= { "n0[15-17]", "n[015-016]" },	result="n[015-017]" },
+		{ hl= { "n0[15-17],n[015-016]" },	result="n[015-017]" },
 	},
 
 	next = {
-		"foo[1-50]", "", "foo[1,1,1]",
+		"foo[1-50]", "", "foo[1,1,1]", string.rep ("x", 2000) .. "[1-3]",
 	},
 
 	pop = {
@@ -120,6 +140,18 @@ TestHostlist = {
 		{ hl="foo[1-10]", pop=-3, result="foo[4-10]" },
 	},
 
+	slice = {
+		{ hl="foo[1-10]",            i=1,  j=3,   result="foo[1-3]" },
+		{ hl="foo[1-10]",            i=-3, j=nil, result="foo[8-10]" },
+		{ hl="foo[1-10]",            i=4,  j=-4,  result="foo[4-7]" },
+		{ hl="foo[1-10]",            i=0,  j=100, result="foo[1-10]" },
+		{ hl="foo[1-10]",            i=5,  j=4,   result="" },
+		{ hl="foo[1-10]",            i=11, j=nil, result="" },
+		{ hl="foo[1-5],bar,baz[07-09]", i=3, j=7, result="foo[3-5],bar,baz07" },
+		{ hl="foo[1-5],bar,baz[07-09]", i=6, j=6, result="bar" },
+		{ hl="foo[1-5,3-4]",        i=5,  j=6,   result="foo[5,3]" },
+	},
+
 	find = {
 		{ hl="foo[1-10]",       host="foo3",        result=3   }, 
 		{ hl="foo[1-10]",       host="foo11",       result=nil }, 
@@ -162,6 +194,53 @@ function test_hostlist_next()
 	end
 end
 
+function test_next_seek()
+	local h = hostlist.new ("foo[1-10],bar,baz[01-05]")
+	local function collect (iter)
+		local t = {}
+		for host in iter do table.insert (t, host) end
+		return table.concat (t, ",")
+	end
+	assert_equal ("baz03,baz04,baz05", collect (h:next (14)))
+	assert_equal ("baz04,baz05", collect (h:next (-2)))
+	assert_equal ("bar,baz01,baz02,baz03,baz04,baz05", collect (h:next ("bar")))
+	local r = h:expand()
+	for i = 1, math.floor (#r / 2) do r[i], r[#r-i+1] = r[#r-i+1], r[i] end
+	assert_equal (table.concat (r, ","), collect (h:prev ()))
+	assert_equal ("foo3,foo2,foo1", collect (h:prev ("foo3")))
+	assert_equal ("foo1", collect (h:prev (1)))
+	assert_error (function () h:next ("nothere") end)
+	assert_error (function () h:next (17) end)
+end
+
+function test_next_modify()
+	local h = hostlist.new ("foo[1-10]")
+	local seen = {}
+	for host in h:next() do
+		table.insert (seen, host)
+		if host == "foo3" then h:delete ("foo1", "foo3", "foo5") end
+	end
+	assert_equal ("foo1,foo2,foo3,foo4,foo6,foo7,foo8,foo9,foo10",
+	              table.concat (seen, ","))
+	assert_equal ("foo[2,4,6-10]", tostring (h))
+end
+
+function test_ranges()
+	local h = hostlist.new ("foo[1-3,5],bar[008-010],baz,[7-9]x")
+	local t = {}
+	for prefix, lo, hi, width in h:ranges() do
+		table.insert (t, table.concat ({ prefix, tostring (lo),
+		                                 tostring (hi), tostring (width) },
+		                               ":"))
+	end
+	assert_equal ("foo:1:3:1,foo:5:5:1,bar:8:10:3,baz:nil:nil:nil,"..
+	              "7x:nil:nil:nil,8x:nil:nil:nil,9x:nil:nil:nil",
+	              table.concat (t, ","))
+	local n = 0
+	for prefix, lo, hi in hostlist.ranges ("") do n = n + 1 end
+	assert_equal (0, n)
+end
+
 function test_uniq ()
 	for s,r in pairs (TestHostlist.uniq) do
 		local h = hostlist.new (s)
@@ -170,6 +249,16 @@ function test_uniq ()
 	end
 end
 
+function test_sort ()
+	for s,r in pairs (TestHostlist.sort) do
+		local h = hostlist.new (s)
+		local n = #h
+		assert_userdata (h)
+		assert_equal (r, tostring (h:sort()))
+		assert_equal (n, #h)
+	end
+end
+
 function test_expand()
 	for s,r in pairs (TestHostlist.expand) do
 		local h = hostlist.new (s)
@@ -178,6 +267,252 @@ function test_expand()
 	end
 end
 
+function test_write()
+	for s,r in pairs (TestHostlist.expand) do
+		local h = hostlist.new (s)
+		local f = io.tmpfile ()
+		assert_equal (#r, h:write (f, { expand = true }))
+		assert_equal (tostring (h):len(), h:write (f))
+		f:seek ("set")
+		assert_equal (r .. tostring (h), f:read ("*a"))
+		f:close ()
+	end
+	local f = io.tmpfile ()
+	hostlist.write ("foo[1-3],bar", f, { expand = true, delim = "\n" })
+	f:seek ("set")
+	assert_equal ("foo1\nfoo2\nfoo3\nbar", f:read ("*a"))
+	f:close ()
+end
+
+function test_dump()
+	for s,r in pairs (TestHostlist.expand) do
+		local h = hostlist.new (s)
+		local l = hostlist.load (h:dump())
+		assert_equal (tostring (h), tostring (l))
+		assert_equal (#h, #l)
+	end
+	local h = hostlist.new ("b[5-9],a[001-010],b[1-3],x,b2,a[7-8]")
+	assert_equal (tostring (h), tostring (hostlist.load (h:dump())))
+	assert_equal ("foo[1-3]", tostring (hostlist.load (hostlist.dump ("foo[1-3]"))))
+	assert_equal (0, #hostlist.load (hostlist.new ():dump()))
+	assert_nil (hostlist.load ("not a hostlist"))
+	assert_nil (hostlist.load (h:dump():sub (1, -2)))
+
+	-- hand made dumps of one prefix and one range
+	local function varint (v)
+		local s = ""
+		while v >= 128 do
+			s = s .. string.char (v % 128 + 128)
+			v = math.floor (v / 128)
+		end
+		return s .. string.char (v)
+	end
+	local function dump (prefix, ...)
+		local s = "HL\1\1" .. varint (#prefix) .. prefix .. "\1"
+		for _,v in ipairs {...} do
+			s = s .. varint (v)
+		end
+		return s
+	end
+	assert_equal ("n[5-7]", tostring (hostlist.load (dump ("n", 0, 1, 5, 2))))
+	assert_equal ("n33554432", tostring (hostlist.load (dump ("n", 0, 1, 2^25, 0))))
+	assert_nil (hostlist.load (dump ("n", 0, 1, 2^25, 1)))
+	assert_equal ("n1[2-3]", tostring (hostlist.load (dump ("n1", 0, 1, 2, 1))))
+	assert_equal ("x", tostring (hostlist.load (dump ("x", 1))))
+end
+
+function test_db()
+	local path = os.tmpname ()
+	local groups = {
+		compute = "n[1-1000]",
+		bmc     = hostlist.new ("n[1-1000]-bmc,mgmt"),
+		empty   = "",
+	}
+	assert_true (hostlist.db_write (path, groups))
+	local db = hostlist.db_open (path)
+	assert_not_nil (db)
+	assert_equal (3, #db)
+	assert_equal ("bmc,compute,empty", table.concat (db:names(), ","))
+	assert_equal (1000, db:count ("compute"))
+	assert_equal ("n[1-1000]", tostring (db:get ("compute")))
+	assert_equal (tostring (groups.bmc), tostring (db:get ("bmc")))
+	assert_equal (0, #db:get ("empty"))
+	assert_nil (db:get ("nosuchgroup"))
+
+	--  Lists from the db may be modified, and outlive it
+	local h = db:get ("compute")
+	db:close ()
+	h:delete ("n[2-999]")
+	assert_equal ("n[1,1000]", tostring (h))
+	os.remove (path)
+
+	assert_nil (hostlist.db_open (path))
+end
+
+function test_cache()
+	local size = hostlist.cache_size ()
+	--  Start empty, strings may be cached by other tests
+	hostlist.cache_size (0)
+	assert_equal (4, hostlist.cache_size (4))
+	local s0 = hostlist.cache_stats ()
+	assert_equal (4, s0.max)
+	for i = 1, 10 do
+		assert_equal (4, hostlist.find ("foo[1-10]", "foo4"))
+	end
+	local s1 = hostlist.cache_stats ()
+	assert_equal (s0.misses + 1, s1.misses)
+	assert_equal (s0.hits + 9, s1.hits)
+
+	--  Modifying a list made from a cached string leaves the cache alone
+	local h = hostlist.delete ("foo[1-10]", "foo[2-9]")
+	assert_equal ("foo[1,10]", tostring (h))
+	assert_equal (10, hostlist.count ("foo[1-10]"))
+
+	--  Least recently used strings are dropped
+	for i = 1, 8 do hostlist.count ("bar"..i) end
+	assert_equal (4, hostlist.cache_stats ().size)
+
+	assert_equal (0, hostlist.cache_size (0))
+	assert_equal (0, hostlist.cache_stats ().size)
+	assert_equal (10, hostlist.count ("foo[1-10]"))
+	assert_equal (s1.hits + 2, hostlist.cache_stats ().hits)
+	hostlist.cache_size (size)
+end
+
+function test_free()
+	local h = hostlist.new ("foo[1-100]")
+	local it = h:next()
+	assert_equal ("foo1", it())
+	h:free ()
+	assert_error (function () return #h end)
+	assert_error (function () return tostring (h) end)
+	assert_error (function () return it() end)
+	h:free ()
+
+	h = hostlist.new ("foo[1-10]")
+	assert_error (function () h:map (function (s) h:free () end) end)
+
+	if _VERSION >= "Lua 5.4" then
+		local f = load ([[
+			local hostlist = ...
+			local h <close> = hostlist.new ("foo[1-10]")
+			return h
+		]])
+		h = f (hostlist)
+		assert_error (function () return #h end)
+	end
+end
+
+function test_update()
+	local h = hostlist.new ("foo[1-10]")
+	assert_equal (h, h:intersect_update ("foo[5-20]"))
+	assert_equal ("foo[5-10]", tostring (h))
+	h:union_update ("foo[1-3]", hostlist.new ("bar1"))
+	assert_equal ("bar1,foo[1-3,5-10]", tostring (h))
+	h:subtract_update ("foo[2-6]", "bar1")
+	assert_equal ("foo[1,7-10]", tostring (h))
+	h:xor_update ("foo[9-12]")
+	assert_equal ("foo[1,7-8,11-12]", tostring (h))
+	assert_equal (5, #h)
+	h:xor_update (h)
+	assert_equal (0, #h)
+
+	--  Strings given as arguments are not modified in the cache
+	local s = "foo[1-5]"
+	h = hostlist.new (s)
+	h:subtract_update ("foo3")
+	assert_equal ("foo[1-2,4-5]", tostring (h))
+	assert_equal ("foo[1-5]", tostring (hostlist.new (s)))
+
+	--  Hosts written with different prefixes are not kept twice
+	h = hostlist.new ("n0[15-17]")
+	h:union_update ("n[015-016]")
+	assert_equal ("n[015-017]", tostring (h))
+	assert_equal (3, #h)
+
+	--  Results match the operators which build a new hostlist
+	local a, b = "n[1-40],m[3-9],n[50-60]", "n[30-55],m7,x"
+	for _,op in ipairs { {"union_update", "__add"},
+	                     {"intersect_update", "__mul"},
+	                     {"xor_update", "__pow"},
+	                     {"subtract_update", "__sub"} } do
+		local r = hostlist.new (a)
+		local mt = getmetatable (r)
+		assert_equal (tostring (mt[op[2]] (r, b)), tostring (r[op[1]] (r, b)))
+	end
+
+	--  Suffixes too long to be handled as spans
+	h = hostlist.new ("n9999999[1-2]")
+	h:subtract_update ("n1")
+	assert_equal ("n9999999[1-2]", tostring (h))
+	h:union_update ("m1")
+	assert_equal ("m1,n9999999[1-2]", tostring (h))
+	h:intersect_update ("m[1-2]")
+	assert_equal ("m1", tostring (h))
+	a, b = "n9999999[1-5],m[1-3]", "n99999993,m2,x"
+	for _,op in ipairs { {"union_update", "__add"},
+	                     {"intersect_update", "__mul"},
+	                     {"xor_update", "__pow"},
+	                     {"subtract_update", "__sub"} } do
+		local r = hostlist.new (a)
+		local mt = getmetatable (r)
+		assert_equal (tostring (mt[op[2]] (r, b)), tostring (r[op[1]] (r, b)))
+	end
+end
+
+function test_view()
+	local h = hostlist.new ("foo[1-10],bar[01-05]")
+	local v = h:view()
+	assert_equal (15, #v)
+	assert_equal ("foo1", v[1])
+	assert_equal ("bar05", v[15])
+	assert_equal ("bar05", v[-1])
+	assert_nil (v[0])
+	assert_nil (v[16])
+	assert_nil (v.foo)
+	assert_equal (tostring (h), tostring (v))
+
+	--  The view is a snapshot and does not change with h
+	h:delete ("foo[1-5]")
+	assert_equal ("foo1", v[1])
+	assert_equal (15, #v)
+
+	local t = {}
+	for i = 1, #v do t[i] = v[i] end
+	assert_equal (table.concat (hostlist.expand ("foo[1-10],bar[01-05]"), ","),
+	              table.concat (t, ","))
+
+	if _VERSION >= "Lua 5.2" then
+		local n = 0
+		for i, host in pairs (v) do
+			n = n + 1
+			assert_equal (n, i)
+			assert_equal (t[i], host)
+		end
+		assert_equal (15, n)
+		n = 0
+		for i, host in ipairs (v) do n = n + 1 end
+		assert_equal (15, n)
+	end
+
+	v = hostlist.view ("m[1-10000],n[1-10000]")
+	assert_equal (20000, #v)
+	assert_equal ("n5000", v[15000])
+end
+
+function test_expand_large()
+	local long = string.rep ("x", 1000)
+	local h = hostlist.new ("foo[1-1000],"..long.."[1-20],bar[00001-00500]")
+	local t = h:expand()
+	assert_equal (#h, #t)
+	for i = 1, #h, 37 do
+		assert_equal (h[i], t[i])
+	end
+	assert_equal (long .. "1", t[1001])
+	assert_equal ("bar00500", t[#t])
+	assert_equal (#h, #hostlist.map (h, function (s) return s end))
+end
+
 function test_to_string()
 	for s,r in pairs (TestHostlist.to_string) do
 		local h = hostlist.new (s)
@@ -245,6 +580,116 @@ function test_pop()
 	end
 end
 
+function test_slice()
+	for _,t in pairs (TestHostlist.slice) do
+		local hl = hostlist.new (t.hl)
+		assert_equal (t.result, tostring (hl:slice (t.i, t.j)))
+		assert_equal (t.hl, tostring (hl))
+		assert_equal (hl, hl:truncate (t.i, t.j))
+		assert_equal (t.result, tostring (hl))
+	end
+	assert_equal ("foo[2-3]", tostring (hostlist.slice ("foo[1-5]", 2, 3)))
+end
+
+function test_split()
+	local hl = hostlist.new ("foo[1-5],bar,baz[01-04]")
+	local t = hl:split (3)
+	assert_equal (3, #t)
+	assert_equal ("foo[1-4]", tostring (t[1]))
+	assert_equal ("foo5,bar,baz01", tostring (t[2]))
+	assert_equal ("baz[02-04]", tostring (t[3]))
+
+	t = hl:split (20)
+	assert_equal (20, #t)
+	assert_equal ("foo1", tostring (t[1]))
+	assert_equal ("", tostring (t[20]))
+
+	t = hostlist.split ("n[1-100]", 7)
+	for i = 1, 7 do
+		assert_true (#t[i] == 14 or #t[i] == 15)
+	end
+	assert_equal ("n[1-15]", tostring (t[1]))
+	assert_equal ("n[87-100]", tostring (t[7]))
+
+	t = hl:chunks (4)
+	assert_equal (3, #t)
+	assert_equal ("foo[1-4]", tostring (t[1]))
+	assert_equal ("baz[03-04]", tostring (t[3]))
+	assert_equal (0, #hostlist.new():chunks (4))
+
+	assert_error (function () hl:split (0) end)
+	assert_error (function () hl:chunks (-1) end)
+end
+
+function test_hash_split()
+	local hl = hostlist.new ("n[1-500],m[001-300],x,n1-eth0,q[1-3]-eth0")
+	local t = hl:hash_split (5)
+	assert_equal (5, #t)
+	local total = 0
+	for i = 1, 5 do
+		total = total + #t[i]
+		for host in t[i]:next() do
+			assert_equal (i, hostlist.hash_shard (host, 5))
+		end
+	end
+	assert_equal (#hl, total)
+
+	--  Placement depends on the hostname only, not on the hostlist
+	local s = hostlist.hash_shard ("n17", 5)
+	assert_not_nil (t[s]:find ("n17"))
+	assert_equal ("n17", tostring (hostlist.new ("n17"):hash_split (5)[s]))
+
+	--  Adjacent hosts from different ranges are joined in a shard
+	local t3 = hostlist.new ("c[1-3],x,c[4-6],y,c[7-9],z,c[10-12]")
+	t3 = t3:hash_split (3)
+	for i = 1, 3 do
+		local s = tostring (t3[i])
+		assert_equal (tostring (hostlist.new (s)), s)
+	end
+
+	--  Adding a shard only moves hosts onto the new shard
+	local t6 = hl:hash_split (6)
+	for i = 1, 5 do
+		assert_equal (0, #(t6[i] - t[i]))
+	end
+
+	--  The seed changes placement
+	local same = true
+	local t7 = hl:hash_split (5, 7)
+	for i = 1, 5 do
+		if tostring (t7[i]) ~= tostring (t[i]) then same = false end
+	end
+	assert_false (same)
+	assert_error (function () hl:hash_split (0) end)
+end
+
+function test_fanout()
+	local levels = hostlist.fanout ("n[0-20]", 4)
+	assert_equal (3, #levels)
+	assert_equal ("n0", tostring (levels[1]))
+	assert_equal ("n[1-4]", tostring (levels[2]))
+	assert_equal ("n[5-20]", tostring (levels[3]))
+
+	local t = hostlist.new ("a,n[1-30]"):fanout_tree (2)
+	assert_equal (31, #t)
+	assert_equal (5, t:depth())
+	assert_equal ("a,n[1-2]", tostring (t:levels()[1] + t:levels()[2]))
+	assert_equal ("n[15-30]", tostring (t:levels()[5]))
+	assert_nil (t:parent ("a"))
+	assert_equal ("a", t:parent (3))
+	local host, pos = t:parent ("n8")
+	assert_equal ("n3", host)
+	assert_equal (4, pos)
+	assert_equal ("n[7-8]", tostring (t:children ("n3")))
+	assert_equal ("n[3,7-8,15-18]", tostring (t:subtree ("n3")))
+	assert_equal ("", tostring (t:children ("n30")))
+	assert_error (function () t:children ("foo") end)
+	assert_error (function () t:parent (32) end)
+
+	assert_equal (0, #hostlist.fanout ("", 8))
+	assert_error (function () hostlist.fanout ("n[1-3]", 0) end)
+end
+
 function test_xor()
 	for _,t in pairs (TestHostlist.xor) do
 		local h = hostlist.xor (t.hl, t.arg)
@@ -279,6 +724,22 @@ function test_subtract()
 	end
 end
 
+function test_set_op_operands()
+	local h = hostlist.new ("n[1-10],x")
+	local d = h - "n[3-4]"
+	local u = h + "y"
+	local i = h * "n[5-20]"
+	d:pop()
+	u:delete ("n1")
+	assert_equal ("n[1-10],x", tostring (h))
+	assert_equal ("n[1-2,5-10]", tostring (d))
+	assert_equal ("n[2-10],x,y", tostring (u))
+	assert_equal ("n[5-10]", tostring (i))
+	h:delete ("n[1-9]")
+	assert_equal ("n10,x", tostring (h))
+	assert_equal ("n[5-10]", tostring (i))
+end
+
 function test_find()
 	for _,t in pairs (TestHostlist.find) do
 		assert_equal (t.result, hostlist.find (t.hl, t.host))